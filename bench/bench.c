@@ -0,0 +1,327 @@
+
+/*********************************************
+ *   nerv kernel and training benchmark suite
+ * ******************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <nerv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Usage: nerv_bench [-json] [-t threads] [output]
+
+Every benchmark repeats its operation until BENCH_SECONDS have passed and
+records one row of benchmark, shape, value, unit and heap allocations per
+iteration. Rows are written as CSV, or JSON with -json, to output or to
+stdout, so runs from two releases can be diffed directly. */
+
+#define BENCH_SECONDS 0.25
+#define BENCH_FILE "nerv_bench.model"
+
+typedef struct {
+    FILE* file;
+    int json, rows;
+} Report;
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+static void report(Report* r, const char* name, const char* shape, double value, const char* unit, double allocs)
+{
+    if (r->json) {
+        fprintf(r->file, "%s\n    {\"benchmark\": \"%s\", \"shape\": \"%s\", \"value\": %.6g, \"unit\": \"%s\", \"allocs\": %.6g}",
+            r->rows ? "," : "", name, shape, value, unit, allocs);
+    } else {
+        fprintf(r->file, "%s,%s,%.6g,%s,%.6g\n", name, shape, value, unit, allocs);
+    }
+    r->rows++;
+}
+
+/* Runs op(arg) until the time budget is spent and returns seconds per
+call, storing heap allocations per call in allocs. */
+
+static double bench_run(void (*op)(void*), void* arg, double* allocs)
+{
+    op(arg);
+    
+    long n = 0;
+    size_t count = nerv_alloc_count();
+    double start = now(), elapsed;
+    do {
+        op(arg);
+        n++;
+        elapsed = now() - start;
+    } while (elapsed < BENCH_SECONDS);
+
+    *allocs = (double)(nerv_alloc_count() - count) / (double)n;
+    return elapsed / (double)n;
+}
+
+/* model_save and model_load report to stdout, which may also carry the
+results, so their messages are discarded while they are timed. */
+
+static int quiet(int fd)
+{
+    fflush(stdout);
+    if (fd >= 0) {
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+        return -1;
+    }
+
+    int saved = dup(STDOUT_FILENO), null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+    return saved;
+}
+
+static void fill(float* f, int size)
+{
+    for (int i = 0; i < size; i++) {
+        f[i] = (float)rand_norm() - 0.5f;
+    }
+}
+
+/*------------------------------------------*/
+
+/*              KERNEL BENCHMARKS           */
+
+/*------------------------------------------*/
+
+typedef struct {
+    Mat a, b, c;
+    Vec x, y;
+} Kernel;
+
+static void op_gemv(void* arg)
+{
+    Kernel* k = (Kernel*)arg;
+    vector_by_matrix_into(&k->y, &k->a, &k->x);
+}
+
+static void op_gemm(void* arg)
+{
+    Kernel* k = (Kernel*)arg;
+    matrix_multiply_into(&k->c, &k->a, &k->b);
+}
+
+static void bench_kernels(Report* r)
+{
+    static const int gemv_sizes[] = {64, 256, 1024, 4096};
+    static const int gemm_sizes[] = {64, 128, 256, 512, 1024};
+    char shape[64];
+    double allocs;
+
+    for (size_t i = 0; i < sizeof(gemv_sizes) / sizeof(int); i++) {
+        int n = gemv_sizes[i];
+        Kernel k;
+        k.a = matrix(n, n);
+        k.x = vector(n);
+        k.y = vector(n);
+        fill(k.a.data, n * n);
+        fill(k.x.data, n);
+
+        double t = bench_run(op_gemv, &k, &allocs);
+        sprintf(shape, "%dx%d", n, n);
+        report(r, "gemv", shape, 2.0 * n * n / t * 1e-9, "GFLOP/s", allocs);
+
+        matrix_free(&k.a);
+        vector_free(&k.x);
+        vector_free(&k.y);
+    }
+
+    for (size_t i = 0; i < sizeof(gemm_sizes) / sizeof(int); i++) {
+        int n = gemm_sizes[i];
+        Kernel k;
+        k.a = matrix(n, n);
+        k.b = matrix(n, n);
+        k.c = matrix(n, n);
+        fill(k.a.data, n * n);
+        fill(k.b.data, n * n);
+
+        double t = bench_run(op_gemm, &k, &allocs);
+        sprintf(shape, "%dx%dx%d", n, n, n);
+        report(r, "gemm", shape, 2.0 * n * n * n / t * 1e-9, "GFLOP/s", allocs);
+
+        matrix_free(&k.a);
+        matrix_free(&k.b);
+        matrix_free(&k.c);
+    }
+}
+
+/*------------------------------------------*/
+
+/*          END TO END MODEL BENCHMARKS     */
+
+/*------------------------------------------*/
+
+#define BENCH_BATCH 64
+
+typedef struct {
+    Model model;
+    Batch batch;
+    Mat inputs, targets;
+    Vec target;
+} Train;
+
+static void op_forward(void* arg)
+{
+    Train* t = (Train*)arg;
+    model_forward(&t->model);
+}
+
+static void op_backwards(void* arg)
+{
+    Train* t = (Train*)arg;
+    model_backwards(&t->model, &t->target);
+}
+
+static void op_update(void* arg)
+{
+    Train* t = (Train*)arg;
+    model_update(&t->model, 0.0f);
+}
+
+static void op_forward_batch(void* arg)
+{
+    Train* t = (Train*)arg;
+    model_forward_batch(&t->model, &t->batch, &t->inputs);
+}
+
+static void op_backwards_batch(void* arg)
+{
+    Train* t = (Train*)arg;
+    model_backwards_batch(&t->model, &t->batch, &t->targets);
+}
+
+static void op_update_batch(void* arg)
+{
+    Train* t = (Train*)arg;
+    t->batch.count = BENCH_BATCH;
+    model_update_batch(&t->model, &t->batch, 0.0f);
+}
+
+/* Loaded and mapped models are released inside the timed call so every
+iteration starts from the same state; model_free does not allocate. */
+
+static void op_save(void* arg)
+{
+    Train* t = (Train*)arg;
+    model_save(BENCH_FILE, &t->model);
+}
+
+static void op_load(void* arg)
+{
+    (void)arg;
+    Model model = model_load(BENCH_FILE);
+    model_free(&model);
+}
+
+static void op_map(void* arg)
+{
+    (void)arg;
+    Model model = model_map(BENCH_FILE, 0);
+    model_free(&model);
+}
+
+static void bench_model(Report* r, int layer_count, const int* layer_sizes)
+{
+    char shape[128] = "";
+    for (int i = 0; i < layer_count; i++) {
+        sprintf(shape + strlen(shape), i ? "-%d" : "%d", layer_sizes[i]);
+    }
+
+    int input = layer_sizes[0], output = layer_sizes[layer_count - 1];
+    Train t;
+    t.model = model_build(layer_count, layer_sizes);
+    model_init(&t.model);
+    t.batch = batch_create(&t.model, BENCH_BATCH);
+    t.inputs = matrix(BENCH_BATCH, input);
+    t.targets = matrix(BENCH_BATCH, output);
+    t.target = vector(output);
+    fill(t.model.layers->a.data, input);
+    fill(t.inputs.data, BENCH_BATCH * input);
+    fill(t.targets.data, BENCH_BATCH * output);
+    fill(t.target.data, output);
+
+    double allocs, s;
+    s = bench_run(op_forward, &t, &allocs);
+    report(r, "forward", shape, s * 1e9, "ns/sample", allocs);
+    s = bench_run(op_backwards, &t, &allocs);
+    report(r, "backwards", shape, s * 1e9, "ns/sample", allocs);
+    s = bench_run(op_update, &t, &allocs);
+    report(r, "update", shape, s * 1e9, "ns/sample", allocs);
+    
+    s = bench_run(op_forward_batch, &t, &allocs);
+    report(r, "forward_batch", shape, s * 1e9 / BENCH_BATCH, "ns/sample", allocs);
+    s = bench_run(op_backwards_batch, &t, &allocs);
+    report(r, "backwards_batch", shape, s * 1e9 / BENCH_BATCH, "ns/sample", allocs);
+    s = bench_run(op_update_batch, &t, &allocs);
+    report(r, "update_batch", shape, s * 1e9, "ns/batch", allocs);
+
+    double bytes = (double)t.model.params.size * sizeof(float);
+    int out = quiet(-1);
+    double save = bench_run(op_save, &t, &allocs), save_allocs = allocs;
+    double load = bench_run(op_load, &t, &allocs), load_allocs = allocs;
+    double map = bench_run(op_map, &t, &allocs), map_allocs = allocs;
+    quiet(out);
+
+    report(r, "save", shape, bytes / save * 1e-6, "MB/s", save_allocs);
+    report(r, "load", shape, bytes / load * 1e-6, "MB/s", load_allocs);
+    report(r, "map", shape, map * 1e6, "us", map_allocs);
+    
+    remove(BENCH_FILE);
+    model_free(&t.model);
+    batch_free(&t.batch);
+    matrix_free(&t.inputs);
+    matrix_free(&t.targets);
+    vector_free(&t.target);
+}
+
+int main(int argc, char** argv)
+{
+    Report r = {stdout, 0, 0};
+    int threads = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-json")) r.json = 1;
+        else if (!strcmp(argv[i], "-t") && i + 1 < argc) threads = atoi(argv[++i]);
+        else if (!(r.file = fopen(argv[i], "w"))) {
+            fprintf(stderr, "nerv_bench: could not open '%s'\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    rands(1);
+    nerv_set_threads(threads);
+
+    if (r.json) {
+        fprintf(r.file, "{\n  \"simd\": \"%s\",\n  \"threads\": %d,\n  \"results\": [",
+            nerv_simd_name(), nerv_get_threads());
+    } else {
+        fprintf(r.file, "# simd=%s threads=%d\nbenchmark,shape,value,unit,allocs\n",
+            nerv_simd_name(), nerv_get_threads());
+    }
+
+    bench_kernels(&r);
+
+    static const int mnist[] = {784, 128, 10};
+    static const int deep[] = {256, 256, 256, 256, 10};
+    static const int wide[] = {1024, 2048, 1024};
+    bench_model(&r, 3, mnist);
+    bench_model(&r, 5, deep);
+    bench_model(&r, 3, wide);
+
+    if (r.json) fprintf(r.file, "\n  ]\n}\n");
+    if (r.file != stdout) fclose(r.file);
+    return EXIT_SUCCESS;
+}
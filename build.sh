@@ -15,6 +15,10 @@ inc=(
     -I./
 )
 
+if [ -n "$PROFILE" ]; then
+    flags+=(-DNERV_PROFILE)
+fi
+
 fail_op() {
     echo "Run with -dlib to build dynamically or -slib to build statically." && exit
 }
@@ -29,7 +33,7 @@ mac_dlib() {
 }
 
 linux_dlib() {
-    $cc -shared ${flags[*]} ${inc[*]} ${lib[*]} -lm -fPIC $src -o $name.so 
+    $cc -shared ${flags[*]} ${inc[*]} ${lib[*]} -lm -lpthread -fPIC $src -o $name.so 
 }
 
 dlib() {
@@ -56,6 +60,8 @@ clean() {
     cleanf $name.a
     cleanf $name.so
     cleanf $name.dylib
+    cleanf bench/nerv_bench
+    cleanf tests/nerv_test
 }
 
 case "$1" in
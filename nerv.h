@@ -5,6 +5,8 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+
 /******************************
  * nerv tiny C tensor framework
  * ----------------------------
@@ -20,27 +22,109 @@ typedef struct Mat {
     float* data;
 } Mat;
 
+typedef struct {
+    int rows, columns, nnz;
+    int* offsets, *indices;
+    float* values;
+} SMat;
+
 typedef struct {
     Mat w;
     Vec b, z, a, d;
+    int activation;
+    SMat s;
 } Layer;
 
 typedef struct {
     int layer_count;
     Layer* layers;
+    Vec params;
+    void* arena;
+    void* map;
+    size_t map_size;
 } Model;
 
+typedef struct {
+    int layer_count, size, count;
+    Mat* z, *a, *d;
+    Mat* gw;
+    Vec* gb;
+    Vec grads;
+} Batch;
+
+typedef struct {
+    int layer_count;
+    Vec* z, *a;
+} Context;
+
+typedef struct {
+    int kind, step;
+    float rate, momentum, beta1, beta2, epsilon, decay;
+    Vec m, v;
+} Optimizer;
+
+typedef struct {
+    unsigned long long seed, stream, counter;
+    unsigned int block[4];
+    int used;
+} Rng;
+
+typedef struct {
+    int mode, threads, batch_size;
+    Batch* workers;
+    float* costs;
+    Optimizer* optimizer;
+} Trainer;
+
+typedef struct {
+    int input_size, target_size, batch_size;
+    size_t sample_count;
+    void* stream;
+} Dataset;
+
+typedef struct {
+    int node_count, capacity;
+    void* nodes;
+} Graph;
+
+typedef struct {
+    size_t live_bytes, peak_bytes, allocations, hits, misses;
+    float hit_rate;
+} AllocStats;
+
+typedef struct {
+    unsigned long long calls, time, flops, bytes, allocations;
+} Profile;
+
+typedef struct {
+    int rows, columns, format;
+    void* data;
+    float* scales;
+} QMat;
+
+typedef struct {
+    int layer_count, format;
+    QMat* w;
+    Vec* b;
+    int* activations;
+    void* arena;
+} QModel;
+
+typedef struct {
+    float mean_error, max_error, agreement;
+} QAccuracy;
+
 #define _ftou(n) (unsigned int)(int)((n) * 255)
 #define _utof(u) ((float)(u) / 255.0f)
 #define __clampf(x, min, max) (x * (min <= x && x <= max) + max * (x > max) + min * (x < min))
 #define _clampf(x, min, max) __clampf((x), (min), (max)) 
 #define _normf(x) _clampf(x, 0.0, 1.0)
-#define _sigmoid(x) (1.0 / (1.0 + exp(-(x))))
-#define _sigderiv(x) ((x) * (1.0 - (x)))
+#define _sigmoid(x) (1.0f / (1.0f + expf(-(x))))
+#define _sigderiv(x) ((x) * (1.0f - (x)))
 #define _dsigmoid(x) _sigderiv(_sigmoid(x))
 #define _relu(x) ((x) * ((x) > 0.0f))
 #define _drelu(x) (float)((x) > 0.0f)
-#define __leaky_relu(x, slope) (x * (x >= 0.0f) + slope * (x < 0.0f))
+#define __leaky_relu(x, slope) (x * (x >= 0.0f) + slope * x * (x < 0.0f))
 #define _leaky_relu(x, slope) __leaky_relu((x), (slope))
 #define __dleaky_relu(x, slope) (float)(x >= 0.0f) + slope * (x < 0.0f)
 #define _dleaky_relu(x, slope) __dleaky_relu((x), (slope))
@@ -59,6 +143,19 @@ double rand_gauss();
 double rand_norm();
 double rand_dist(double standard_deviation, double mean);
 
+/*********************************************
+ *  counter based Philox streams, each value
+ *  depends only on seed, stream and position
+ * ******************************************/
+
+Rng rng_create(unsigned long long seed, unsigned long long stream);
+unsigned int rng_next(Rng* rng);
+float rng_uniform(Rng* rng);
+float rng_gauss(Rng* rng);
+void rng_shuffle(Rng* rng, int* indices, int count);
+void rng_fill_uniform(Rng* rng, float* dst, int count, float min, float max);
+void rng_fill_gauss(Rng* rng, float* dst, int count, float mean, float standard_deviation);
+
 /*********************************************
  *   floating point functions and operations
  * ******************************************/
@@ -69,10 +166,109 @@ float normf(float x);
 float sigmoid(float x);
 float sigderiv(float sig);
 float dsigmoid(float x);
+float fast_exp(float x);
+float fast_sigmoid(float x);
 float relu(float x);
 float drelu(float x);
 float leaky_relu(float x, float slope);
 float dleaky_relu(float x, float slope);
+unsigned short float_to_half(float f);
+float half_to_float(unsigned short h);
+unsigned short float_to_bf16(float f);
+float bf16_to_float(unsigned short h);
+
+/*------------------------------------------*/
+
+/*            MEMORY ALLOCATION             */
+
+/*********************************************
+ *  heap allocation used by all constructors
+ * ******************************************/
+
+void* nerv_malloc(size_t size);
+void* nerv_calloc(size_t count, size_t size);
+void nerv_free(void* ptr);
+size_t nerv_alloc_count();
+
+/*********************************************
+ *  64 byte aligned blocks from the system or
+ *  from size class pools with thread caches,
+ *  the arena of a thread holds its Vec and Mat
+ *  data until nerv_alloc_reset: every Vec or
+ *  Mat made by vector, matrix, a _copy or an
+ *  allocating operation while the arena is on
+ *  dangles after the reset. Models, layers,
+ *  batches, optimizers, contexts, datasets and
+ *  graphs never take arena memory
+ * ******************************************/
+
+#define NERV_ALLOC_SYSTEM 0
+#define NERV_ALLOC_POOL 1
+
+void nerv_alloc_mode(int mode);
+void nerv_alloc_arena(int enable);
+void nerv_alloc_reset();
+void nerv_alloc_trim();
+AllocStats nerv_alloc_stats();
+
+/*------------------------------------------*/
+
+/*     SIMD KERNELS AND RUNTIME DISPATCH    */
+
+/*********************************************
+ *  instruction set selected at load by CPUID
+ * ******************************************/
+
+#define NERV_SIMD_SCALAR 0
+#define NERV_SIMD_SSE 1
+#define NERV_SIMD_AVX2 2
+#define NERV_SIMD_AVX512 3
+
+int nerv_simd_set(int level);
+int nerv_simd_level();
+const char* nerv_simd_name();
+int nerv_simd_test();
+
+#define NERV_SIGMOID_PRECISE 0
+#define NERV_SIGMOID_FAST 1
+
+void nerv_sigmoid_mode(int mode);
+
+/*------------------------------------------*/
+
+/*       MULTITHREADED KERNEL EXECUTION     */
+
+/*********************************************
+ *  persistent pool splitting rows of kernels
+ * ******************************************/
+
+void nerv_set_threads(int count);
+int nerv_get_threads();
+void nerv_set_parallel_threshold(size_t work);
+
+/*------------------------------------------*/
+
+/*        PROFILING COUNTERS AND TRACE      */
+
+/*********************************************
+ * compiled in only with make PROFILE=1, per
+ * phase and layer i (weights of layer i into
+ * layer i + 1), layer -1 sums the phase and
+ * layers from NERV_PROFILE_LAYERS on share
+ * one overflow row
+ * ******************************************/
+
+#define NERV_PROFILE_FORWARD 0
+#define NERV_PROFILE_BACKWARDS 1
+#define NERV_PROFILE_UPDATE 2
+#define NERV_PROFILE_PHASES 3
+#define NERV_PROFILE_LAYERS 256
+
+int nerv_profile_enabled();
+void nerv_profile_reset();
+Profile nerv_profile_get(int phase, int layer);
+void nerv_profile_print();
+void nerv_profile_trace(char* path);
 
 /*------------------------------------------*/
 
@@ -83,6 +279,7 @@ float dleaky_relu(float x, float slope);
  * ******************************************/
 
 Vec vector(int size);
+Vec vector_empty(int size);
 Vec vector_create(int size, ...);
 Vec vector_uniform(int size, float val);
 Vec vector_copy(const Vec* src);
@@ -108,6 +305,21 @@ Vec vector_leaky_relu(const Vec* v, float leak);
 Vec vector_dleaky_relu(const Vec* v, float leak);
 Vec vector_softmax(const Vec* v);
 
+void vector_by_matrix_into(const Vec* dst, const Mat* mat, const Vec* vec);
+void vector_by_matrix_transposed_into(const Vec* dst, const Mat* mat, const Vec* vec);
+void vector_sigmoid_into(const Vec* dst, const Vec* v);
+void vector_dsigmoid_into(const Vec* dst, const Vec* v);
+void vector_sigderiv_into(const Vec* dst, const Vec* v);
+void vector_relu_into(const Vec* dst, const Vec* v);
+void vector_drelu_into(const Vec* dst, const Vec* v);
+void vector_leaky_relu_into(const Vec* dst, const Vec* v, float leak);
+void vector_dleaky_relu_into(const Vec* dst, const Vec* v, float leak);
+void vector_softmax_into(const Vec* dst, const Vec* v);
+void vector_activate_into(const Vec* dst, const Vec* z, int activation);
+void vector_deriv_hadamard(const Vec* d, const Vec* a, int activation);
+void vector_dense_into(const Vec* z, const Vec* a, const Mat* mat, const Vec* vec, const Vec* bias, int activation);
+void vector_dense_deriv_into(const Vec* d, const Mat* mat, const Vec* vec, const Vec* a, int activation);
+
 /*------------------------------------------*/
 
 /*   MATRIX DATA STRUCTURE AND OPERATIONS   */
@@ -117,6 +329,7 @@ Vec vector_softmax(const Vec* v);
  * ******************************************/
 
 Mat matrix(int rows, int columns);
+Mat matrix_empty(int rows, int columns);
 Mat matrix_create(int rows, int columns, ...);
 Mat matrix_identity(int size);
 Mat matrix_uniform(int rows, int columns, float val);
@@ -125,13 +338,65 @@ Mat matrix_vector(const Vec* v);
 void matrix_free(Mat* mat);
 
 /*********************************************
- *       matrix functions and operations
+ *       matrix functions and operations,
+ *       _into products overwrite dst and
+ *       _acc products add to it
  * ******************************************/
 
 Mat matrix_scale(const Mat* mat, float scale);
 Mat matrix_multiply(const Mat* a, const Mat* b);
 Mat matrix_hadamard(const Mat* a, const Mat* b);
 Mat matrix_transpose(const Mat* m);
+void matrix_scale_into(const Mat* dst, const Mat* mat, float scale);
+void matrix_hadamard_into(const Mat* dst, const Mat* a, const Mat* b);
+void matrix_transpose_into(const Mat* dst, const Mat* src);
+void matrix_transpose_inplace(const Mat* mat);
+
+void matrix_multiply_into(const Mat* dst, const Mat* a, const Mat* b);
+void matrix_multiply_transposed_into(const Mat* dst, const Mat* a, const Mat* b);
+void matrix_transposed_multiply_into(const Mat* dst, const Mat* a, const Mat* b);
+void matrix_multiply_acc(const Mat* dst, const Mat* a, const Mat* b);
+void matrix_multiply_transposed_acc(const Mat* dst, const Mat* a, const Mat* b);
+void matrix_transposed_multiply_acc(const Mat* dst, const Mat* a, const Mat* b);
+
+/*********************************************
+ *   sparse matrices in compressed row form
+ * ******************************************/
+
+SMat smatrix(const Mat* mat, float threshold);
+SMat smatrix_copy(const SMat* mat);
+Mat smatrix_dense(const SMat* mat);
+void smatrix_free(SMat* mat);
+void vector_by_smatrix_into(const Vec* dst, const SMat* mat, const Vec* vec);
+void vector_by_smatrix_transposed_into(const Vec* dst, const SMat* mat, const Vec* vec);
+void vector_sparse_into(const Vec* z, const Vec* a, const SMat* mat, const Vec* vec, const Vec* bias, int activation);
+void vector_sparse_deriv_into(const Vec* d, const SMat* mat, const Vec* vec, const Vec* a, int activation);
+
+/*------------------------------------------*/
+
+/*   LAZY EXPRESSION GRAPHS WITH FUSION     */
+
+/*********************************************
+ *  nodes record Vec and Mat expressions as
+ *  handles, -1 on error, and run on eval with
+ *  chains of element-wise nodes fused into
+ *  one tiled pass without temporaries
+ * ******************************************/
+
+Graph graph_create();
+void graph_free(Graph* graph);
+void graph_clear(Graph* graph);
+int graph_vector(Graph* graph, const Vec* v);
+int graph_matrix(Graph* graph, const Mat* m);
+int graph_add(Graph* graph, int a, int b);
+int graph_sub(Graph* graph, int a, int b);
+int graph_hadamard(Graph* graph, int a, int b);
+int graph_scale(Graph* graph, int a, float n);
+int graph_activate(Graph* graph, int z, int activation);
+int graph_deriv(Graph* graph, int d, int a, int activation);
+int graph_by_matrix(Graph* graph, int mat, int x);
+void graph_eval_vector(const Graph* graph, int node, const Vec* dst);
+void graph_eval_matrix(const Graph* graph, int node, const Mat* dst);
 
 /*------------------------------------------*/
 
@@ -144,6 +409,20 @@ Mat matrix_transpose(const Mat* m);
         dw = a * d * g
         db = d * g                          */
 
+/*********************************************
+ *  activation of the neurons of each layer,
+ *  derivatives are taken from a = f(z)
+ * ******************************************/
+
+#define NERV_ACTIVATION_SIGMOID 0
+#define NERV_ACTIVATION_RELU 1
+#define NERV_ACTIVATION_LEAKY_RELU 2
+#define NERV_ACTIVATION_SOFTMAX 3
+#define NERV_ACTIVATION_LINEAR 4
+#define NERV_ACTIVATIONS 5
+
+#define NERV_LEAKY_SLOPE 0.01f
+
 /*********************************************
  *          fully connected layers 
  * ******************************************/
@@ -153,6 +432,9 @@ Layer layer_copy(const Layer* layer);
 void layer_vector_free(Layer* layer);
 void layer_matrix_free(Layer* layer);
 void layer_free(Layer* layer);
+void layer_forward(const Layer* layer, const Layer* next_layer, const Vec* a, const Vec* z, const Vec* next_a);
+void layer_backwards(const Layer* layer, const Layer* next_layer);
+float layer_prune(Layer* layer, float sparsity);
 
 /*********************************************
  *    neural network model data structure 
@@ -160,19 +442,116 @@ void layer_free(Layer* layer);
 
 Model model_new(int layer_count);
 Model model_create(int layer_count, ...);
+Model model_build(int layer_count, const int* layer_sizes);
+Model model_build_params(int layer_count, const int* layer_sizes, float* params);
 Model model_copy(const Model* model);
 void model_free(Model* model);
+int model_param_size(const Model* model);
+void model_bind_params(const Model* model, float* data, Mat* w, Vec* b);
 
 /*********************************************
- *    neural network model operations 
+ *    neural network model operations, init
+ *    picks He normal for rectified layers and
+ *    Xavier normal otherwise
  * ******************************************/
 
+#define NERV_INIT_AUTO 0
+#define NERV_INIT_XAVIER_UNIFORM 1
+#define NERV_INIT_XAVIER_NORMAL 2
+#define NERV_INIT_HE_UNIFORM 3
+#define NERV_INIT_HE_NORMAL 4
+#define NERV_INITS 5
+
 void model_init(const Model* model);
+void model_init_scheme(const Model* model, int scheme);
+void model_set_activation(const Model* model, int layer, int activation);
+float model_prune(const Model* model, float sparsity);
+void model_densify(const Model* model);
+void model_compact(Model* model);
 void model_forward(const Model* model);
 void model_backwards(const Model* model, const Vec* desired_output);
 void model_update(const Model* model, float alpha);
 float model_cost(const Model* model, const Vec* desired_output);
 
+/*********************************************
+ * per-thread inference over shared weights
+ * ******************************************/
+
+Context context_create(const Model* model);
+Context context_sizes(int layer_count, const int* layer_sizes);
+void context_free(Context* context);
+const Vec* model_infer(const Model* model, Context* context, const Vec* input);
+
+/*********************************************
+ *  reduced precision weights for inference,
+ *  int8 with one float scale per row, half
+ *  or bfloat16, accumulating in float
+ * ******************************************/
+
+#define NERV_QUANT_INT8 0
+#define NERV_QUANT_FP16 1
+#define NERV_QUANT_BF16 2
+
+QModel qmodel_create(const Model* model, int format);
+void qmodel_free(QModel* qmodel);
+size_t qmodel_size(const QModel* qmodel);
+Context qmodel_context(const QModel* qmodel);
+const Vec* qmodel_infer(const QModel* qmodel, Context* context, const Vec* input);
+void vector_by_qmatrix_into(const Vec* dst, const QMat* mat, const Vec* vec);
+QAccuracy qmodel_compare(const QModel* qmodel, const Model* model, const Mat* inputs);
+
+/*********************************************
+ *   mini-batch training over a Mat of inputs
+ * ******************************************/
+
+Batch batch_create(const Model* model, int size);
+void batch_free(Batch* batch);
+
+void model_forward_batch(const Model* model, Batch* batch, const Mat* inputs);
+void model_backwards_batch(const Model* model, Batch* batch, const Mat* desired_outputs);
+void model_update_batch(const Model* model, Batch* batch, float alpha);
+float model_cost_batch(const Model* model, const Batch* batch, const Mat* desired_outputs);
+
+/*********************************************
+ *  optimizers with state in the flat layout
+ *  of model.params, rmsprop decays by beta2
+ * ******************************************/
+
+#define NERV_OPTIMIZER_SGD 0
+#define NERV_OPTIMIZER_MOMENTUM 1
+#define NERV_OPTIMIZER_NESTEROV 2
+#define NERV_OPTIMIZER_ADAM 3
+#define NERV_OPTIMIZER_ADAMW 4
+#define NERV_OPTIMIZER_RMSPROP 5
+#define NERV_OPTIMIZERS 6
+
+Optimizer optimizer_create(const Model* model, int kind, float rate);
+void optimizer_free(Optimizer* optimizer);
+void optimizer_reset(Optimizer* optimizer);
+void optimizer_step(Optimizer* optimizer, const Model* model, const Vec* grads, float scale);
+void model_optimize(const Model* model, Optimizer* optimizer);
+void model_optimize_batch(const Model* model, Batch* batch, Optimizer* optimizer);
+
+/*********************************************
+ *   data-parallel multithreaded SGD trainer,
+ *  threads is the number of worker batches,
+ *  0 for nerv_get_threads, and the workers
+ *  run on the kernel pool, so they only run
+ *  concurrently once nerv_set_threads gives
+ *  it as many threads. A worker batch that
+ *  cannot be created, as for compact models,
+ *  leaves an empty Trainer that trainer_epoch
+ *  and trainer_stream refuse
+ * ******************************************/
+
+#define NERV_TRAIN_HOGWILD 0
+#define NERV_TRAIN_SYNC 1
+
+Trainer trainer_create(const Model* model, int threads, int batch_size, int mode);
+void trainer_free(Trainer* trainer);
+void trainer_optimizer(Trainer* trainer, Optimizer* optimizer);
+float trainer_epoch(Trainer* trainer, const Model* model, const Mat* inputs, const Mat* targets, float alpha);
+
 /*------------------------------------------*/
 
 /*                 NERV IO                  */
@@ -182,8 +561,23 @@ float model_cost(const Model* model, const Vec* desired_output);
  * ******************************************/
 
 Model model_load(char* path);
+Model model_map(char* path, int verify);
 void model_save(char* path, const Model* model);
 
+/*********************************************
+ *  streaming datasets read in shuffled chunks
+ *  by a prefetch thread, batches are views of
+ *  the current chunk, 0 rows ends the epoch,
+ *  -1 a read error; trainer_stream then
+ *  returns -1, as for an empty Trainer
+ * ******************************************/
+
+Dataset dataset_open(char* path, int batch_size, int chunk_size, int shuffle);
+void dataset_close(Dataset* dataset);
+void dataset_save(char* path, const Mat* inputs, const Mat* targets);
+int dataset_next(Dataset* dataset, Mat* inputs, Mat* targets);
+float trainer_stream(Trainer* trainer, const Model* model, Dataset* dataset, float alpha);
+
 /*********************************************
  *   useful IO functions to print and scan
  * ******************************************/
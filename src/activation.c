@@ -0,0 +1,91 @@
+/*********************************************
+ *    activation functions of the layers
+ * ******************************************/
+
+#include <nerv.h>
+#include "activation.h"
+#include "simd.h"
+#include <string.h>
+#include <math.h>
+
+/* Softmax subtracts the maximum of the row before exponentiating, so
+large inputs cannot overflow and the result always sums to one. */
+
+static void softmax(float* a, const float* z, int n)
+{
+    float max = z[0], sum = 0.0f;
+    for (int i = 1; i < n; i++) {
+        if (z[i] > max) max = z[i];
+    }
+
+    for (int i = 0; i < n; i++) {
+        a[i] = expf(z[i] - max);
+        sum += a[i];
+    }
+
+    nerv_kernels.scale(a, 1.0f / sum, n);
+}
+
+static void softmax_deriv(float* restrict d, const float* restrict a, int n)
+{
+    float dot = nerv_kernels.dot(d, a, n);
+    for (int i = 0; i < n; i++) {
+        d[i] = a[i] * (d[i] - dot);
+    }
+}
+
+void nerv_activate(int activation, float* a, const float* z, int rows, int columns)
+{
+    int n = rows * columns;
+    switch (activation) {
+        case NERV_ACTIVATION_RELU:
+            for (int i = 0; i < n; i++) {
+                a[i] = _relu(z[i]);
+            }
+            break;
+        case NERV_ACTIVATION_LEAKY_RELU:
+            for (int i = 0; i < n; i++) {
+                a[i] = _leaky_relu(z[i], NERV_LEAKY_SLOPE);
+            }
+            break;
+        case NERV_ACTIVATION_SOFTMAX:
+            if (!columns) break;
+            for (int y = 0; y < rows; y++, a += columns, z += columns) {
+                softmax(a, z, columns);
+            }
+            break;
+        case NERV_ACTIVATION_LINEAR:
+            if (a != z) memcpy(a, z, n * sizeof(float));
+            break;
+        default:
+            nerv_kernels.sigmoid(a, z, n);
+    }
+}
+
+void nerv_activate_deriv(int activation, float* d, const float* a, int rows, int columns)
+{
+    int n = rows * columns;
+    switch (activation) {
+        case NERV_ACTIVATION_RELU:
+            for (int i = 0; i < n; i++) {
+                d[i] *= _drelu(a[i]);
+            }
+            break;
+        case NERV_ACTIVATION_LEAKY_RELU:
+            for (int i = 0; i < n; i++) {
+                d[i] *= _dleaky_relu(a[i], NERV_LEAKY_SLOPE);
+            }
+            break;
+        case NERV_ACTIVATION_SOFTMAX:
+            for (int y = 0; y < rows; y++, d += columns, a += columns) {
+                softmax_deriv(d, a, columns);
+            }
+            break;
+        case NERV_ACTIVATION_LINEAR:
+            break;
+        default:
+            for (int i = 0; i < n; i++) {
+                d[i] *= _sigderiv(a[i]);
+            }
+    }
+}
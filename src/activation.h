@@ -0,0 +1,17 @@
+#ifndef NERV_ACTIVATION_H
+#define NERV_ACTIVATION_H
+
+/*********************************************
+ *   internal activation kernels on raw rows
+ * ******************************************/
+
+/* Both work on rows x columns floats. Element-wise kinds treat them as one
+array, softmax normalizes every row on its own. nerv_activate writes
+a = f(z); nerv_activate_deriv turns d, the gradient with respect to a,
+into the gradient with respect to z using only a. For softmax that is
+the Jacobian product d = a * (d - dot(d, a)) of every row. */
+
+void nerv_activate(int activation, float* a, const float* z, int rows, int columns);
+void nerv_activate_deriv(int activation, float* d, const float* a, int rows, int columns);
+
+#endif
@@ -0,0 +1,386 @@
+/*********************************************
+ *      heap allocation and bookkeeping
+ * ******************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <nerv.h>
+#include "alloc.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Every block starts 64 bytes aligned behind a 64 byte header that
+records where it came from, so nerv_free works whatever the mode was
+when the block was allocated:
+
+    SYSTEM  malloc or calloc with the raw pointer kept in the header
+    POOL    a size class block, returned to the free list of its class
+    ARENA   bump allocated scratch, freed all at once by nerv_alloc_reset
+
+Only Vec and Mat data comes from the arena of a thread that turned it on
+with nerv_alloc_arena, as everything else the library allocates, like
+scratch buffers, outlives a batch; nerv_free of arena data does nothing.
+Layers, batches, optimizers and datasets suspend the arena while they
+allocate their tensors, so building one inside an arena window is safe.
+
+Size classes are quarter powers of two of 64 byte units: 1, 2, 3, 4, 5,
+6, 7, 8, 10, 12, 14, 16, 20... units, so rounding wastes at most a fifth
+of a block, up to 64 MB; larger requests go to the system. Each thread
+caches freed blocks per class and spills half of a full cache to a
+global spinlocked list, which refills empty caches. Pool blocks are only
+returned to the system by nerv_alloc_trim. */
+
+#define ALLOC_ALIGN 64
+#define ALLOC_CLASSES 76
+#define ALLOC_CACHE_BLOCKS 32
+#define ALLOC_CACHE_BYTES (4 << 20)
+#define ALLOC_ARENA_CHUNK (4 << 20)
+
+#define BLOCK_SYSTEM 0
+#define BLOCK_POOL 1
+#define BLOCK_ARENA 2
+
+typedef struct {
+    void* raw;
+    size_t size;
+    int source, cls;
+} Header;
+
+typedef struct Chunk {
+    struct Chunk* next;
+    size_t size, used;
+} Chunk;
+
+typedef struct {
+    void* head[ALLOC_CLASSES];
+    int count[ALLOC_CLASSES];
+    Chunk* chunks, *chunk;
+    size_t arena_live;
+} Cache;
+
+typedef struct {
+    void* head;
+    int lock;
+} FreeList;
+
+static size_t nerv_allocations = 0;
+static size_t alloc_live = 0, alloc_peak = 0, alloc_hits = 0, alloc_misses = 0;
+static int alloc_mode = NERV_ALLOC_SYSTEM;
+static __thread int alloc_arena = 0;
+static __thread Cache* alloc_cache = NULL;
+static FreeList alloc_lists[ALLOC_CLASSES];
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+#define HEADER(ptr) ((Header*)(ptr) - 1)
+#define NEXT(ptr) (*(void**)(ptr))
+
+static void alloc_track(size_t size)
+{
+    size_t live = __sync_add_and_fetch(&alloc_live, size), peak = __atomic_load_n(&alloc_peak, __ATOMIC_RELAXED);
+    while (live > peak && !__sync_bool_compare_and_swap(&alloc_peak, peak, live)) {
+        peak = __atomic_load_n(&alloc_peak, __ATOMIC_RELAXED);
+    }
+}
+
+static int class_index(size_t size)
+{
+    size_t units = size ? (size + ALLOC_ALIGN - 1) / ALLOC_ALIGN : 1;
+    if (units <= 4) return (int)units - 1;
+
+    int e = 63 - __builtin_clzll((unsigned long long)(units - 1));
+    int cls = 4 + (e - 2) * 4 + (int)(((units - 1) >> (e - 2)) & 3);
+    return cls < ALLOC_CLASSES ? cls : -1;
+}
+
+static size_t class_size(int cls)
+{
+    if (cls < 4) return (size_t)(cls + 1) * ALLOC_ALIGN;
+    return ((size_t)(5 + (cls - 4) % 4) << ((cls - 4) / 4)) * ALLOC_ALIGN;
+}
+
+static int class_limit(int cls)
+{
+    size_t limit = ALLOC_CACHE_BYTES / class_size(cls);
+    return limit < 1 ? 1 : limit > ALLOC_CACHE_BLOCKS ? ALLOC_CACHE_BLOCKS : (int)limit;
+}
+
+static void* system_alloc(size_t size, int zero, int source, int cls)
+{
+    size_t total = size + 2 * ALLOC_ALIGN;
+    char* raw = (char*)(zero ? calloc(1, total) : malloc(total));
+    if (!raw) return NULL;
+
+    char* ptr = (char*)(((uintptr_t)raw + 2 * ALLOC_ALIGN - 1) & ~(uintptr_t)(ALLOC_ALIGN - 1));
+    Header* h = HEADER(ptr);
+    h->raw = raw;
+    h->source = source;
+    h->cls = cls;
+    return ptr;
+}
+
+static void list_lock(FreeList* list)
+{
+    while (__sync_lock_test_and_set(&list->lock, 1)) {
+        while (*(volatile int*)&list->lock);
+    }
+}
+
+/*------------------------------------------*/
+
+/*        PER THREAD CACHES AND ARENAS      */
+
+/*------------------------------------------*/
+
+static void cache_spill(Cache* cache, int cls, int keep)
+{
+    FreeList* list = alloc_lists + cls;
+    list_lock(list);
+    while (cache->count[cls] > keep) {
+        void* ptr = cache->head[cls];
+        cache->head[cls] = NEXT(ptr);
+        NEXT(ptr) = list->head;
+        list->head = ptr;
+        cache->count[cls]--;
+    }
+    __sync_lock_release(&list->lock);
+}
+
+static void cache_release(void* ptr)
+{
+    Cache* cache = (Cache*)ptr;
+    for (int i = 0; i < ALLOC_CLASSES; i++) {
+        if (cache->count[i]) cache_spill(cache, i, 0);
+    }
+
+    for (Chunk* chunk = cache->chunks, *next; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    __sync_sub_and_fetch(&alloc_live, cache->arena_live);
+    free(cache);
+}
+
+static void cache_init()
+{
+    pthread_key_create(&cache_key, cache_release);
+}
+
+/* The key only exists to hand the cache of an exiting thread back to the
+global lists; lookups go through the thread local pointer. */
+
+static Cache* cache_get()
+{
+    if (alloc_cache) return alloc_cache;
+
+    pthread_once(&cache_once, cache_init);
+    alloc_cache = (Cache*)calloc(1, sizeof(Cache));
+    pthread_setspecific(cache_key, alloc_cache);
+    return alloc_cache;
+}
+
+static void* pool_alloc(size_t size, int zero)
+{
+    int cls = class_index(size);
+    if (cls < 0) return system_alloc(size, zero, BLOCK_SYSTEM, -1);
+
+    Cache* cache = cache_get();
+    if (!cache->head[cls] && alloc_lists[cls].head) {
+        FreeList* list = alloc_lists + cls;
+        list_lock(list);
+        for (int n = class_limit(cls) / 2 + 1; n && list->head; n--) {
+            void* ptr = list->head;
+            list->head = NEXT(ptr);
+            NEXT(ptr) = cache->head[cls];
+            cache->head[cls] = ptr;
+            cache->count[cls]++;
+        }
+        __sync_lock_release(&list->lock);
+    }
+
+    void* ptr = cache->head[cls];
+    if (!ptr) {
+        __sync_fetch_and_add(&alloc_misses, 1);
+        return system_alloc(class_size(cls), zero, BLOCK_POOL, cls);
+    }
+
+    cache->head[cls] = NEXT(ptr);
+    cache->count[cls]--;
+    __sync_fetch_and_add(&alloc_hits, 1);
+    if (zero) memset(ptr, 0, size);
+    return ptr;
+}
+
+static void pool_free(void* ptr, int cls)
+{
+    Cache* cache = cache_get();
+    NEXT(ptr) = cache->head[cls];
+    cache->head[cls] = ptr;
+
+    int limit = class_limit(cls);
+    if (++cache->count[cls] > limit) cache_spill(cache, cls, limit / 2);
+}
+
+static void* arena_alloc(Cache* cache, size_t size, int zero)
+{
+    size_t need = ALLOC_ALIGN + ((size + ALLOC_ALIGN - 1) & ~(size_t)(ALLOC_ALIGN - 1));
+    Chunk* chunk = cache->chunk;
+
+    while (chunk && chunk->used + need > chunk->size) {
+        chunk = chunk->next;
+    }
+
+    if (!chunk) {
+        size_t capacity = need > ALLOC_ARENA_CHUNK ? need : ALLOC_ARENA_CHUNK;
+        chunk = (Chunk*)malloc(capacity + 2 * ALLOC_ALIGN);
+        if (!chunk) return NULL;
+        chunk->size = capacity;
+        chunk->used = 0;
+        chunk->next = cache->chunk ? cache->chunk->next : NULL;
+        if (cache->chunk) cache->chunk->next = chunk;
+        else cache->chunks = chunk;
+    }
+    cache->chunk = chunk;
+
+    char* base = (char*)(((uintptr_t)(chunk + 1) + ALLOC_ALIGN - 1) & ~(uintptr_t)(ALLOC_ALIGN - 1));
+    char* ptr = base + chunk->used + ALLOC_ALIGN;
+    chunk->used += need;
+
+    Header* h = HEADER(ptr);
+    h->raw = NULL;
+    h->source = BLOCK_ARENA;
+    h->cls = -1;
+    cache->arena_live += size;
+    if (zero) memset(ptr, 0, size);
+    return ptr;
+}
+
+/*------------------------------------------*/
+
+/*            ALLOCATOR INTERFACE           */
+
+/*------------------------------------------*/
+
+static void* alloc_block(size_t size, int zero, int tensor)
+{
+    __sync_fetch_and_add(&nerv_allocations, 1);
+
+    void* ptr;
+    if (tensor && alloc_arena) {
+        ptr = arena_alloc(cache_get(), size, zero);
+    } else if (alloc_mode == NERV_ALLOC_POOL) {
+        ptr = pool_alloc(size, zero);
+    } else {
+        ptr = system_alloc(size, zero, BLOCK_SYSTEM, -1);
+    }
+
+    if (!ptr) return NULL;
+    HEADER(ptr)->size = size;
+    alloc_track(size);
+    return ptr;
+}
+
+void* nerv_malloc(size_t size)
+{
+    return alloc_block(size, 0, 0);
+}
+
+void* nerv_calloc(size_t count, size_t size)
+{
+    return alloc_block(count * size, 1, 0);
+}
+
+void* nerv_tensor_malloc(size_t size)
+{
+    return alloc_block(size, 0, 1);
+}
+
+void* nerv_tensor_calloc(size_t count, size_t size)
+{
+    return alloc_block(count * size, 1, 1);
+}
+
+void nerv_free(void* ptr)
+{
+    if (!ptr) return;
+
+    Header* h = HEADER(ptr);
+    if (h->source == BLOCK_ARENA) return;
+
+    __sync_sub_and_fetch(&alloc_live, h->size);
+    if (h->source == BLOCK_POOL) pool_free(ptr, h->cls);
+    else free(h->raw);
+}
+
+size_t nerv_alloc_count()
+{
+    return nerv_allocations;
+}
+
+void nerv_alloc_mode(int mode)
+{
+    alloc_mode = mode == NERV_ALLOC_POOL ? NERV_ALLOC_POOL : NERV_ALLOC_SYSTEM;
+}
+
+void nerv_alloc_arena(int enable)
+{
+    alloc_arena = enable;
+}
+
+int nerv_arena_suspend()
+{
+    int arena = alloc_arena;
+    alloc_arena = 0;
+    return arena;
+}
+
+void nerv_arena_resume(int arena)
+{
+    alloc_arena = arena;
+}
+
+void nerv_alloc_reset()
+{
+    Cache* cache = cache_get();
+    for (Chunk* chunk = cache->chunks; chunk; chunk = chunk->next) {
+        chunk->used = 0;
+    }
+    cache->chunk = cache->chunks;
+
+    __sync_sub_and_fetch(&alloc_live, cache->arena_live);
+    cache->arena_live = 0;
+}
+
+void nerv_alloc_trim()
+{
+    Cache* cache = cache_get();
+    for (int i = 0; i < ALLOC_CLASSES; i++) {
+        if (cache->count[i]) cache_spill(cache, i, 0);
+
+        FreeList* list = alloc_lists + i;
+        list_lock(list);
+        void* ptr = list->head;
+        list->head = NULL;
+        __sync_lock_release(&list->lock);
+
+        for (void* next; ptr; ptr = next) {
+            next = NEXT(ptr);
+            free(HEADER(ptr)->raw);
+        }
+    }
+}
+
+AllocStats nerv_alloc_stats()
+{
+    AllocStats stats;
+    stats.live_bytes = alloc_live;
+    stats.peak_bytes = alloc_peak;
+    stats.allocations = nerv_allocations;
+    stats.hits = alloc_hits;
+    stats.misses = alloc_misses;
+    stats.hit_rate = stats.hits + stats.misses ? (float)stats.hits / (float)(stats.hits + stats.misses) : 0.0f;
+    return stats;
+}
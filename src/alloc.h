@@ -0,0 +1,24 @@
+#ifndef NERV_ALLOC_H
+#define NERV_ALLOC_H
+
+/*********************************************
+ *  internal allocation of tensor storage
+ * ******************************************/
+
+#include <stddef.h>
+
+/* Like nerv_malloc and nerv_calloc, but served from the reset arena of
+the calling thread while nerv_alloc_arena is on. Only Vec and Mat data,
+which callers free or drop at the end of a batch, goes through these. */
+
+void* nerv_tensor_malloc(size_t size);
+void* nerv_tensor_calloc(size_t count, size_t size);
+
+/* Constructors of objects that outlive a batch, like Batch, Optimizer
+and Dataset, turn the arena of the calling thread off around their Vec
+and Mat allocations and restore it with the value suspend returned. */
+
+int nerv_arena_suspend();
+void nerv_arena_resume(int arena);
+
+#endif
@@ -0,0 +1,195 @@
+
+/*********************************************
+ *   mini-batch training over a Mat of inputs
+ * ******************************************/
+
+#include <nerv.h>
+#include "simd.h"
+#include "profile.h"
+#include "activation.h"
+#include "sparse.h"
+#include "alloc.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Each row of a batch matrix is one sample, so layer activations are
+stored as (samples x neurons) and the layer weights w (next x current)
+are applied as Z = A * w^T + b. Gradients are summed over every sample
+seen since the last update and averaged once in model_update_batch.
+The products all go through the blocked GEMM kernels of matrix_op.c.
+Gradients share the flat layout of the model parameters, so models built
+in an arena are updated in a single pass over model.params. */
+
+static void batch_rows(Batch* batch, int rows)
+{
+    for (int i = 0; i < batch->layer_count; i++) {
+        batch->z[i].rows = rows;
+        batch->a[i].rows = rows;
+        batch->d[i].rows = rows;
+    }
+}
+
+static void matrix_broadcast_rows(const Mat* dst, const Vec* b)
+{
+    float* f = dst->data;
+    for (int y = 0; y < dst->rows; y++, f += dst->columns) {
+        memcpy(f, b->data, dst->columns * sizeof(float));
+    }
+}
+
+static void vector_add_rows(const Vec* dst, const Mat* m)
+{
+    float* n = m->data;
+    for (int y = 0; y < m->rows; y++) {
+        float* f = dst->data;
+        for (float* end = f + dst->size; f != end; f++, n++) {
+            *f += *n;
+        }
+    }
+}
+
+Batch batch_create(const Model* restrict model, int size)
+{
+    Batch batch;
+    memset(&batch, 0, sizeof(Batch));
+    if (model_compacted(model)) {
+        printf("Batch: Compact models have no dense weights, call model_densify first\n");
+        return batch;
+    }
+
+    batch.layer_count = model->layer_count;
+    batch.size = size;
+    batch.count = 0;
+
+    batch.z = (Mat*)nerv_malloc(sizeof(Mat) * model->layer_count);
+    batch.a = (Mat*)nerv_malloc(sizeof(Mat) * model->layer_count);
+    batch.d = (Mat*)nerv_malloc(sizeof(Mat) * model->layer_count);
+    batch.gw = (Mat*)nerv_malloc(sizeof(Mat) * model->layer_count);
+    batch.gb = (Vec*)nerv_malloc(sizeof(Vec) * model->layer_count);
+    int arena = nerv_arena_suspend();
+    batch.grads = vector(model_param_size(model));
+    model_bind_params(model, batch.grads.data, batch.gw, batch.gb);
+
+    Layer* layer = model->layers;
+    for (int i = 0; i < model->layer_count; i++, layer++) {
+        batch.z[i] = matrix(size, layer->a.size);
+        batch.a[i] = matrix(size, layer->a.size);
+        batch.d[i] = matrix(size, layer->a.size);
+    }
+
+    nerv_arena_resume(arena);
+    return batch;
+}
+
+void batch_free(Batch* batch)
+{
+    for (int i = 0; i < batch->layer_count; i++) {
+        matrix_free(batch->z + i);
+        matrix_free(batch->a + i);
+        matrix_free(batch->d + i);
+    }
+
+    vector_free(&batch->grads);
+
+    nerv_free(batch->z);
+    nerv_free(batch->a);
+    nerv_free(batch->d);
+    nerv_free(batch->gw);
+    nerv_free(batch->gb);
+}
+
+void model_forward_batch(const Model* restrict model, Batch* restrict batch, const Mat* restrict inputs)
+{
+    if (inputs->rows > batch->size || inputs->columns != model->layers->a.size) {
+        printf("Forward Batch: Input matrix (%dx%d) does not fit batch of %d samples of size %d\n",
+            inputs->rows, inputs->columns, batch->size, model->layers->a.size);
+        return;
+    }
+
+    batch_rows(batch, inputs->rows);
+    memcpy(batch->a->data, inputs->data, inputs->rows * inputs->columns * sizeof(float));
+
+    Layer* layer = model->layers;
+    for (int i = 0; i < model->layer_count - 1; i++, layer++) {
+        PROFILE_BEGIN(scope);
+        Mat* z = batch->z + i + 1, *a = batch->a + i + 1;
+        matrix_broadcast_rows(z, &layer[1].b);
+        matrix_multiply_transposed_acc(z, batch->a + i, &layer->w);
+        nerv_activate(layer[1].activation, a->data, z->data, a->rows, a->columns);
+        PROFILE_END(scope, NERV_PROFILE_FORWARD, i, (size_t)a->rows * (2 * layer->w.rows * layer->w.columns + layer->w.rows),
+            sizeof(float) * (layer->w.rows * layer->w.columns + layer->w.rows + (size_t)a->rows * (layer->w.columns + 2 * layer->w.rows)));
+    }
+}
+
+void model_backwards_batch(const Model* restrict model, Batch* restrict batch, const Mat* restrict desired_outputs)
+{
+    int last = model->layer_count - 1;
+    Mat* a = batch->a + last, *d = batch->d + last;
+    if (desired_outputs->rows != a->rows || desired_outputs->columns != a->columns) {
+        printf("Backwards Batch: Desired output matrix (%dx%d) must match batch output (%dx%d)\n",
+            desired_outputs->rows, desired_outputs->columns, a->rows, a->columns);
+        return;
+    }
+
+    PROFILE_BEGIN(scope);
+    float* f = d->data, *n = a->data, *y = desired_outputs->data;
+    for (float* end = f + d->rows * d->columns; f != end; f++, n++, y++) {
+        *f = 2.0f * (*n - *y);
+    }
+    nerv_activate_deriv(model->layers[last].activation, d->data, a->data, d->rows, d->columns);
+    PROFILE_END(scope, NERV_PROFILE_BACKWARDS, last - 1, (size_t)5 * d->rows * d->columns, sizeof(float) * 4 * d->rows * d->columns);
+
+    for (int i = last - 1; i >= 0; i--) {
+        PROFILE_BEGIN(scope);
+        Layer* layer = model->layers + i;
+        matrix_transposed_multiply_acc(batch->gw + i, batch->d + i + 1, batch->a + i);
+        vector_add_rows(batch->gb + i + 1, batch->d + i + 1);
+        if (i) {
+            matrix_multiply_into(batch->d + i, batch->d + i + 1, &layer->w);
+            nerv_activate_deriv(layer->activation, batch->d[i].data, batch->a[i].data, batch->d[i].rows, batch->d[i].columns);
+        }
+        PROFILE_END(scope, NERV_PROFILE_BACKWARDS, i,
+            (size_t)a->rows * (2 * layer->w.rows * layer->w.columns + layer->w.rows) * (1 + (i > 0)),
+            sizeof(float) * (2 * layer->w.rows * layer->w.columns + (size_t)a->rows * (layer->w.rows + layer->w.columns)) * (1 + (i > 0)));
+    }
+
+    batch->count += a->rows;
+}
+
+void model_update_batch(const Model* restrict model, Batch* restrict batch, float alpha)
+{
+    if (!batch->count) return;
+    float scale = alpha / (float)batch->count;
+
+    PROFILE_BEGIN(scope);
+    if (model->params.data) {
+        nerv_kernels.axpy(model->params.data, -scale, batch->grads.data, batch->grads.size);
+        vector_scale(&batch->grads, 0.0f);
+        batch->count = 0;
+        model_sparse_sync(model);
+        PROFILE_END(scope, NERV_PROFILE_UPDATE, -1, 2 * (size_t)batch->grads.size, sizeof(float) * 4 * (size_t)batch->grads.size);
+        return;
+    }
+
+    Layer* layer = model->layers;
+    for (int i = 0; i < model->layer_count; i++, layer++) {
+        nerv_kernels.axpy(layer->b.data, -scale, batch->gb[i].data, layer->b.size);
+        nerv_kernels.axpy(layer->w.data, -scale, batch->gw[i].data, layer->w.rows * layer->w.columns);
+    }
+
+    vector_scale(&batch->grads, 0.0f);
+    model_sparse_sync(model);
+    PROFILE_END(scope, NERV_PROFILE_UPDATE, -1, 2 * (size_t)batch->grads.size, sizeof(float) * 4 * (size_t)batch->grads.size);
+    batch->count = 0;
+}
+
+float model_cost_batch(const Model* restrict model, const Batch* restrict batch, const Mat* restrict desired_outputs)
+{
+    const Mat* a = batch->a + model->layer_count - 1;
+    float* n = a->data, *y = desired_outputs->data, cost = 0.0f;
+    for (float* end = n + a->rows * a->columns; n != end; n++, y++) {
+        float f = *n - *y;
+        cost += f * f;
+    }
+    return cost;
+}
@@ -0,0 +1,73 @@
+
+/*********************************************
+ * per-thread inference over shared weights
+ * ******************************************/
+
+#include <nerv.h>
+#include <stdio.h>
+#include <string.h>
+
+/* A Context holds only the z and a vectors of every layer, all carved out
+of one allocation, so any number of threads can evaluate the same Model
+at once. model_infer reads the weights and biases of the model and
+writes nothing but the context. */
+
+Context context_sizes(int layer_count, const int* restrict layer_sizes)
+{
+    Context context;
+    context.layer_count = layer_count;
+
+    int size = 0;
+    for (int i = 0; i < layer_count; i++) {
+        size += layer_sizes[i];
+    }
+
+    Vec* vectors = (Vec*)nerv_malloc(sizeof(Vec) * 2 * layer_count + sizeof(float) * 2 * size);
+    float* f = (float*)(vectors + 2 * layer_count);
+    memset(f, 0, sizeof(float) * 2 * size);
+    
+    context.z = vectors;
+    context.a = vectors + layer_count;
+    for (int i = 0; i < layer_count; i++) {
+        int n = layer_sizes[i];
+        context.z[i].size = n;
+        context.z[i].data = f;
+        context.a[i].size = n;
+        context.a[i].data = f + n;
+        f += 2 * n;
+    }
+
+    return context;
+}
+
+Context context_create(const Model* restrict model)
+{
+    int layer_sizes[model->layer_count];
+    for (int i = 0; i < model->layer_count; i++) {
+        layer_sizes[i] = model->layers[i].a.size;
+    }
+
+    return context_sizes(model->layer_count, layer_sizes);
+}
+
+void context_free(Context* context)
+{
+    nerv_free(context->z);
+}
+
+const Vec* model_infer(const Model* restrict model, Context* restrict context, const Vec* restrict input)
+{
+    if (input->size != context->a->size) {
+        printf("Infer: Input size (%d) must be equal to model input layer (%d)\n", input->size, context->a->size);
+        return context->a + context->layer_count - 1;
+    }
+
+    memcpy(context->a->data, input->data, input->size * sizeof(float));
+    
+    Layer* layer = model->layers;
+    for (int i = 0; i < model->layer_count - 1; i++, layer++) {
+        layer_forward(layer, layer + 1, context->a + i, context->z + i + 1, context->a + i + 1);
+    }
+
+    return context->a + context->layer_count - 1;
+}
@@ -0,0 +1,344 @@
+/*********************************************
+ *  streaming datasets with background prefetch
+ * ******************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <nerv.h>
+#include "alloc.h"
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Dataset files are a 64 byte DataHeader followed by sample_count samples
+from data_offset on, each input_size input floats and then target_size
+target floats, in the byte order of the writer.
+
+A Dataset never holds more than two chunks of chunk_size samples. A
+background thread reads the next chunk with pread while batches are
+taken from the current one, splitting samples into an input and a
+target Mat and, when shuffling, permuting samples inside the chunk on the
+way. The order of the chunks is reshuffled every epoch. Batches are views
+into the current chunk and stay valid until the next dataset_next.
+
+A chunk that cannot be read is handed over with -1 rows and stops the
+thread, so dataset_next returns -1 from then on instead of ending the
+epoch early. */
+
+#define DATA_MAGIC "NDAT"
+#define DATA_VERSION 1
+#define DATA_ENDIAN 0x01020304
+
+typedef struct {
+    char magic[4];
+    uint32_t version, endian, input_size, target_size, reserved0;
+    uint64_t sample_count, data_offset;
+    uint8_t reserved[24];
+} DataHeader;
+
+typedef struct {
+    Mat inputs, targets;
+    int rows, last, ready;
+} Chunk;
+
+typedef struct {
+    int fd, chunk_size, chunk_count, shuffle;
+    uint64_t data_offset;
+    size_t sample_count, sample_floats;
+
+    Chunk chunks[2];
+    int front, held, cursor;
+
+    Rng rng;
+    int* order, *perm;
+    float* raw;
+    int next, quit;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Stream;
+
+void dataset_save(char* path, const Mat* restrict inputs, const Mat* restrict targets)
+{
+    if (inputs->rows != targets->rows) {
+        printf("Dataset: Input (%d) and target (%d) sample counts are not equal\n", inputs->rows, targets->rows);
+        return;
+    }
+
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        printf("Could not write dataset file '%s'\n", path);
+        return;
+    }
+
+    DataHeader header;
+    memset(&header, 0, sizeof(DataHeader));
+    memcpy(header.magic, DATA_MAGIC, 4);
+    header.version = DATA_VERSION;
+    header.endian = DATA_ENDIAN;
+    header.input_size = inputs->columns;
+    header.target_size = targets->columns;
+    header.sample_count = inputs->rows;
+    header.data_offset = sizeof(DataHeader);
+    fwrite(&header, sizeof(DataHeader), 1, file);
+
+    for (int r = 0; r < inputs->rows; r++) {
+        fwrite(inputs->data + (size_t)r * inputs->columns, sizeof(float), inputs->columns, file);
+        fwrite(targets->data + (size_t)r * targets->columns, sizeof(float), targets->columns, file);
+    }
+    fclose(file);
+}
+
+/*------------------------------------------*/
+
+/*          BACKGROUND CHUNK LOADER         */
+
+/*------------------------------------------*/
+
+static void stream_permute(Stream* s, int* p, int n)
+{
+    for (int i = 0; i < n; i++) {
+        p[i] = i;
+    }
+
+    if (s->shuffle) rng_shuffle(&s->rng, p, n);
+}
+
+static int stream_read(Stream* s, int index)
+{
+    size_t first = (size_t)index * s->chunk_size;
+    size_t rows = s->sample_count - first < (size_t)s->chunk_size ? s->sample_count - first : (size_t)s->chunk_size;
+    size_t size = rows * s->sample_floats * sizeof(float), done = 0;
+    off_t offset = (off_t)(s->data_offset + first * s->sample_floats * sizeof(float));
+
+    while (done < size) {
+        ssize_t n = pread(s->fd, (char*)s->raw + done, size - done, offset + (off_t)done);
+        if (n <= 0) {
+            printf("Dataset: Could not read samples %zu to %zu\n", first, first + rows);
+            return -1;
+        }
+        done += (size_t)n;
+    }
+
+    return (int)rows;
+}
+
+static int stream_load(Stream* s, Chunk* chunk, int index)
+{
+    int rows = stream_read(s, index);
+    if (rows < 0) return rows;
+    stream_permute(s, s->perm, rows);
+
+    size_t in = chunk->inputs.columns, out = chunk->targets.columns;
+    for (int r = 0; r < rows; r++) {
+        const float* sample = s->raw + (size_t)s->perm[r] * s->sample_floats;
+        memcpy(chunk->inputs.data + r * in, sample, in * sizeof(float));
+        memcpy(chunk->targets.data + r * out, sample + in, out * sizeof(float));
+    }
+    return rows;
+}
+
+static void* stream_worker(void* arg)
+{
+    Stream* s = (Stream*)arg;
+
+    for (int b = 0;; b ^= 1) {
+        Chunk* chunk = s->chunks + b;
+
+        pthread_mutex_lock(&s->lock);
+        while (chunk->ready && !s->quit) {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        int quit = s->quit;
+        pthread_mutex_unlock(&s->lock);
+        if (quit) break;
+
+        if (!s->next) stream_permute(s, s->order, s->chunk_count);
+        int rows = stream_load(s, chunk, s->order[s->next]);
+        s->next = (s->next + 1) % s->chunk_count;
+
+        pthread_mutex_lock(&s->lock);
+        chunk->rows = rows;
+        chunk->last = !s->next;
+        chunk->ready = 1;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        if (rows < 0) break;
+    }
+
+    return NULL;
+}
+
+static void stream_free(Stream* s)
+{
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    close(s->fd);
+
+    for (int i = 0; i < 2; i++) {
+        matrix_free(&s->chunks[i].inputs);
+        matrix_free(&s->chunks[i].targets);
+    }
+    nerv_free(s->order);
+    nerv_free(s->raw);
+    nerv_free(s);
+}
+
+/*------------------------------------------*/
+
+/*             DATASET INTERFACE            */
+
+/*------------------------------------------*/
+
+Dataset dataset_open(char* path, int batch_size, int chunk_size, int shuffle)
+{
+    Dataset dataset = {0, 0, batch_size, 0, NULL};
+
+    int fd = open(path, O_RDONLY);
+    DataHeader header;
+    if (fd < 0 || pread(fd, &header, sizeof(DataHeader), 0) != (ssize_t)sizeof(DataHeader) ||
+        memcmp(header.magic, DATA_MAGIC, 4) || header.version != DATA_VERSION || header.endian != DATA_ENDIAN) {
+        printf("Could not read dataset file '%s'\n", path);
+        if (fd >= 0) close(fd);
+        return dataset;
+    }
+
+    if (!header.sample_count || batch_size <= 0) {
+        printf("Dataset file '%s' has no samples to batch\n", path);
+        close(fd);
+        return dataset;
+    }
+
+    /* Sample sizes must fit a Mat and every sample the header promises
+    must lie inside the file, so the loader never reads past its end. */
+
+    struct stat st;
+    uint64_t sample_bytes = ((uint64_t)header.input_size + header.target_size) * sizeof(float);
+    if (fstat(fd, &st) || !header.input_size || header.input_size > INT_MAX / 2 || header.target_size > INT_MAX / 2 ||
+        header.data_offset < sizeof(DataHeader) || header.data_offset > (uint64_t)st.st_size ||
+        header.sample_count > ((uint64_t)st.st_size - header.data_offset) / sample_bytes) {
+        printf("Dataset file '%s' is truncated or has a corrupt header\n", path);
+        close(fd);
+        return dataset;
+    }
+
+    if (chunk_size < batch_size) chunk_size = batch_size;
+    if ((uint64_t)chunk_size > header.sample_count) chunk_size = (int)header.sample_count;
+
+    Stream* s = (Stream*)nerv_calloc(1, sizeof(Stream));
+    s->fd = fd;
+    s->chunk_size = chunk_size;
+    s->chunk_count = (int)((header.sample_count + chunk_size - 1) / chunk_size);
+    s->shuffle = shuffle;
+    s->data_offset = header.data_offset;
+    s->rng = rng_create(randn(), 0);
+    s->sample_count = header.sample_count;
+    s->sample_floats = header.input_size + header.target_size;
+
+    int arena = nerv_arena_suspend();
+    for (int i = 0; i < 2; i++) {
+        s->chunks[i].inputs = matrix_empty(chunk_size, header.input_size);
+        s->chunks[i].targets = matrix_empty(chunk_size, header.target_size);
+    }
+    nerv_arena_resume(arena);
+    s->order = (int*)nerv_malloc(sizeof(int) * (s->chunk_count + chunk_size));
+    s->perm = s->order + s->chunk_count;
+    s->raw = (float*)nerv_malloc(sizeof(float) * chunk_size * s->sample_floats);
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    if (pthread_create(&s->thread, NULL, stream_worker, s)) {
+        printf("Dataset: Could not start the loader thread for '%s'\n", path);
+        stream_free(s);
+        return dataset;
+    }
+
+    dataset.input_size = header.input_size;
+    dataset.target_size = header.target_size;
+    dataset.sample_count = header.sample_count;
+    dataset.stream = s;
+    return dataset;
+}
+
+void dataset_close(Dataset* dataset)
+{
+    Stream* s = (Stream*)dataset->stream;
+    if (!s) return;
+
+    pthread_mutex_lock(&s->lock);
+    s->quit = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+
+    stream_free(s);
+    dataset->stream = NULL;
+}
+
+int dataset_next(Dataset* restrict dataset, Mat* restrict inputs, Mat* restrict targets)
+{
+    Stream* s = (Stream*)dataset->stream;
+    inputs->rows = targets->rows = 0;
+    if (!s) return 0;
+
+    pthread_mutex_lock(&s->lock);
+    Chunk* chunk = s->chunks + s->front;
+    if (s->held && s->cursor >= chunk->rows) {
+        int last = chunk->last;
+        chunk->ready = 0;
+        s->held = 0;
+        s->front ^= 1;
+        pthread_cond_broadcast(&s->cond);
+
+        if (last) {
+            pthread_mutex_unlock(&s->lock);
+            return 0;
+        }
+        chunk = s->chunks + s->front;
+    }
+
+    if (!s->held) {
+        while (!chunk->ready) {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        if (chunk->rows < 0) {
+            pthread_mutex_unlock(&s->lock);
+            return -1;
+        }
+        s->held = 1;
+        s->cursor = 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    int rows = chunk->rows - s->cursor < dataset->batch_size ? chunk->rows - s->cursor : dataset->batch_size;
+    inputs->rows = targets->rows = rows;
+    inputs->columns = dataset->input_size;
+    targets->columns = dataset->target_size;
+    inputs->data = chunk->inputs.data + (size_t)s->cursor * dataset->input_size;
+    targets->data = chunk->targets.data + (size_t)s->cursor * dataset->target_size;
+    s->cursor += rows;
+
+    return rows ? rows : dataset_next(dataset, inputs, targets);
+}
+
+float trainer_stream(Trainer* restrict trainer, const Model* restrict model, Dataset* restrict dataset, float alpha)
+{
+    if (!trainer->workers) {
+        printf("Trainer: Trainer has no workers, trainer_create failed\n");
+        return -1.0f;
+    }
+
+    Mat inputs, targets;
+    float cost = 0.0f;
+    int rows;
+    while ((rows = dataset_next(dataset, &inputs, &targets)) > 0) {
+        cost += trainer_epoch(trainer, model, &inputs, &targets, alpha);
+    }
+    return rows < 0 ? -1.0f : cost;
+}
@@ -0,0 +1,474 @@
+/*********************************************
+ *  lazy expression graphs with fused kernels
+ * ******************************************/
+
+#include <nerv.h>
+#include "activation.h"
+#include "thread.h"
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+/* A Graph records Vec and Mat expressions as nodes and only computes them
+when a node is evaluated into a destination. Inputs are views of the data
+they were recorded from, so a graph can be evaluated again after the
+inputs change in place.
+
+Evaluation fuses every connected run of element-wise nodes into one
+program that walks the output in tiles of GRAPH_TILE floats: each node
+of the program reads its operands straight from the inputs or from
+registers one tile wide, and the root writes the destination, so the
+temporaries of the expression never leave L1 and every input is read
+once. Products and softmax need whole rows or columns, so they are
+computed first into buffers the fused program then reads like inputs.
+Programs that run out of registers or leaves materialize the node that
+did not fit, or the largest operand of the root, and compile again. */
+
+#define GRAPH_INPUT 0
+#define GRAPH_ADD 1
+#define GRAPH_SUB 2
+#define GRAPH_HADAMARD 3
+#define GRAPH_SCALE 4
+#define GRAPH_ACTIVATE 5
+#define GRAPH_DERIV 6
+#define GRAPH_PRODUCT 7
+
+#define GRAPH_TILE 256
+#define GRAPH_SLOTS 16
+#define GRAPH_CODE 64
+#define GRAPH_LEAVES 32
+
+#define GRAPH_UNSET INT_MIN
+
+typedef struct {
+    int op, a, b, rows, columns, activation;
+    float n;
+    const float* data;
+} Node;
+
+/* Operands of an Instr are register slots when positive and leaves, the
+inputs and materialized nodes of the program, as -(leaf + 1) otherwise.
+The root writes the destination, out -1. */
+
+typedef struct {
+    int op, activation, x, y, out;
+    float n;
+} Instr;
+
+typedef struct {
+    int count, leaf_count, size;
+    Instr code[GRAPH_CODE];
+    const float* leaves[GRAPH_LEAVES];
+    float* dst;
+} Program;
+
+typedef struct {
+    const Graph* graph;
+    float** values;
+} Run;
+
+typedef struct {
+    Run* run;
+    Program* p;
+    int* where, *uses;
+    int free_slots, failed;
+} Compile;
+
+static int graph_fused(const Node* n)
+{
+    if (n->op == GRAPH_INPUT || n->op == GRAPH_PRODUCT) return 0;
+    return !((n->op == GRAPH_ACTIVATE || n->op == GRAPH_DERIV) && n->activation == NERV_ACTIVATION_SOFTMAX);
+}
+
+static int graph_binary(const Node* n)
+{
+    return n->op != GRAPH_SCALE && n->op != GRAPH_ACTIVATE;
+}
+
+static int graph_push(Graph* graph, Node node)
+{
+    if (graph->node_count == graph->capacity) {
+        int capacity = graph->capacity ? graph->capacity * 2 : 16;
+        Node* nodes = (Node*)nerv_malloc(sizeof(Node) * capacity);
+        if (graph->nodes) {
+            memcpy(nodes, graph->nodes, sizeof(Node) * graph->node_count);
+            nerv_free(graph->nodes);
+        }
+        graph->nodes = nodes;
+        graph->capacity = capacity;
+    }
+
+    ((Node*)graph->nodes)[graph->node_count] = node;
+    return graph->node_count++;
+}
+
+static const Node* graph_node(const Graph* graph, int node)
+{
+    return node >= 0 && node < graph->node_count ? (const Node*)graph->nodes + node : NULL;
+}
+
+static int graph_elementwise(Graph* graph, int op, int a, int b, float n, int activation)
+{
+    if (a < 0 || b < 0) return -1;
+
+    const Node* x = graph_node(graph, a), *y = graph_node(graph, b);
+    if (!x || !y) {
+        printf("Graph: Unknown node %d\n", x ? b : a);
+        return -1;
+    }
+    if (x->rows != y->rows || x->columns != y->columns) {
+        printf("Graph: Operands (%d x %d) and (%d x %d) are not the same size\n", x->rows, x->columns, y->rows, y->columns);
+        return -1;
+    }
+
+    Node node = {op, a, b, x->rows, x->columns, activation, n, NULL};
+    return graph_push(graph, node);
+}
+
+/*------------------------------------------*/
+
+/*          FUSED ELEMENT-WISE TILES        */
+
+/*------------------------------------------*/
+
+static void graph_tile(const Program* p, int start, int n)
+{
+    float slots[GRAPH_SLOTS][GRAPH_TILE];
+
+    for (const Instr* ins = p->code, *end = p->code + p->count; ins != end; ins++) {
+        const float* x = ins->x >= 0 ? slots[ins->x] : p->leaves[-ins->x - 1] + start;
+        const float* y = ins->y >= 0 ? slots[ins->y] : p->leaves[-ins->y - 1] + start;
+        float* o = ins->out >= 0 ? slots[ins->out] : p->dst + start;
+
+        switch (ins->op) {
+            case GRAPH_ADD:
+                for (int i = 0; i < n; i++) o[i] = x[i] + y[i];
+                break;
+            case GRAPH_SUB:
+                for (int i = 0; i < n; i++) o[i] = x[i] - y[i];
+                break;
+            case GRAPH_HADAMARD:
+                for (int i = 0; i < n; i++) o[i] = x[i] * y[i];
+                break;
+            case GRAPH_SCALE:
+                for (int i = 0; i < n; i++) o[i] = x[i] * ins->n;
+                break;
+            case GRAPH_ACTIVATE:
+                nerv_activate(ins->activation, o, x, 1, n);
+                break;
+            case GRAPH_DERIV:
+                if (ins->activation == NERV_ACTIVATION_RELU) {
+                    for (int i = 0; i < n; i++) o[i] = x[i] * _drelu(y[i]);
+                } else if (ins->activation == NERV_ACTIVATION_LEAKY_RELU) {
+                    for (int i = 0; i < n; i++) o[i] = x[i] * (_dleaky_relu(y[i], NERV_LEAKY_SLOPE));
+                } else if (ins->activation == NERV_ACTIVATION_LINEAR) {
+                    for (int i = 0; i < n; i++) o[i] = x[i];
+                } else {
+                    for (int i = 0; i < n; i++) o[i] = x[i] * _sigderiv(y[i]);
+                }
+                break;
+        }
+    }
+}
+
+static void graph_tiles(void* arg, int begin, int end)
+{
+    const Program* p = (const Program*)arg;
+    for (int t = begin; t < end; t++) {
+        int start = t * GRAPH_TILE;
+        graph_tile(p, start, p->size - start < GRAPH_TILE ? p->size - start : GRAPH_TILE);
+    }
+}
+
+/*------------------------------------------*/
+
+/*       COMPILATION AND MATERIALIZATION    */
+
+/*------------------------------------------*/
+
+static void graph_exec(Run* run, int node, float* dst);
+
+/* Inputs are read in place; other nodes outside a fused program are
+computed once per evaluation into a buffer kept until it ends. */
+
+static const float* graph_value(Run* run, int node)
+{
+    const Node* n = (const Node*)run->graph->nodes + node;
+    if (n->op == GRAPH_INPUT) return n->data;
+
+    if (!run->values[node]) {
+        float* buffer = (float*)nerv_malloc(sizeof(float) * n->rows * n->columns);
+        graph_exec(run, node, buffer);
+        run->values[node] = buffer;
+    }
+    return run->values[node];
+}
+
+static int graph_leaf(const Run* run, int node)
+{
+    const Node* n = (const Node*)run->graph->nodes + node;
+    return !graph_fused(n) || run->values[node];
+}
+
+static void graph_count(Compile* c, int node)
+{
+    const Node* n = (const Node*)c->run->graph->nodes + node;
+    int operands[2] = {n->a, n->b};
+
+    for (int i = 0; i < 1 + graph_binary(n); i++) {
+        if (!c->uses[operands[i]]++ && !graph_leaf(c->run, operands[i])) {
+            graph_count(c, operands[i]);
+        }
+    }
+}
+
+static void graph_release(Compile* c, int node, int source)
+{
+    if (!--c->uses[node] && source >= 0) c->free_slots |= 1 << source;
+}
+
+/* Nodes are emitted after their operands. Operand slots are released
+before the result takes one, so a node may overwrite the tile of an
+operand it was the last reader of. The tile loops and nerv_activate
+read every element before writing it, so that is safe. */
+
+static int graph_emit(Compile* c, int node, int root)
+{
+    if (c->where[node] != GRAPH_UNSET || c->failed >= 0) return c->where[node];
+
+    Program* p = c->p;
+    if (graph_leaf(c->run, node)) {
+        if (p->leaf_count == GRAPH_LEAVES) {
+            c->failed = node;
+            return 0;
+        }
+        p->leaves[p->leaf_count] = graph_value(c->run, node);
+        return c->where[node] = -(++p->leaf_count);
+    }
+
+    const Node* n = (const Node*)c->run->graph->nodes + node;
+    int binary = graph_binary(n);
+    int x = graph_emit(c, n->a, 0), y = binary ? graph_emit(c, n->b, 0) : x;
+    if (c->failed >= 0) {
+        if (graph_leaf(c->run, c->failed)) c->failed = node;
+        return 0;
+    }
+
+    graph_release(c, n->a, x);
+    if (binary) graph_release(c, n->b, y);
+
+    int out = -1;
+    if (!root) {
+        out = c->free_slots ? __builtin_ctz(c->free_slots) : -1;
+        if (out < 0 || p->count == GRAPH_CODE) {
+            c->failed = node;
+            return 0;
+        }
+        c->free_slots &= ~(1 << out);
+    }
+
+    Instr ins = {n->op, n->activation, x, y, out, n->n};
+    p->code[p->count++] = ins;
+    return c->where[node] = out;
+}
+
+static void graph_fuse(Run* run, int node, float* dst)
+{
+    const Node* n = (const Node*)run->graph->nodes + node;
+    int count = run->graph->node_count;
+    int* where = (int*)nerv_malloc(sizeof(int) * 2 * count), *uses = where + count;
+
+    Program p;
+    for (;;) {
+        for (int i = 0; i < count; i++) {
+            where[i] = GRAPH_UNSET;
+            uses[i] = 0;
+        }
+
+        p.count = p.leaf_count = 0;
+        Compile c = {run, &p, where, uses, (1 << GRAPH_SLOTS) - 1, -1};
+        graph_count(&c, node);
+        graph_emit(&c, node, 1);
+        if (c.failed < 0) break;
+
+        int k = c.failed;
+        if (k == node) k = graph_leaf(run, n->a) ? n->b : n->a;
+        graph_value(run, k);
+    }
+    nerv_free(where);
+
+    p.size = n->rows * n->columns;
+    p.dst = dst;
+    nerv_parallel((p.size + GRAPH_TILE - 1) / GRAPH_TILE, (size_t)p.size * p.count, graph_tiles, &p);
+}
+
+static void graph_exec(Run* run, int node, float* dst)
+{
+    const Node* n = (const Node*)run->graph->nodes + node;
+    if (graph_fused(n)) {
+        graph_fuse(run, node, dst);
+        return;
+    }
+
+    int size = n->rows * n->columns;
+    if (n->op == GRAPH_INPUT) {
+        if (dst != n->data) memcpy(dst, n->data, sizeof(float) * size);
+    } else if (n->op == GRAPH_PRODUCT) {
+        const Node* m = (const Node*)run->graph->nodes + n->a;
+        Mat w = {m->rows, m->columns, (float*)graph_value(run, n->a)};
+        float* x = (float*)graph_value(run, n->b);
+        if (n->rows == 1) {
+            Vec v = {m->columns, x}, out = {m->rows, dst};
+            vector_by_matrix_into(&out, &w, &v);
+        } else {
+            Mat a = {n->rows, m->columns, x}, out = {n->rows, n->columns, dst};
+            matrix_multiply_transposed_into(&out, &a, &w);
+        }
+    } else if (n->op == GRAPH_ACTIVATE) {
+        nerv_activate(n->activation, dst, graph_value(run, n->a), n->rows, n->columns);
+    } else {
+        const float* d = graph_value(run, n->a), *a = graph_value(run, n->b);
+        if (dst != d) memmove(dst, d, sizeof(float) * size);
+        nerv_activate_deriv(n->activation, dst, a, n->rows, n->columns);
+    }
+}
+
+static void graph_run(const Graph* graph, int node, float* dst, int rows, int columns)
+{
+    const Node* n = graph_node(graph, node);
+    if (!n) {
+        printf("Graph: Unknown node %d\n", node);
+        return;
+    }
+    if (n->rows != rows || n->columns != columns) {
+        printf("Graph: Node (%d x %d) does not fit destination (%d x %d)\n", n->rows, n->columns, rows, columns);
+        return;
+    }
+
+    /* Products and softmax read whole rows of their operands while they
+    write dst, so a destination that is also one of the inputs gets the
+    result through a buffer. */
+
+    float* out = dst;
+    for (int i = 0; !graph_fused(n) && out == dst && i < graph->node_count; i++) {
+        const Node* input = (const Node*)graph->nodes + i;
+        if (input->op == GRAPH_INPUT && input->data == dst && i != node) {
+            out = (float*)nerv_malloc(sizeof(float) * rows * columns);
+        }
+    }
+
+    Run run = {graph, (float**)nerv_calloc(graph->node_count, sizeof(float*))};
+    graph_exec(&run, node, out);
+    if (out != dst) {
+        memcpy(dst, out, sizeof(float) * rows * columns);
+        nerv_free(out);
+    }
+    for (int i = 0; i < graph->node_count; i++) {
+        if (run.values[i]) nerv_free(run.values[i]);
+    }
+    nerv_free(run.values);
+}
+
+/*------------------------------------------*/
+
+/*              GRAPH INTERFACE             */
+
+/*------------------------------------------*/
+
+Graph graph_create()
+{
+    Graph graph = {0, 0, NULL};
+    return graph;
+}
+
+void graph_free(Graph* graph)
+{
+    if (graph->nodes) nerv_free(graph->nodes);
+    graph->nodes = NULL;
+    graph->node_count = graph->capacity = 0;
+}
+
+void graph_clear(Graph* graph)
+{
+    graph->node_count = 0;
+}
+
+int graph_vector(Graph* restrict graph, const Vec* restrict v)
+{
+    Node node = {GRAPH_INPUT, -1, -1, 1, v->size, 0, 0.0f, v->data};
+    return graph_push(graph, node);
+}
+
+int graph_matrix(Graph* restrict graph, const Mat* restrict m)
+{
+    Node node = {GRAPH_INPUT, -1, -1, m->rows, m->columns, 0, 0.0f, m->data};
+    return graph_push(graph, node);
+}
+
+int graph_add(Graph* graph, int a, int b)
+{
+    return graph_elementwise(graph, GRAPH_ADD, a, b, 0.0f, 0);
+}
+
+int graph_sub(Graph* graph, int a, int b)
+{
+    return graph_elementwise(graph, GRAPH_SUB, a, b, 0.0f, 0);
+}
+
+int graph_hadamard(Graph* graph, int a, int b)
+{
+    return graph_elementwise(graph, GRAPH_HADAMARD, a, b, 0.0f, 0);
+}
+
+int graph_scale(Graph* graph, int a, float n)
+{
+    return graph_elementwise(graph, GRAPH_SCALE, a, a, n, 0);
+}
+
+int graph_activate(Graph* graph, int z, int activation)
+{
+    if (activation < 0 || activation >= NERV_ACTIVATIONS) {
+        printf("Graph: Unknown activation %d\n", activation);
+        return -1;
+    }
+
+    return activation == NERV_ACTIVATION_LINEAR ? z : graph_elementwise(graph, GRAPH_ACTIVATE, z, z, 0.0f, activation);
+}
+
+int graph_deriv(Graph* graph, int d, int a, int activation)
+{
+    if (activation < 0 || activation >= NERV_ACTIVATIONS) {
+        printf("Graph: Unknown activation %d\n", activation);
+        return -1;
+    }
+
+    return activation == NERV_ACTIVATION_LINEAR ? d : graph_elementwise(graph, GRAPH_DERIV, d, a, 0.0f, activation);
+}
+
+int graph_by_matrix(Graph* graph, int mat, int x)
+{
+    if (mat < 0 || x < 0) return -1;
+
+    const Node* m = graph_node(graph, mat), *v = graph_node(graph, x);
+    if (!m || !v) {
+        printf("Graph: Unknown node %d\n", m ? x : mat);
+        return -1;
+    }
+    if (v->columns != m->columns) {
+        printf("Graph: Rows of (%d x %d) must have as many columns as matrix (%d x %d)\n", v->rows, v->columns, m->rows, m->columns);
+        return -1;
+    }
+
+    Node node = {GRAPH_PRODUCT, mat, x, v->rows, m->rows, 0, 0.0f, NULL};
+    return graph_push(graph, node);
+}
+
+void graph_eval_vector(const Graph* restrict graph, int node, const Vec* restrict dst)
+{
+    graph_run(graph, node, dst->data, 1, dst->size);
+}
+
+void graph_eval_matrix(const Graph* restrict graph, int node, const Mat* restrict dst)
+{
+    graph_run(graph, node, dst->data, dst->rows, dst->columns);
+}
@@ -4,7 +4,9 @@
  * ******************************************/
 
 #include <nerv.h>
+#include "alloc.h"
 #include <stdlib.h>
+#include <string.h>
 
 Layer layer_create(int layer_size, int next_layer_size)
 {
@@ -12,36 +14,41 @@ Layer layer_create(int layer_size, int next_layer_size)
     layer.w.columns = 0;
     layer.w.rows = 0;
     layer.w.data = NULL;
+    layer.activation = NERV_ACTIVATION_SIGMOID;
+    memset(&layer.s, 0, sizeof(SMat));
 
+    int arena = nerv_arena_suspend();
     layer.a = vector(layer_size);
     layer.b = vector(layer_size);
     layer.z = vector(layer_size);
     layer.d = vector(layer_size);
-    if (!next_layer_size) return layer;
-
-    layer.w = matrix(next_layer_size, layer_size);
+    if (next_layer_size) layer.w = matrix(next_layer_size, layer_size);
+    nerv_arena_resume(arena);
     return layer;
 }
 
 Layer layer_copy(const Layer* restrict layer)
 {
     Layer ret;
-    ret.w.columns = 0;
-    ret.w.rows = 0;
+    ret.w = layer->w;
     ret.w.data = NULL;
+    ret.activation = layer->activation;
+    memset(&ret.s, 0, sizeof(SMat));
+    if (layer->s.offsets) ret.s = smatrix_copy(&layer->s);
 
+    int arena = nerv_arena_suspend();
     ret.a = vector_copy(&layer->a);
     ret.b = vector_copy(&layer->b);
     ret.z = vector_copy(&layer->z);
     ret.d = vector_copy(&layer->d);
-    if (!layer->w.data) return ret;
-
-    ret.w = matrix_copy(&layer->w);
+    if (layer->w.data) ret.w = matrix_copy(&layer->w);
+    nerv_arena_resume(arena);
     return ret;
 }
 
 void layer_matrix_free(Layer* layer)
 {
+    if (layer->s.offsets) smatrix_free(&layer->s);
     matrix_free(&layer->w);
 }
 
@@ -57,4 +64,16 @@ void layer_free(Layer* layer)
 {
     layer_matrix_free(layer);
     layer_vector_free(layer);
-}
\ No newline at end of file
+}
+
+void layer_forward(const Layer* restrict layer, const Layer* restrict next_layer, const Vec* a, const Vec* z, const Vec* next_a)
+{
+    if (layer->s.offsets) vector_sparse_into(z, next_a, &layer->s, a, &next_layer->b, next_layer->activation);
+    else vector_dense_into(z, next_a, &layer->w, a, &next_layer->b, next_layer->activation);
+}
+
+void layer_backwards(const Layer* restrict layer, const Layer* restrict next_layer)
+{
+    if (layer->s.offsets) vector_sparse_deriv_into(&layer->d, &layer->s, &next_layer->d, &layer->a, layer->activation);
+    else vector_dense_deriv_into(&layer->d, &layer->w, &next_layer->d, &layer->a, layer->activation);
+}
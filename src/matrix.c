@@ -4,7 +4,7 @@
  * ******************************************/
 
 #include <nerv.h>
-#include <stdlib.h>
+#include "alloc.h"
 #include <stdarg.h>
 #include <string.h>
 
@@ -13,7 +13,19 @@ Mat matrix(int rows, int columns)
     Mat mat;
     mat.rows = rows;
     mat.columns = columns;
-    mat.data = (float*)calloc(rows * columns, sizeof(float));
+    mat.data = (float*)nerv_tensor_calloc(rows * columns, sizeof(float));
+    return mat;
+}
+
+/* matrix_empty leaves the data uninitialized for buffers that are
+written in full before they are read. */
+
+Mat matrix_empty(int rows, int columns)
+{
+    Mat mat;
+    mat.rows = rows;
+    mat.columns = columns;
+    mat.data = (float*)nerv_tensor_malloc(sizeof(float) * rows * columns);
     return mat;
 }
 
@@ -30,7 +42,7 @@ Mat matrix_identity(int size)
 
 Mat matrix_create(int rows, int columns, ...)
 {
-    Mat m = matrix(rows, columns);
+    Mat m = matrix_empty(rows, columns);
     columns *= rows;
     float* f = m.data;
 
@@ -46,7 +58,7 @@ Mat matrix_create(int rows, int columns, ...)
 
 Mat matrix_uniform(int rows, int columns, float val)
 {
-    Mat m = matrix(rows, columns);
+    Mat m = matrix_empty(rows, columns);
     int size = rows * columns;
     
     float* f = m.data;
@@ -59,19 +71,19 @@ Mat matrix_uniform(int rows, int columns, float val)
 
 Mat matrix_copy(const Mat* restrict mat)
 {
-    Mat ret = matrix(mat->rows, mat->columns);
+    Mat ret = matrix_empty(mat->rows, mat->columns);
     memcpy(ret.data, mat->data, sizeof(float) * mat->rows * mat->columns);
     return ret;
 }
 
 Mat matrix_vector(const Vec* restrict v)
 {
-    Mat m = matrix(v->size, 1);
+    Mat m = matrix_empty(v->size, 1);
     memcpy(m.data, v->data, sizeof(float) * v->size);
     return m;
 }
 
 void matrix_free(Mat* mat)
 {
-    free(mat->data);
+    nerv_free(mat->data);
 }
@@ -3,71 +3,370 @@
  *       matrix functions and operations
  * ******************************************/
 
-#define MATRIX_AT(m, x, y) (m->data + (m->columns * (y)) + (x))
-
 #include <nerv.h>
+#include "simd.h"
+#include "thread.h"
 #include <stdio.h>
+#include <string.h>
+
+/* The _into functions write every element of dst and the allocating ones
+run them over a fresh matrix_empty, zeroed first when the shapes do not
+match and the _into leaves it untouched. Scale and Hadamard allow dst to be
+one of the sources, so they also work in place; transposes and products
+need a dst of its own, matrix_transpose_inplace transposes in place. */
+
+void matrix_scale_into(const Mat* dst, const Mat* mat, float scale)
+{
+    if (dst->rows != mat->rows || dst->columns != mat->columns) {
+        printf("Scale: Destination and source matrices are not the same size\n");
+        return;
+    }
+
+    int size = mat->rows * mat->columns;
+    if (dst->data != mat->data) memcpy(dst->data, mat->data, size * sizeof(float));
+    nerv_kernels.scale(dst->data, scale, size);
+}
 
 Mat matrix_scale(const Mat* restrict mat, float scale)
 {
-    Mat ret = matrix_copy(mat);
-    int size = ret.rows * ret.columns;
+    Mat ret = matrix_empty(mat->rows, mat->columns);
+    matrix_scale_into(&ret, mat, scale);
+    return ret;
+}
+
+void matrix_hadamard_into(const Mat* dst, const Mat* a, const Mat* b)
+{
+    if (a->rows != b->rows || a->columns != b->columns || dst->rows != a->rows || dst->columns != a->columns) {
+        printf("Matrixes are not equal for Hadamard Product\n");
+        return;
+    }
 
-    float* f = ret.data;
-    for (float* end = f + size; f != end; f++) {
-        *f *= scale;
+    int size = a->rows * a->columns;
+    if (dst->data == b->data) {
+        nerv_kernels.hadamard(dst->data, a->data, size);
+        return;
     }
 
-    return ret;
+    if (dst->data != a->data) memcpy(dst->data, a->data, size * sizeof(float));
+    nerv_kernels.hadamard(dst->data, b->data, size);
 }
 
 Mat matrix_hadamard(const Mat* restrict a, const Mat* restrict b)
 {
-    Mat ret = matrix(a->rows, a->columns);
-    if ((a->rows != b->rows) || (a->columns != b->columns)) {
+    Mat ret = matrix_empty(a->rows, a->columns);
+    if (a->rows != b->rows || a->columns != b->columns) {
         printf("Matrixes are not equal for Hadamard Product\n");
+        memset(ret.data, 0, sizeof(float) * a->rows * a->columns);
         return ret;
     }
 
-    int size = ret.rows * ret.columns;
-    float* f = ret.data, *af = a->data, *bf = a->data;
-    for (float* end = f + size; f != end; f++, af++, bf++) {
-        *f = (*af) * (*bf);
+    matrix_hadamard_into(&ret, a, b);
+    return ret;
+}
+
+/* Transposes walk TRANSPOSE_BLOCK square blocks, small enough that the
+source and destination block stay in L1 together, so every cache line
+and page is brought in once instead of once per element written. Inside
+a block the tile kernel of the SIMD table turns T rows into T columns in
+registers; rows and columns past the last whole tile are copied one
+element at a time. Row blocks of the source are split across the pool.
+
+The in place transpose of a square matrix swaps block (y, x) with block
+(x, y) through a stack buffer. Task i takes block rows i and n - 1 - i
+so every task swaps about the same number of blocks. */
+
+#define TRANSPOSE_BLOCK 64
+
+static void transpose_scalar(float* restrict dst, int ldd, const float* restrict src, int lds, int rows, int columns)
+{
+    for (int y = 0; y < rows; y++) {
+        for (int x = 0; x < columns; x++) {
+            dst[x * ldd + y] = src[y * lds + x];
+        }
     }
+}
 
-    return ret;
+static void transpose_block(float* restrict dst, int ldd, const float* restrict src, int lds, int rows, int columns)
+{
+    int t = nerv_kernels.transpose_tile;
+    int tr = rows - rows % t, tc = columns - columns % t;
+    
+    for (int y = 0; y < tr; y += t) {
+        for (int x = 0; x < tc; x += t) {
+            nerv_kernels.transpose(src + y * lds + x, lds, dst + x * ldd + y, ldd);
+        }
+    }
+    
+    transpose_scalar(dst + tc * ldd, ldd, src + tc, lds, tr, columns - tc);
+    transpose_scalar(dst + tr, ldd, src + tr * lds, lds, rows - tr, columns);
 }
 
-Mat matrix_transpose(const Mat* restrict m)
+typedef struct {
+    float* dst;
+    const float* src;
+    int rows, columns;
+} Transpose;
+
+static void matrix_transpose_rows(void* arg, int begin, int end)
+{
+    const Transpose* op = (const Transpose*)arg;
+    int rows = op->rows, columns = op->columns;
+    
+    for (int y = begin * TRANSPOSE_BLOCK; y < rows && y < end * TRANSPOSE_BLOCK; y += TRANSPOSE_BLOCK) {
+        int h = rows - y < TRANSPOSE_BLOCK ? rows - y : TRANSPOSE_BLOCK;
+        for (int x = 0; x < columns; x += TRANSPOSE_BLOCK) {
+            int w = columns - x < TRANSPOSE_BLOCK ? columns - x : TRANSPOSE_BLOCK;
+            transpose_block(op->dst + (size_t)x * rows + y, rows, op->src + (size_t)y * columns + x, columns, h, w);
+        }
+    }
+}
+
+static void transpose_swap_row(const Transpose* op, int by)
 {
-    Mat ret = matrix(m->columns, m->rows); Mat* r = &ret;
+    float tmp[TRANSPOSE_BLOCK * TRANSPOSE_BLOCK];
+    int n = op->rows, y = by * TRANSPOSE_BLOCK, h = n - y < TRANSPOSE_BLOCK ? n - y : TRANSPOSE_BLOCK;
     
-    float *f = m->data;
-    for (int y = 0; y < m->rows; y++) {
-        for (int x = 0; x < m->columns; x++, f++) {
-            *MATRIX_AT(r, y, x) = *f;
+    for (int x = y; x < n; x += TRANSPOSE_BLOCK) {
+        int w = n - x < TRANSPOSE_BLOCK ? n - x : TRANSPOSE_BLOCK;
+        float* a = op->dst + (size_t)y * n + x, *b = op->dst + (size_t)x * n + y;
+        
+        transpose_block(tmp, h, a, n, h, w);
+        if (x != y) transpose_block(a, n, b, n, w, h);
+        for (int r = 0; r < w; r++) {
+            memcpy(b + (size_t)r * n, tmp + r * h, h * sizeof(float));
         }
     }
+}
+
+static void matrix_transpose_square_rows(void* arg, int begin, int end)
+{
+    const Transpose* op = (const Transpose*)arg;
+    int blocks = (op->rows + TRANSPOSE_BLOCK - 1) / TRANSPOSE_BLOCK;
+    
+    for (int i = begin; i < end; i++) {
+        transpose_swap_row(op, i);
+        if (blocks - 1 - i != i) transpose_swap_row(op, blocks - 1 - i);
+    }
+}
+
+void matrix_transpose_into(const Mat* restrict dst, const Mat* restrict src)
+{
+    if (dst->rows != src->columns || dst->columns != src->rows) {
+        printf("Transpose: Destination must have as many rows as source columns and columns as source rows\n");
+        return;
+    }
+
+    if (dst->data == src->data) {
+        printf("Transpose: Destination and source are the same, use matrix_transpose_inplace\n");
+        return;
+    }
 
+    Transpose op = {dst->data, src->data, src->rows, src->columns};
+    int blocks = (src->rows + TRANSPOSE_BLOCK - 1) / TRANSPOSE_BLOCK;
+    nerv_parallel(blocks, (size_t)src->rows * src->columns, matrix_transpose_rows, &op);
+}
+
+void matrix_transpose_inplace(const Mat* restrict mat)
+{
+    if (mat->rows != mat->columns) {
+        printf("Transpose: In place transpose needs a square matrix\n");
+        return;
+    }
+
+    Transpose op = {mat->data, mat->data, mat->rows, mat->columns};
+    int blocks = (mat->rows + TRANSPOSE_BLOCK - 1) / TRANSPOSE_BLOCK;
+    nerv_parallel((blocks + 1) / 2, (size_t)mat->rows * mat->columns, matrix_transpose_square_rows, &op);
+}
+
+Mat matrix_transpose(const Mat* restrict m)
+{
+    Mat ret = matrix_empty(m->columns, m->rows);
+    matrix_transpose_into(&ret, m);
     return ret;
 }
 
-Mat matrix_multiply(const Mat* restrict a, const Mat* restrict b)
+/* Blocked GEMM: C += A * B where A is (m x k) and B is (k x n), each read
+through a row and column stride so transposed operands need no copy.
+Panels of A (GEMM_MC x GEMM_KC) and B (GEMM_KC x GEMM_NC) are packed into
+contiguous buffers that fit in cache and zero padded to whole register
+tiles, then the mr x nr micro-kernel of the active SIMD table walks the
+packed panels. GEMM_MC and GEMM_NC are multiples of every tile size. */
+
+#define GEMM_MC 96
+#define GEMM_KC 256
+#define GEMM_NC 512
+
+typedef struct {
+    const float* data;
+    int rs, cs;
+} Operand;
+
+static void gemm_pack_a(float* restrict dst, const Operand* a, int i0, int k0, int mc, int kc, int tile)
 {
-    Mat ret = matrix(a->rows, b->columns);
-    if (a->columns != b->rows) {
-        printf("Number of columns in first matrix must be equal to number of rows in second\n");
-        return ret;
+    for (int i = 0; i < mc; i += tile) {
+        int mr = mc - i < tile ? mc - i : tile;
+        for (int k = 0; k < kc; k++) {
+            const float* src = a->data + (i0 + i) * a->rs + (k0 + k) * a->cs;
+            int r = 0;
+            for (; r < mr; r++) *(dst++) = src[r * a->rs];
+            for (; r < tile; r++) *(dst++) = 0.0f;
+        }
     }
+}
+
+static void gemm_pack_b(float* restrict dst, const Operand* b, int k0, int j0, int kc, int nc, int tile)
+{
+    for (int j = 0; j < nc; j += tile) {
+        int nr = nc - j < tile ? nc - j : tile;
+        for (int k = 0; k < kc; k++) {
+            const float* src = b->data + (k0 + k) * b->rs + (j0 + j) * b->cs;
+            int c = 0;
+            for (; c < nr; c++) *(dst++) = src[c * b->cs];
+            for (; c < tile; c++) *(dst++) = 0.0f;
+        }
+    }
+}
+
+static void gemm(int m, int n, int k, const Operand* a, const Operand* b, float* c, int ldc)
+{
+    const Kernels* kernels = &nerv_kernels;
+    int tm = kernels->gemm_mr, tn = kernels->gemm_nr;
+    float* pack_a = nerv_scratch(0, GEMM_MC * GEMM_KC);
+    float* pack_b = nerv_scratch(1, GEMM_KC * GEMM_NC);
 
-    float* f = ret.data;
-    for (int y = 0; y < ret.rows; y++) {
-        for (int x = 0; x < ret.columns; x++, f++) {
-            for (int z = 0; z < a->columns; z++) {
-                *f += (*MATRIX_AT(a, z, y)) * (*MATRIX_AT(b, x, z));
+    for (int j0 = 0; j0 < n; j0 += GEMM_NC) {
+        int nc = n - j0 < GEMM_NC ? n - j0 : GEMM_NC;
+        for (int k0 = 0; k0 < k; k0 += GEMM_KC) {
+            int kc = k - k0 < GEMM_KC ? k - k0 : GEMM_KC;
+            gemm_pack_b(pack_b, b, k0, j0, kc, nc, tn);
+
+            for (int i0 = 0; i0 < m; i0 += GEMM_MC) {
+                int mc = m - i0 < GEMM_MC ? m - i0 : GEMM_MC;
+                gemm_pack_a(pack_a, a, i0, k0, mc, kc, tm);
+
+                for (int j = 0; j < nc; j += tn) {
+                    int nr = nc - j < tn ? nc - j : tn;
+                    for (int i = 0; i < mc; i += tm) {
+                        int mr = mc - i < tm ? mc - i : tm;
+                        kernels->gemm(
+                            kc, pack_a + i * kc, pack_b + j * kc,
+                            c + (i0 + i) * ldc + j0 + j, ldc, mr, nr
+                        );
+                    }
+                }
             }
         }
     }
-    
+}
+
+/* The pool splits the output along its larger dimension and every thread
+runs the blocked GEMM on its own slice with its own packing buffers.
+The _into products clear their slice first and so compute C = A * B,
+the _acc ones add to what C holds. Neither allows C to alias A or B. */
+
+typedef struct {
+    int m, n, k, ldc, clear;
+    Operand a, b;
+    float* c;
+} Gemm;
+
+static void gemm_rows(void* arg, int begin, int end)
+{
+    const Gemm* op = (const Gemm*)arg;
+    Operand a = op->a;
+    a.data += begin * a.rs;
+    for (int y = begin; op->clear && y < end; y++) {
+        memset(op->c + (size_t)y * op->ldc, 0, op->n * sizeof(float));
+    }
+    gemm(end - begin, op->n, op->k, &a, &op->b, op->c + begin * op->ldc, op->ldc);
+}
+
+static void gemm_columns(void* arg, int begin, int end)
+{
+    const Gemm* op = (const Gemm*)arg;
+    Operand b = op->b;
+    b.data += begin * b.cs;
+    for (int y = 0; op->clear && y < op->m; y++) {
+        memset(op->c + (size_t)y * op->ldc + begin, 0, (end - begin) * sizeof(float));
+    }
+    gemm(op->m, end - begin, op->k, &op->a, &b, op->c + begin, op->ldc);
+}
+
+static void gemm_parallel(int m, int n, int k, Operand a, Operand b, float* c, int ldc, int clear)
+{
+    Gemm op = {m, n, k, ldc, clear, a, b, c};
+    size_t work = (size_t)m * n * k;
+    if (m >= n) nerv_parallel(m, work, gemm_rows, &op);
+    else nerv_parallel(n, work, gemm_columns, &op);
+}
+
+static void multiply(const Mat* restrict dst, const Mat* restrict a, const Mat* restrict b, int clear)
+{
+    if (a->columns != b->rows || dst->rows != a->rows || dst->columns != b->columns) {
+        printf("Number of columns in first matrix must be equal to number of rows in second\n");
+        return;
+    }
+
+    Operand oa = {a->data, a->columns, 1}, ob = {b->data, b->columns, 1};
+    gemm_parallel(a->rows, b->columns, a->columns, oa, ob, dst->data, dst->columns, clear);
+}
+
+static void multiply_transposed(const Mat* restrict dst, const Mat* restrict a, const Mat* restrict b, int clear)
+{
+    if (a->columns != b->columns || dst->rows != a->rows || dst->columns != b->rows) {
+        printf("Number of columns in first matrix must be equal to number of columns in second\n");
+        return;
+    }
+
+    Operand oa = {a->data, a->columns, 1}, ob = {b->data, 1, b->columns};
+    gemm_parallel(a->rows, b->rows, a->columns, oa, ob, dst->data, dst->columns, clear);
+}
+
+static void transposed_multiply(const Mat* restrict dst, const Mat* restrict a, const Mat* restrict b, int clear)
+{
+    if (a->rows != b->rows || dst->rows != a->columns || dst->columns != b->columns) {
+        printf("Number of rows in first matrix must be equal to number of rows in second\n");
+        return;
+    }
+
+    Operand oa = {a->data, 1, a->columns}, ob = {b->data, b->columns, 1};
+    gemm_parallel(a->columns, b->columns, a->rows, oa, ob, dst->data, dst->columns, clear);
+}
+
+void matrix_multiply_into(const Mat* restrict dst, const Mat* restrict a, const Mat* restrict b)
+{
+    multiply(dst, a, b, 1);
+}
+
+void matrix_multiply_acc(const Mat* restrict dst, const Mat* restrict a, const Mat* restrict b)
+{
+    multiply(dst, a, b, 0);
+}
+
+void matrix_multiply_transposed_into(const Mat* restrict dst, const Mat* restrict a, const Mat* restrict b)
+{
+    multiply_transposed(dst, a, b, 1);
+}
+
+void matrix_multiply_transposed_acc(const Mat* restrict dst, const Mat* restrict a, const Mat* restrict b)
+{
+    multiply_transposed(dst, a, b, 0);
+}
+
+void matrix_transposed_multiply_into(const Mat* restrict dst, const Mat* restrict a, const Mat* restrict b)
+{
+    transposed_multiply(dst, a, b, 1);
+}
+
+void matrix_transposed_multiply_acc(const Mat* restrict dst, const Mat* restrict a, const Mat* restrict b)
+{
+    transposed_multiply(dst, a, b, 0);
+}
+
+Mat matrix_multiply(const Mat* restrict a, const Mat* restrict b)
+{
+    Mat ret = matrix_empty(a->rows, b->columns);
+    if (a->columns != b->rows) memset(ret.data, 0, sizeof(float) * a->rows * b->columns);
+    matrix_multiply_into(&ret, a, b);
     return ret;
-}
\ No newline at end of file
+}
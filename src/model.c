@@ -3,18 +3,148 @@
  *    neural network model data structure 
  * ******************************************/
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <nerv.h>
+#include <sys/mman.h>
 #include <stdarg.h>
-#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+/* model_build lays a whole model out in one 64 byte aligned arena:
+
+    [ Layer array | w0 b0 w1 b1 ... | a0 z0 d0 a1 z1 d1 ... ]
+
+Every tensor starts on a 64 byte boundary, all parameters are contiguous
+and exposed as model.params, and copying or freeing the model touches a
+single allocation. model_build_params binds the parameters to memory the
+caller provides instead, such as a mapped model file. Models assembled by hand from model_new and
+layer_create have no arena and keep per-layer ownership. */
+
+#define ARENA_ALIGN 64
+#define ARENA_FLOATS(n) (((n) + 15) & ~15)
+
+static size_t model_activation_size(int layer_count, const int* layer_sizes)
+{
+    size_t size = 0;
+    for (int i = 0; i < layer_count; i++) {
+        size += 3 * ARENA_FLOATS(layer_sizes[i]);
+    }
+    return size;
+}
+
+static size_t model_layers_size(int layer_count)
+{
+    return ARENA_FLOATS(sizeof(Layer) * layer_count / sizeof(float)) * sizeof(float);
+}
+
+int model_param_size(const Model* restrict model)
+{
+    int size = 0;
+    Layer* layer = model->layers;
+    for (Layer* end = layer + model->layer_count; layer != end; layer++) {
+        size += ARENA_FLOATS(layer->w.rows * layer->w.columns) + ARENA_FLOATS(layer->b.size);
+    }
+    return size;
+}
+
+void model_bind_params(const Model* restrict model, float* data, Mat* w, Vec* b)
+{
+    Layer* layer = model->layers;
+    for (int i = 0; i < model->layer_count; i++, layer++) {
+        int size = layer->w.rows * layer->w.columns;
+        w[i].rows = layer->w.rows;
+        w[i].columns = layer->w.columns;
+        w[i].data = size ? data : NULL;
+        data += ARENA_FLOATS(size);
+
+        b[i].size = layer->b.size;
+        b[i].data = data;
+        data += ARENA_FLOATS(layer->b.size);
+    }
+}
 
 Model model_new(int layer_count)
 {
     Model model = {
         layer_count,
-        (Layer*)malloc(sizeof(Layer) * layer_count)
+        (Layer*)nerv_malloc(sizeof(Layer) * layer_count),
+        {0, NULL}, NULL, NULL, 0
     };  return model;
 }
 
+static Model model_arena(int layer_count, const int* restrict layer_sizes, float* params)
+{
+    int param_size = 0;
+    for (int i = 0; i < layer_count; i++) {
+        int next = i < layer_count - 1 ? layer_sizes[i + 1] : 0;
+        param_size += ARENA_FLOATS(next * layer_sizes[i]) + ARENA_FLOATS(layer_sizes[i]);
+    }
+
+    size_t layers_size = model_layers_size(layer_count);
+    size_t size = model_activation_size(layer_count, layer_sizes);
+    if (!params) size += param_size;
+    
+    Model model;
+    model.layer_count = layer_count;
+    model.arena = nerv_malloc(layers_size + sizeof(float) * size + ARENA_ALIGN);
+    model.map = NULL;
+    model.map_size = 0;
+    
+    char* base = (char*)(((uintptr_t)model.arena + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1));
+    float* f = (float*)(base + layers_size);
+    
+    model.layers = (Layer*)base;
+    model.params.size = param_size;
+    model.params.data = params ? params : f;
+
+    float* p = model.params.data;
+    for (int i = 0; i < layer_count; i++) {
+        Layer* layer = model.layers + i;
+        int size = layer_sizes[i], next = i < layer_count - 1 ? layer_sizes[i + 1] : 0;
+        
+        layer->w.rows = next;
+        layer->w.columns = next ? size : 0;
+        layer->w.data = next ? p : NULL;
+        p += ARENA_FLOATS(next * size);
+
+        layer->b.size = size;
+        layer->b.data = p;
+        p += ARENA_FLOATS(size);
+        layer->activation = NERV_ACTIVATION_SIGMOID;
+        memset(&layer->s, 0, sizeof(SMat));
+    }
+
+    if (!params) f = p;
+    for (int i = 0; i < layer_count; i++) {
+        Layer* layer = model.layers + i;
+        int size = layer_sizes[i];
+        
+        layer->a.size = layer->z.size = layer->d.size = size;
+        layer->a.data = f;
+        layer->z.data = f + ARENA_FLOATS(size);
+        layer->d.data = f + 2 * ARENA_FLOATS(size);
+        f += 3 * ARENA_FLOATS(size);
+    }
+
+    return model;
+}
+
+Model model_build(int layer_count, const int* restrict layer_sizes)
+{
+    Model model = model_arena(layer_count, layer_sizes, NULL);
+    memset(model.params.data, 0, sizeof(float) * model.params.size);
+    memset(model.layers->a.data, 0, sizeof(float) * model_activation_size(layer_count, layer_sizes));
+    return model;
+}
+
+Model model_build_params(int layer_count, const int* restrict layer_sizes, float* params)
+{
+    Model model = model_arena(layer_count, layer_sizes, params);
+    memset(model.layers->a.data, 0, sizeof(float) * model_activation_size(layer_count, layer_sizes));
+    return model;
+}
+
 Model model_create(int layer_count, ...)
 {   
     int neuron_counts[layer_count];
@@ -26,32 +156,53 @@ Model model_create(int layer_count, ...)
     }
     va_end(args);
 
-    Model model = model_new(layer_count);
-    Layer* layer = model.layers;
-
-    for (int i = 0; i < layer_count; i++) {
-        int next = 0;
-        if (i < layer_count - 1) next = neuron_counts[i + 1];
-        *(layer++) = layer_create(neuron_counts[i], next);
-    } 
-
-    return model;
+    return model_build(layer_count, neuron_counts);
 }
 
 Model model_copy(const Model* restrict model)
 {
-    Model ret = model_new(model->layer_count);
-    Layer* layer = ret.layers, *l = model->layers;
-    
-    for (int i = 0; i < ret.layer_count; i++) {
-        *(layer++) = layer_copy(l++);
-    } 
+    if (!model->arena) {
+        Model ret = model_new(model->layer_count);
+        Layer* layer = ret.layers, *l = model->layers;
+        
+        for (int i = 0; i < ret.layer_count; i++) {
+            *(layer++) = layer_copy(l++);
+        } 
+
+        return ret;
+    }
 
+    int layer_sizes[model->layer_count];
+    for (int i = 0; i < model->layer_count; i++) {
+        layer_sizes[i] = model->layers[i].a.size;
+    }
+
+    Model ret = model_arena(model->layer_count, layer_sizes, NULL);
+    memcpy(ret.params.data, model->params.data, sizeof(float) * model->params.size);
+    memcpy(ret.layers->a.data, model->layers->a.data, sizeof(float) * 
+        model_activation_size(model->layer_count, layer_sizes));
+    for (int i = 0; i < model->layer_count; i++) {
+        ret.layers[i].activation = model->layers[i].activation;
+        if (model->layers[i].s.offsets) ret.layers[i].s = smatrix_copy(&model->layers[i].s);
+    }
     return ret;
 }
 
 void model_free(Model* model)
 {
+    if (!model->layers) return;
+    if (model->map) {
+        munmap(model->map, model->map_size);
+    }
+
+    if (model->arena) {
+        for (int i = 0; i < model->layer_count; i++) {
+            if (model->layers[i].s.offsets) smatrix_free(&model->layers[i].s);
+        }
+        nerv_free(model->arena);
+        return;
+    }
+
     Layer* layer = model->layers;
     for (int i = 0; i < model->layer_count - 1; i++) {
         layer_free(layer);
@@ -59,5 +210,5 @@ void model_free(Model* model)
     }
 
     layer_vector_free(layer);
-    free(model->layers);
-}
\ No newline at end of file
+    nerv_free(model->layers);
+}
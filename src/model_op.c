@@ -4,33 +4,56 @@
  * ******************************************/
 
 #include <nerv.h>
+#include "simd.h"
+#include "thread.h"
+#include "profile.h"
+#include "sparse.h"
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 
-static void vector_swap(Vec func, Vec* v)
-{
-    memcpy(v->data, func.data, v->size * sizeof(float));
-    vector_free(&func);
-}
+typedef struct {
+    Mat* m;
+    Vec* a, *b;
+    float scale;
+} MatVecVec;
 
-static Vec vector_by_matrix_plus(Mat* m, Vec* a, Vec* b)
+static void matrix_minus_vec_by_vec_rows(void* arg, int begin, int end)
 {
-    Vec ret = vector_by_matrix(m, a);
-    vector_add(&ret, b);
-    return ret;
+    const MatVecVec* op = (const MatVecVec*)arg;
+    Mat* m = op->m;
+    
+    float *f = m->data + begin * m->columns;
+    for (int y = begin; y < end; y++, f += m->columns) {
+        nerv_kernels.axpy(f, -op->scale * op->b->data[y], op->a->data, m->columns);
+    }
 }
 
-static void matrix_minus_vec_by_vec(Mat* m, Vec* a, Vec* b)
+static void matrix_minus_vec_by_vec(Mat* m, Vec* a, Vec* b, float scale)
 {
     if (a->size != m->columns || b->size != m->rows) {
         printf("Vector and matrix are not the same size!\n");
         return;
     }
 
-    float *f = m->data;
-    for (int y = 0; y < m->rows; y++) {
-        for (int x = 0; x < m->columns; x++) {
-            *(f++) -= a->data[x] * b->data[y];
+    MatVecVec op = {m, a, b, scale};
+    nerv_parallel(m->rows, (size_t)m->rows * m->columns, matrix_minus_vec_by_vec_rows, &op);
+}
+
+/* Pruned layers update only the entries of their pattern, in the sparse
+values and in the dense weights alike, unless model_compact released
+them. */
+
+static void smatrix_minus_vec_by_vec(const Layer* layer, const Vec* d, float scale)
+{
+    const SMat* s = &layer->s;
+    const float* a = layer->a.data;
+    
+    for (int y = 0; y < s->rows; y++) {
+        float n = scale * d->data[y], *f = layer->w.data ? layer->w.data + (size_t)y * s->columns : NULL;
+        for (int k = s->offsets[y]; k < s->offsets[y + 1]; k++) {
+            s->values[k] -= n * a[s->indices[k]];
+            if (f) f[s->indices[k]] = s->values[k];
         }
     }
 }
@@ -41,30 +64,69 @@ static void matrix_minus_vec_by_vec(Mat* m, Vec* a, Vec* b)
 
 /*------------------------------------------*/
 
-void model_init(const Model* restrict model)
+/* Weights of layer i feed the activation of layer i + 1, with fan in
+w.columns and fan out w.rows. Xavier keeps the variance of activations
+and gradients at 2 / (in + out), He at 2 / in to make up for the half
+of the inputs rectifiers zero out; uniform schemes draw from [-l, l]
+with l = sqrt(3) times the standard deviation. Each layer is one bulk
+fill split across the thread pool, and biases start at zero. */
+
+void model_init_scheme(const Model* restrict model, int scheme)
 {
-    Layer* layer = model->layers;
-    for (int i = 0; i < model->layer_count - 1; i++) {
-        int size = layer->w.columns * layer->w.rows;
-        float* f = layer->w.data;
-        
-        for (int j = 0; j < size; j++) {
-            *(f++) = rand_gauss() / (float)layer->a.size;
+    if (scheme < NERV_INIT_AUTO || scheme >= NERV_INITS) {
+        printf("Init: Unknown initialization scheme %d\n", scheme);
+        return;
+    }
+
+    Rng rng = rng_create(randn(), 0);
+    for (int i = 0; i < model->layer_count; i++) {
+        Layer* layer = model->layers + i;
+        memset(layer->b.data, 0, layer->b.size * sizeof(float));
+        if (!layer->w.data) continue;
+
+        int kind = scheme, activation = layer[1].activation;
+        if (kind == NERV_INIT_AUTO) {
+            int rectified = activation == NERV_ACTIVATION_RELU || activation == NERV_ACTIVATION_LEAKY_RELU;
+            kind = rectified ? NERV_INIT_HE_NORMAL : NERV_INIT_XAVIER_NORMAL;
+        }
+
+        int in = layer->w.columns, out = layer->w.rows;
+        int he = kind == NERV_INIT_HE_UNIFORM || kind == NERV_INIT_HE_NORMAL;
+        float deviation = sqrtf(2.0f / (float)(he ? in : in + out));
+        if (kind == NERV_INIT_XAVIER_NORMAL || kind == NERV_INIT_HE_NORMAL) {
+            rng_fill_gauss(&rng, layer->w.data, in * out, 0.0f, deviation);
+        } else {
+            float limit = sqrtf(3.0f) * deviation;
+            rng_fill_uniform(&rng, layer->w.data, in * out, -limit, limit);
         }
-        layer++;
     }
+
+    model_sparse_sync(model);
+}
+
+void model_init(const Model* restrict model)
+{
+    model_init_scheme(model, NERV_INIT_AUTO);
+}
+
+void model_set_activation(const Model* restrict model, int layer, int activation)
+{
+    if (layer < 0 || layer >= model->layer_count || activation < 0 || activation >= NERV_ACTIVATIONS) {
+        printf("Activation: Invalid activation %d for layer %d of %d\n", activation, layer, model->layer_count);
+        return;
+    }
+
+    model->layers[layer].activation = activation;
 }
 
 void model_forward(const Model* restrict model)
 {
     Layer* layer = model->layers, *next_layer; next_layer = layer + 1;
     for (int i = 0; i < model->layer_count - 1; i++) {
-        
-        vector_swap(vector_by_matrix_plus(&layer->w, &layer->a, &next_layer->b), &next_layer->z);
-
-        if (i < model->layer_count - 2) vector_swap(vector_sigmoid(&next_layer->z), &next_layer->a);
-        else vector_swap(vector_sigmoid(&next_layer->z), &next_layer->a);
-
+        PROFILE_BEGIN(scope);
+        layer_forward(layer, next_layer, &layer->a, &next_layer->z, &next_layer->a);
+        PROFILE_END(scope, NERV_PROFILE_FORWARD, i, 2 * layer->w.rows * layer->w.columns + layer->w.rows,
+            sizeof(float) * (layer->w.rows * layer->w.columns + layer->w.columns + 3 * layer->w.rows));
         next_layer++;
         layer++;
     }
@@ -73,26 +135,25 @@ void model_forward(const Model* restrict model)
 void model_backwards(const Model* restrict model, const Vec* restrict desired_output)
 {
     Layer* layer = model->layers + model->layer_count - 1;
+    if (desired_output->size != layer->a.size) {
+        printf("Backwards: Desired output (%d) must be equal to model output layer (%d)\n", desired_output->size, layer->a.size);
+        return;
+    }
     
-    Vec c = vector_copy(&layer->a);
-    vector_sub(&c, desired_output);
-    vector_scale(&c, 2.0f);
-
-    vector_swap(vector_dsigmoid(&layer->z), &layer->d);
-    vector_hadamard(&layer->d, &c);
-
-    vector_free(&c);
+    PROFILE_BEGIN(scope);
+    float* d = layer->d.data, *a = layer->a.data, *y = desired_output->data;
+    for (float* end = d + layer->d.size; d != end; d++, a++, y++) {
+        *d = 2.0f * (*a - *y);
+    }
+    vector_deriv_hadamard(&layer->d, &layer->a, layer->activation);
+    PROFILE_END(scope, NERV_PROFILE_BACKWARDS, model->layer_count - 2, 5 * layer->a.size, sizeof(float) * 3 * layer->a.size);
     
     Layer* next_layer = layer--;
-    for (Layer* end = model->layers - 1; layer != end; layer--) {
-        
-        c = vector_by_matrix_transposed(&layer->w, &next_layer->d);
-        vector_swap(vector_dsigmoid(&layer->z), &layer->d);
-
-        vector_hadamard(&layer->d, &c);
-        vector_free(&c);
-
-        next_layer--;
+    for (Layer* end = model->layers - 1; layer != end; layer--, next_layer--) {
+        PROFILE_BEGIN(scope);
+        layer_backwards(layer, next_layer);
+        PROFILE_END(scope, NERV_PROFILE_BACKWARDS, (int)(layer - model->layers), 2 * layer->w.rows * layer->w.columns + 3 * layer->w.columns,
+            sizeof(float) * (layer->w.rows * layer->w.columns + layer->w.rows + 2 * layer->w.columns));
     }
 }
 
@@ -114,10 +175,12 @@ void model_update(const Model* restrict model, float alpha)
 {
     Layer* layer = model->layers, *next_layer; next_layer = layer + 1;
     for (Layer* end = layer + model->layer_count - 1; layer != end; layer++) {
-        
-        vector_scale(&next_layer->d, alpha);
-        vector_sub(&next_layer->b, &next_layer->d);
-        matrix_minus_vec_by_vec(&layer->w, &layer->a, &next_layer->d);
+        PROFILE_BEGIN(scope);
+        nerv_kernels.axpy(next_layer->b.data, -alpha, next_layer->d.data, next_layer->b.size);
+        if (layer->s.offsets) smatrix_minus_vec_by_vec(layer, &next_layer->d, alpha);
+        else matrix_minus_vec_by_vec(&layer->w, &layer->a, &next_layer->d, alpha);
+        PROFILE_END(scope, NERV_PROFILE_UPDATE, (int)(layer - model->layers), 2 * layer->w.rows * layer->w.columns + 2 * layer->w.rows,
+            sizeof(float) * (2 * layer->w.rows * layer->w.columns + layer->w.columns + 4 * layer->w.rows));
         
         next_layer++;
     }
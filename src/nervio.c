@@ -13,7 +13,7 @@ Vec vector_scan()
     printf("Enter size of vector: ");
     scanf("%d", &size);
     
-    Vec v = vector(size);
+    Vec v = vector_empty(size);
     for (int i = 0; i < size; i++) {
         printf("%d: ", i + 1);
         scanf("%f", v.data + i);
@@ -40,7 +40,7 @@ Mat matrix_scan()
     printf("Enter columns: ");
     scanf("%d", &columns);
 
-    Mat mat = matrix(rows, columns);
+    Mat mat = matrix_empty(rows, columns);
     float* f = mat.data;
     
     for (int y = 0; y < rows; y++) {
@@ -75,22 +75,13 @@ Model model_scan()
     printf("Enter number of layers: ");
     scanf("%d", &layer_count);
 
-    Model model = model_new(layer_count);
-
-    int layer_sizes[layer_count + 1];
-    memset(&layer_sizes[0], 0, sizeof(int) * (layer_count + 1));
-    
+    int layer_sizes[layer_count];
     for (int i = 0; i < layer_count; i++) {
         printf("Enter size of layer %d: ", i + 1);
         scanf("%d", &layer_sizes[i]);
     }
 
-    Layer* layer = model.layers;
-    for (int i = 0; i < layer_count; i++) {
-        int size = layer_sizes[i], next = layer_sizes[i + 1];
-        *(layer++) = layer_create(size, next);
-    }
-
+    Model model = model_build(layer_count, layer_sizes);
     model_print_struct(&model);
     return model;
 }
@@ -4,7 +4,9 @@
  * ******************************************/
 
 #include <nerv.h>
+#include "simd.h"
 #include <math.h>
+#include <string.h>
 
 unsigned int ftou(float n)
 {
@@ -23,7 +25,7 @@ float normf(float x)
 
 float sigmoid(float x)
 {
-    return 1.0 / (1.0 + exp(-x));
+    return 1.0f / (1.0f + expf(-x));
 }
 
 float sigderiv(float sig)
@@ -36,6 +38,32 @@ float dsigmoid(float x)
     return sigderiv(sigmoid(x));
 }
 
+float fast_exp(float x)
+{
+    x = x < EXP_MIN ? EXP_MIN : x > EXP_MAX ? EXP_MAX : x;
+    float fn = floorf(x * EXP_LOG2E + 0.5f);
+    x -= fn * EXP_LN2_HI;
+    x -= fn * EXP_LN2_LO;
+
+    float y = EXP_P0;
+    y = y * x + EXP_P1;
+    y = y * x + EXP_P2;
+    y = y * x + EXP_P3;
+    y = y * x + EXP_P4;
+    y = y * x + EXP_P5;
+    y = y * x * x + x + 1.0f;
+
+    unsigned int bits = (unsigned int)((int)fn + 127) << 23;
+    float pow2;
+    memcpy(&pow2, &bits, sizeof(float));
+    return y * pow2;
+}
+
+float fast_sigmoid(float x)
+{
+    return 1.0f / (1.0f + fast_exp(-x));
+}
+
 float relu(float x)
 {
     return x * (x > 0.0f);
@@ -48,10 +76,72 @@ float drelu(float x)
 
 float leaky_relu(float x, float slope)
 {
-    return x * (x >= 0.0f) + slope * (x < 0.0f);
+    return x * (x >= 0.0f) + slope * x * (x < 0.0f);
 }
 
 float dleaky_relu(float x, float slope)
 {
     return (float)(x >= 0.0f) + slope * (x < 0.0f);
 }
+
+/* IEEE half and bfloat16 conversions, both rounding to nearest even.
+Halfs keep subnormals, overflow to infinity and preserve NaN. */
+
+unsigned short float_to_half(float f)
+{
+    unsigned int x;
+    memcpy(&x, &f, sizeof(float));
+    
+    unsigned int sign = (x >> 16) & 0x8000, m = x & 0x7fffff;
+    int e = (int)((x >> 23) & 0xff);
+    if (e == 0xff) return (unsigned short)(sign | 0x7c00 | (m ? 0x200 : 0));
+
+    e -= 112;
+    if (e >= 31) return (unsigned short)(sign | 0x7c00);
+    if (e <= 0) {
+        if (e < -10) return (unsigned short)sign;
+        m |= 0x800000;
+        int shift = 14 - e;
+        unsigned int half = m >> shift, rest = m & ((1u << shift) - 1), mid = 1u << (shift - 1);
+        if (rest > mid || (rest == mid && (half & 1))) half++;
+        return (unsigned short)(sign | half);
+    }
+
+    unsigned int half = ((unsigned int)e << 10) | (m >> 13), rest = m & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+    return (unsigned short)(sign | half);
+}
+
+float half_to_float(unsigned short h)
+{
+    unsigned int sign = (unsigned int)(h & 0x8000) << 16, e = (h >> 10) & 0x1f, m = h & 0x3ff, x;
+    if (e == 0x1f) x = sign | 0x7f800000 | (m << 13);
+    else if (e) x = sign | ((e + 112) << 23) | (m << 13);
+    else if (!m) x = sign;
+    else {
+        for (e = 113; !(m & 0x400); e--) {
+            m <<= 1;
+        }
+        x = sign | (e << 23) | ((m & 0x3ff) << 13);
+    }
+
+    float f;
+    memcpy(&f, &x, sizeof(float));
+    return f;
+}
+
+unsigned short float_to_bf16(float f)
+{
+    unsigned int x;
+    memcpy(&x, &f, sizeof(float));
+    if ((x & 0x7fffffff) > 0x7f800000) return (unsigned short)((x >> 16) | 0x40);
+    return (unsigned short)((x + 0x7fff + ((x >> 16) & 1)) >> 16);
+}
+
+float bf16_to_float(unsigned short h)
+{
+    unsigned int x = (unsigned int)h << 16;
+    float f;
+    memcpy(&f, &x, sizeof(float));
+    return f;
+}
@@ -0,0 +1,199 @@
+/*********************************************
+ *  optimizers with state in the flat layout
+ * ******************************************/
+
+#include <nerv.h>
+#include "simd.h"
+#include "thread.h"
+#include "profile.h"
+#include "sparse.h"
+#include "alloc.h"
+#include <stdio.h>
+#include <math.h>
+
+/* The moments m and v of an Optimizer are vectors of model_param_size
+floats, so model_bind_params views them as per layer tensors exactly
+like the gradients of a Batch. Every step is a single pass of the fused
+update kernel over parameters, gradients and state, split across the
+thread pool; for models built in an arena that pass covers the whole of
+model.params at once. Rules that do not use m or v leave them empty. */
+
+#define OPTIMIZER_HAS_M(kind) ((kind) != NERV_OPTIMIZER_SGD && (kind) != NERV_OPTIMIZER_RMSPROP)
+#define OPTIMIZER_HAS_V(kind) ((kind) >= NERV_OPTIMIZER_ADAM)
+
+typedef struct {
+    const Update* u;
+    float* p, *m, *v;
+    const float* g;
+    float scale;
+    int columns;
+} UpdateOp;
+
+static void optimizer_range(void* arg, int begin, int end)
+{
+    const UpdateOp* op = (const UpdateOp*)arg;
+    nerv_kernels.update(op->u, op->p + begin, op->m ? op->m + begin : NULL,
+        op->v ? op->v + begin : NULL, op->g + begin, op->scale, end - begin);
+}
+
+static void optimizer_range_update(const Update* u, float* p, float* m, float* v, const float* g, float scale, int size)
+{
+    UpdateOp op = {u, p, m, v, g, scale, 0};
+    nerv_parallel(size, (size_t)size, optimizer_range, &op);
+}
+
+/* Rows of w take the outer product d * a^T as their gradient: row y sees
+a scaled by d[y], so the product is never stored. */
+
+typedef struct {
+    const UpdateOp* op;
+    const float* d;
+} DeltaOp;
+
+static void optimizer_delta_rows(void* arg, int begin, int end)
+{
+    const DeltaOp* delta = (const DeltaOp*)arg;
+    const UpdateOp* op = delta->op;
+    
+    for (int y = begin; y < end; y++) {
+        size_t offset = (size_t)y * op->columns;
+        nerv_kernels.update(op->u, op->p + offset, op->m ? op->m + offset : NULL,
+            op->v ? op->v + offset : NULL, op->g, op->scale * delta->d[y], op->columns);
+    }
+}
+
+static Update optimizer_begin(Optimizer* optimizer)
+{
+    int step = __sync_add_and_fetch(&optimizer->step, 1), kind = optimizer->kind;
+
+    Update u;
+    u.kind = kind;
+    u.rate = optimizer->rate;
+    u.momentum = optimizer->momentum;
+    u.beta1 = optimizer->beta1;
+    u.beta2 = optimizer->beta2;
+    u.epsilon = optimizer->epsilon;
+    u.l2 = kind == NERV_OPTIMIZER_ADAMW ? 0.0f : optimizer->decay;
+    u.shrink = kind == NERV_OPTIMIZER_ADAMW ? 1.0f - optimizer->rate * optimizer->decay : 1.0f;
+    u.correction = 1.0f;
+
+    if (kind == NERV_OPTIMIZER_ADAM || kind == NERV_OPTIMIZER_ADAMW) {
+        u.rate /= 1.0f - powf(optimizer->beta1, (float)step);
+        u.correction = 1.0f / (1.0f - powf(optimizer->beta2, (float)step));
+    }
+
+    return u;
+}
+
+Optimizer optimizer_create(const Model* restrict model, int kind, float rate)
+{
+    Optimizer optimizer = {
+        kind, 0, rate, 0.9f, 0.9f, 0.999f, 1e-8f, 0.0f, {0, NULL}, {0, NULL}
+    };
+
+    if (kind < 0 || kind >= NERV_OPTIMIZERS) {
+        printf("Optimizer: Unknown optimizer kind %d, using SGD\n", kind);
+        optimizer.kind = kind = NERV_OPTIMIZER_SGD;
+    }
+
+    if (model_compacted(model)) {
+        printf("Optimizer: Compact models have no dense weights, call model_densify first\n");
+        return optimizer;
+    }
+
+    if (kind == NERV_OPTIMIZER_ADAMW) optimizer.decay = 0.01f;
+    if (kind == NERV_OPTIMIZER_RMSPROP) optimizer.beta2 = 0.9f;
+
+    int size = model_param_size(model), arena = nerv_arena_suspend();
+    if (OPTIMIZER_HAS_M(kind)) optimizer.m = vector(size);
+    if (OPTIMIZER_HAS_V(kind)) optimizer.v = vector(size);
+    nerv_arena_resume(arena);
+    return optimizer;
+}
+
+void optimizer_free(Optimizer* optimizer)
+{
+    if (optimizer->m.data) vector_free(&optimizer->m);
+    if (optimizer->v.data) vector_free(&optimizer->v);
+}
+
+void optimizer_reset(Optimizer* optimizer)
+{
+    optimizer->step = 0;
+    if (optimizer->m.data) vector_scale(&optimizer->m, 0.0f);
+    if (optimizer->v.data) vector_scale(&optimizer->v, 0.0f);
+}
+
+void optimizer_step(Optimizer* restrict optimizer, const Model* restrict model, const Vec* restrict grads, float scale)
+{
+    if (grads->size != model_param_size(model)) {
+        printf("Optimizer: Gradients (%d) must match the model parameters (%d)\n", grads->size, model_param_size(model));
+        return;
+    }
+
+    PROFILE_BEGIN(scope);
+    Update u = optimizer_begin(optimizer);
+    if (model->params.data) {
+        optimizer_range_update(&u, model->params.data, optimizer->m.data, optimizer->v.data, grads->data, scale, grads->size);
+        model_sparse_sync(model);
+        PROFILE_END(scope, NERV_PROFILE_UPDATE, -1, 6 * (size_t)grads->size, sizeof(float) * 6 * (size_t)grads->size);
+        return;
+    }
+
+    int count = model->layer_count;
+    Mat gw[count], mw[count], vw[count];
+    Vec gb[count], mb[count], vb[count];
+    model_bind_params(model, grads->data, gw, gb);
+    if (optimizer->m.data) model_bind_params(model, optimizer->m.data, mw, mb);
+    if (optimizer->v.data) model_bind_params(model, optimizer->v.data, vw, vb);
+
+    for (int i = 0; i < count; i++) {
+        Layer* layer = model->layers + i;
+        float* m = optimizer->m.data, *v = optimizer->v.data;
+        optimizer_range_update(&u, layer->b.data, m ? mb[i].data : m, v ? vb[i].data : v, gb[i].data, scale, layer->b.size);
+        if (!layer->w.data) continue;
+        optimizer_range_update(&u, layer->w.data, m ? mw[i].data : m, v ? vw[i].data : v, gw[i].data, scale,
+            layer->w.rows * layer->w.columns);
+    }
+    model_sparse_sync(model);
+    PROFILE_END(scope, NERV_PROFILE_UPDATE, -1, 6 * (size_t)grads->size, sizeof(float) * 6 * (size_t)grads->size);
+}
+
+void model_optimize(const Model* restrict model, Optimizer* restrict optimizer)
+{
+    if (model_compacted(model)) {
+        printf("Optimizer: Compact models have no dense weights, call model_densify first\n");
+        return;
+    }
+
+    int count = model->layer_count;
+    Mat mw[count], vw[count];
+    Vec mb[count], vb[count];
+    if (optimizer->m.data) model_bind_params(model, optimizer->m.data, mw, mb);
+    if (optimizer->v.data) model_bind_params(model, optimizer->v.data, vw, vb);
+
+    Update u = optimizer_begin(optimizer);
+    for (int i = 0; i < count - 1; i++) {
+        PROFILE_BEGIN(scope);
+        Layer* layer = model->layers + i, *next_layer = layer + 1;
+        float* m = optimizer->m.data, *v = optimizer->v.data;
+
+        optimizer_range_update(&u, next_layer->b.data, m ? mb[i + 1].data : m, v ? vb[i + 1].data : v,
+            next_layer->d.data, 1.0f, next_layer->b.size);
+
+        UpdateOp op = {&u, layer->w.data, m ? mw[i].data : m, v ? vw[i].data : v, layer->a.data, 1.0f, layer->w.columns};
+        DeltaOp delta = {&op, next_layer->d.data};
+        nerv_parallel(layer->w.rows, (size_t)layer->w.rows * layer->w.columns, optimizer_delta_rows, &delta);
+        PROFILE_END(scope, NERV_PROFILE_UPDATE, i, 6 * (size_t)layer->w.rows * layer->w.columns,
+            sizeof(float) * 5 * (size_t)layer->w.rows * layer->w.columns);
+    }
+    model_sparse_sync(model);
+}
+
+void model_optimize_batch(const Model* restrict model, Batch* restrict batch, Optimizer* restrict optimizer)
+{
+    if (!batch->count) return;
+    optimizer_step(optimizer, model, &batch->grads, 1.0f / (float)batch->count);
+    vector_scale(&batch->grads, 0.0f);
+    batch->count = 0;
+}
@@ -0,0 +1,236 @@
+/*********************************************
+ *  optional hot path profiling counters
+ * ******************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <nerv.h>
+#include "profile.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Counters are kept per (phase, layer) in static storage so recording
+never allocates. Past the layer slots every phase has a model slot for
+work that is not split by layer, like the single pass update over the
+flat parameters of an arena model, and an overflow slot shared by all
+layers from NERV_PROFILE_LAYERS on, which trace events still record by
+their own index. Concurrent callers update the counters
+atomically; nerv_profile_reset must not race with recording. */
+
+#ifdef NERV_PROFILE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#define NERV_PROFILE_EVENTS (1 << 16)
+#define PROFILE_MODEL NERV_PROFILE_LAYERS
+#define PROFILE_OVERFLOW (NERV_PROFILE_LAYERS + 1)
+
+typedef struct {
+    unsigned long long start, time;
+    size_t flops, bytes;
+    int phase, layer, thread;
+} ProfileEvent;
+
+static Profile profile_counters[NERV_PROFILE_PHASES][PROFILE_OVERFLOW + 1];
+static ProfileEvent profile_events[NERV_PROFILE_EVENTS];
+static size_t profile_event_count = 0;
+
+static pthread_key_t profile_thread_key;
+static pthread_once_t profile_thread_once = PTHREAD_ONCE_INIT;
+static int profile_thread_count = 0;
+
+static const char* profile_phase_names[NERV_PROFILE_PHASES] = {
+    "forward", "backwards", "update"
+};
+
+static unsigned long long profile_now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (unsigned long long)t.tv_sec * 1000000000ULL + (unsigned long long)t.tv_nsec;
+}
+
+static void profile_thread_init()
+{
+    pthread_key_create(&profile_thread_key, NULL);
+}
+
+/* Small sequential id per recording thread, stored biased by one so the
+null value of a fresh key means unassigned. */
+
+static int profile_thread()
+{
+    pthread_once(&profile_thread_once, profile_thread_init);
+    intptr_t id = (intptr_t)pthread_getspecific(profile_thread_key);
+    if (!id) {
+        id = __sync_add_and_fetch(&profile_thread_count, 1);
+        pthread_setspecific(profile_thread_key, (void*)id);
+    }
+    return (int)id - 1;
+}
+
+ProfileScope nerv_profile_begin()
+{
+    ProfileScope scope;
+    scope.allocations = nerv_alloc_count();
+    scope.start = profile_now();
+    return scope;
+}
+
+void nerv_profile_end(const ProfileScope* scope, int phase, int layer, size_t flops, size_t bytes)
+{
+    unsigned long long end = profile_now(), time = end - scope->start;
+    size_t allocations = nerv_alloc_count() - scope->allocations;
+    if (layer < 0) layer = -1;
+    int slot = layer < 0 ? PROFILE_MODEL : layer < NERV_PROFILE_LAYERS ? layer : PROFILE_OVERFLOW;
+
+    Profile* p = &profile_counters[phase][slot];
+    __sync_fetch_and_add(&p->calls, 1ULL);
+    __sync_fetch_and_add(&p->time, time);
+    __sync_fetch_and_add(&p->flops, (unsigned long long)flops);
+    __sync_fetch_and_add(&p->bytes, (unsigned long long)bytes);
+    __sync_fetch_and_add(&p->allocations, (unsigned long long)allocations);
+
+    size_t index = __sync_fetch_and_add(&profile_event_count, 1);
+    if (index < NERV_PROFILE_EVENTS) {
+        ProfileEvent* e = profile_events + index;
+        e->start = scope->start;
+        e->time = time;
+        e->flops = flops;
+        e->bytes = bytes;
+        e->phase = phase;
+        e->layer = layer;
+        e->thread = profile_thread();
+    }
+}
+
+int nerv_profile_enabled()
+{
+    return 1;
+}
+
+void nerv_profile_reset()
+{
+    memset(profile_counters, 0, sizeof(profile_counters));
+    profile_event_count = 0;
+}
+
+Profile nerv_profile_get(int phase, int layer)
+{
+    Profile p = {0, 0, 0, 0, 0};
+    if (phase < 0 || phase >= NERV_PROFILE_PHASES) {
+        return p;
+    }
+
+    if (layer >= NERV_PROFILE_LAYERS) return profile_counters[phase][PROFILE_OVERFLOW];
+    if (layer >= 0) return profile_counters[phase][layer];
+    
+    for (int i = 0; i <= PROFILE_OVERFLOW; i++) {
+        const Profile* n = &profile_counters[phase][i];
+        p.calls += n->calls;
+        p.time += n->time;
+        p.flops += n->flops;
+        p.bytes += n->bytes;
+        p.allocations += n->allocations;
+    }
+    return p;
+}
+
+static void profile_print_row(const char* phase, const char* layer, const Profile* p)
+{
+    double ms = (double)p->time * 1e-6;
+    double gflops = p->time ? (double)p->flops / (double)p->time : 0.0;
+    double gbytes = p->time ? (double)p->bytes / (double)p->time : 0.0;
+    printf("%-10s %-6s %10llu %12.3f %12.3f %10.3f %10.3f %8llu\n",
+        phase, layer, p->calls, ms, p->calls ? ms / (double)p->calls : 0.0,
+        gflops, gbytes, p->allocations);
+}
+
+void nerv_profile_print()
+{
+    char name[16];
+    printf("%-10s %-6s %10s %12s %12s %10s %10s %8s\n",
+        "phase", "layer", "calls", "total ms", "ms/call", "GFLOP/s", "GB/s", "allocs");
+    
+    for (int phase = 0; phase < NERV_PROFILE_PHASES; phase++) {
+        for (int i = 0; i <= PROFILE_OVERFLOW; i++) {
+            const Profile* p = &profile_counters[phase][i];
+            if (!p->calls) continue;
+            
+            if (i == PROFILE_MODEL) strcpy(name, "model");
+            else if (i == PROFILE_OVERFLOW) sprintf(name, "%d+", NERV_PROFILE_LAYERS);
+            else sprintf(name, "%d", i);
+            profile_print_row(profile_phase_names[phase], name, p);
+        }
+        
+        Profile total = nerv_profile_get(phase, -1);
+        if (total.calls) profile_print_row(profile_phase_names[phase], "total", &total);
+    }
+
+    if (profile_event_count > NERV_PROFILE_EVENTS) {
+        printf("%zu trace events dropped\n", profile_event_count - NERV_PROFILE_EVENTS);
+    }
+}
+
+void nerv_profile_trace(char* path)
+{
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        printf("nerv could not write profile trace '%s'\n", path);
+        return;
+    }
+
+    size_t count = profile_event_count;
+    if (count > NERV_PROFILE_EVENTS) count = NERV_PROFILE_EVENTS;
+
+    unsigned long long epoch = count ? profile_events->start : 0;
+    for (size_t i = 1; i < count; i++) {
+        if (profile_events[i].start < epoch) epoch = profile_events[i].start;
+    }
+
+    fprintf(file, "{\"traceEvents\":[\n");
+    for (size_t i = 0; i < count; i++) {
+        const ProfileEvent* e = profile_events + i;
+        fprintf(file, "{\"name\":\"%s %d\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+            "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"layer\":%d,\"flops\":%zu,\"bytes\":%zu}}%s\n",
+            profile_phase_names[e->phase], e->layer, profile_phase_names[e->phase], e->thread,
+            (double)(e->start - epoch) * 1e-3, (double)e->time * 1e-3,
+            e->layer, e->flops, e->bytes, i + 1 < count ? "," : "");
+    }
+    fprintf(file, "],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(file);
+}
+
+#else
+
+int nerv_profile_enabled()
+{
+    return 0;
+}
+
+void nerv_profile_reset()
+{
+}
+
+Profile nerv_profile_get(int phase, int layer)
+{
+    (void)phase;
+    (void)layer;
+    Profile p = {0, 0, 0, 0, 0};
+    return p;
+}
+
+void nerv_profile_print()
+{
+    printf("nerv was built without profiling, rebuild with make PROFILE=1\n");
+}
+
+void nerv_profile_trace(char* path)
+{
+    (void)path;
+    printf("nerv was built without profiling, rebuild with make PROFILE=1\n");
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef NERV_PROFILE_H
+#define NERV_PROFILE_H
+
+/*********************************************
+ *   internal hooks for the profiling counters
+ * ******************************************/
+
+#include <stddef.h>
+
+/* Without NERV_PROFILE the hooks expand to nothing and the hot paths
+carry no instrumentation at all. With it, every scope records its wall
+time, the FLOPs and bytes it was charged with and the allocations made
+while it was open into the counters of (phase, layer), and appends one
+event to the trace buffer. */
+
+#ifdef NERV_PROFILE
+
+typedef struct {
+    unsigned long long start;
+    size_t allocations;
+} ProfileScope;
+
+ProfileScope nerv_profile_begin();
+void nerv_profile_end(const ProfileScope* scope, int phase, int layer, size_t flops, size_t bytes);
+
+#define PROFILE_BEGIN(scope) ProfileScope scope = nerv_profile_begin()
+#define PROFILE_END(scope, phase, layer, flops, bytes) \
+    nerv_profile_end(&scope, phase, layer, (size_t)(flops), (size_t)(bytes))
+
+#else
+
+#define PROFILE_BEGIN(scope)
+#define PROFILE_END(scope, phase, layer, flops, bytes)
+
+#endif
+
+#endif
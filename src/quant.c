@@ -0,0 +1,266 @@
+/*********************************************
+ *  reduced precision weights for inference
+ * ******************************************/
+
+#include <nerv.h>
+#include "simd.h"
+#include "thread.h"
+#include "activation.h"
+#include "sparse.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+/* A QModel keeps only what inference reads: every weight matrix in int8,
+half or bfloat16, and the biases and activation kinds in full precision.
+int8 rows are stored as round(w / s) with s = max|w| / 127 per row, so
+each row uses the whole range whatever its magnitude. The GEMV kernels
+widen weights to float on load and accumulate in float, so only the
+weight traffic shrinks. Everything lives in one 64 byte aligned arena:
+
+    [ QMat array | Vec array | activations | b0 | s0 w0 | b1 | s1 w1 ... ] */
+
+#define QUANT_ALIGN 64
+#define QUANT_PAD(n) (((n) + QUANT_ALIGN - 1) & ~(size_t)(QUANT_ALIGN - 1))
+
+static size_t qmat_element_size(int format)
+{
+    return format == NERV_QUANT_INT8 ? sizeof(signed char) : sizeof(unsigned short);
+}
+
+static void qmat_quantize(QMat* restrict q, const Mat* restrict m)
+{
+    for (int y = 0; y < m->rows; y++) {
+        const float* f = m->data + (size_t)y * m->columns;
+
+        if (q->format == NERV_QUANT_INT8) {
+            float max = 0.0f;
+            for (int x = 0; x < m->columns; x++) {
+                if (fabsf(f[x]) > max) max = fabsf(f[x]);
+            }
+
+            float scale = max > 0.0f ? max / 127.0f : 1.0f;
+            signed char* w = (signed char*)q->data + (size_t)y * m->columns;
+            for (int x = 0; x < m->columns; x++) {
+                w[x] = (signed char)lrintf(f[x] / scale);
+            }
+            q->scales[y] = scale;
+        } else {
+            unsigned short* w = (unsigned short*)q->data + (size_t)y * m->columns;
+            for (int x = 0; x < m->columns; x++) {
+                w[x] = q->format == NERV_QUANT_FP16 ? float_to_half(f[x]) : float_to_bf16(f[x]);
+            }
+            q->scales[y] = 1.0f;
+        }
+    }
+}
+
+QModel qmodel_create(const Model* restrict model, int format)
+{
+    QModel qmodel = {0, format, NULL, NULL, NULL, NULL};
+    if (format < NERV_QUANT_INT8 || format > NERV_QUANT_BF16) {
+        printf("Quantize: Unknown weight format %d\n", format);
+        return qmodel;
+    }
+
+    if (model_compacted(model)) {
+        printf("Quantize: Compact models have no dense weights, call model_densify first\n");
+        return qmodel;
+    }
+
+    int count = model->layer_count;
+    size_t size = QUANT_PAD(sizeof(QMat) * count + sizeof(Vec) * count + sizeof(int) * count);
+    for (int i = 0; i < count; i++) {
+        const Layer* layer = model->layers + i;
+        size += QUANT_PAD(sizeof(float) * layer->b.size) + QUANT_PAD(sizeof(float) * layer->w.rows);
+        size += QUANT_PAD(qmat_element_size(format) * layer->w.rows * layer->w.columns);
+    }
+
+    qmodel.layer_count = count;
+    qmodel.arena = nerv_malloc(size + QUANT_ALIGN);
+    char* base = (char*)(((uintptr_t)qmodel.arena + QUANT_ALIGN - 1) & ~(uintptr_t)(QUANT_ALIGN - 1));
+
+    qmodel.w = (QMat*)base;
+    qmodel.b = (Vec*)(qmodel.w + count);
+    qmodel.activations = (int*)(qmodel.b + count);
+    base += QUANT_PAD(sizeof(QMat) * count + sizeof(Vec) * count + sizeof(int) * count);
+
+    for (int i = 0; i < count; i++) {
+        const Layer* layer = model->layers + i;
+        QMat* q = qmodel.w + i;
+
+        qmodel.activations[i] = layer->activation;
+        qmodel.b[i].size = layer->b.size;
+        qmodel.b[i].data = (float*)base;
+        memcpy(base, layer->b.data, sizeof(float) * layer->b.size);
+        base += QUANT_PAD(sizeof(float) * layer->b.size);
+
+        q->rows = layer->w.rows;
+        q->columns = layer->w.columns;
+        q->format = format;
+        q->scales = (float*)base;
+        base += QUANT_PAD(sizeof(float) * q->rows);
+        q->data = base;
+        base += QUANT_PAD(qmat_element_size(format) * q->rows * q->columns);
+
+        if (layer->w.data) qmat_quantize(q, &layer->w);
+    }
+
+    return qmodel;
+}
+
+void qmodel_free(QModel* qmodel)
+{
+    nerv_free(qmodel->arena);
+    qmodel->arena = NULL;
+    qmodel->layer_count = 0;
+}
+
+size_t qmodel_size(const QModel* restrict qmodel)
+{
+    size_t size = 0;
+    for (int i = 0; i < qmodel->layer_count; i++) {
+        const QMat* q = qmodel->w + i;
+        size += qmat_element_size(q->format) * q->rows * q->columns;
+        if (q->format == NERV_QUANT_INT8) size += sizeof(float) * q->rows;
+    }
+    return size;
+}
+
+Context qmodel_context(const QModel* restrict qmodel)
+{
+    int layer_sizes[qmodel->layer_count];
+    for (int i = 0; i < qmodel->layer_count; i++) {
+        layer_sizes[i] = qmodel->b[i].size;
+    }
+
+    return context_sizes(qmodel->layer_count, layer_sizes);
+}
+
+/*------------------------------------------*/
+
+/*    DEQUANTIZING MATRIX VECTOR PRODUCTS   */
+
+/*------------------------------------------*/
+
+typedef struct {
+    const Vec* z, *a;
+    const QMat* mat;
+    const Vec* vec, *bias;
+    int activation;
+} QDense;
+
+static void qdense_rows(void* arg, int begin, int end)
+{
+    const QDense* op = (const QDense*)arg;
+    const QMat* q = op->mat;
+    float* z = op->z->data, *x = op->vec->data;
+
+    if (q->format == NERV_QUANT_INT8) {
+        const signed char* w = (const signed char*)q->data + (size_t)begin * q->columns;
+        for (int y = begin; y < end; y++, w += q->columns) {
+            z[y] = q->scales[y] * nerv_kernels.dot_i8(w, x, q->columns);
+        }
+    } else {
+        const unsigned short* w = (const unsigned short*)q->data + (size_t)begin * q->columns;
+        float (*dot)(const unsigned short*, const float*, int) =
+            q->format == NERV_QUANT_FP16 ? nerv_kernels.dot_f16 : nerv_kernels.dot_bf16;
+        for (int y = begin; y < end; y++, w += q->columns) {
+            z[y] = dot(w, x, q->columns);
+        }
+    }
+
+    if (!op->bias) return;
+    nerv_kernels.add(z + begin, op->bias->data + begin, end - begin);
+    if (op->activation != NERV_ACTIVATION_SOFTMAX) {
+        nerv_activate(op->activation, op->a->data + begin, z + begin, 1, end - begin);
+    }
+}
+
+static void qdense(const QDense* op)
+{
+    const QMat* q = op->mat;
+    nerv_parallel(q->rows, (size_t)q->rows * q->columns, qdense_rows, (void*)op);
+    if (op->bias && op->activation == NERV_ACTIVATION_SOFTMAX) {
+        nerv_activate(op->activation, op->a->data, op->z->data, 1, op->z->size);
+    }
+}
+
+void vector_by_qmatrix_into(const Vec* restrict dst, const QMat* restrict mat, const Vec* restrict vec)
+{
+    if (vec->size != mat->columns || dst->size != mat->rows) {
+        printf("Vector By Quantized Matrix: Vector size must be equal to matrix columns\n");
+        return;
+    }
+
+    QDense op = {dst, dst, mat, vec, NULL, 0};
+    qdense(&op);
+}
+
+const Vec* qmodel_infer(const QModel* restrict qmodel, Context* restrict context, const Vec* restrict input)
+{
+    if (input->size != context->a->size) {
+        printf("Infer: Input size (%d) must be equal to model input layer (%d)\n", input->size, context->a->size);
+        return context->a + context->layer_count - 1;
+    }
+
+    memcpy(context->a->data, input->data, input->size * sizeof(float));
+    for (int i = 0; i < qmodel->layer_count - 1; i++) {
+        QDense op = {
+            context->z + i + 1, context->a + i + 1, qmodel->w + i,
+            context->a + i, qmodel->b + i + 1, qmodel->activations[i + 1]
+        };
+        qdense(&op);
+    }
+
+    return context->a + context->layer_count - 1;
+}
+
+/*------------------------------------------*/
+
+/*      ACCURACY AGAINST THE FLOAT MODEL    */
+
+/*------------------------------------------*/
+
+static int vector_argmax(const Vec* v)
+{
+    int index = 0;
+    for (int i = 1; i < v->size; i++) {
+        if (v->data[i] > v->data[index]) index = i;
+    }
+    return index;
+}
+
+QAccuracy qmodel_compare(const QModel* restrict qmodel, const Model* restrict model, const Mat* restrict inputs)
+{
+    QAccuracy accuracy = {0.0f, 0.0f, 0.0f};
+    if (qmodel->layer_count != model->layer_count || inputs->columns != model->layers->a.size || !inputs->rows) {
+        printf("Quantized Compare: Models and inputs do not match\n");
+        return accuracy;
+    }
+
+    Context fc = context_create(model), qc = qmodel_context(qmodel);
+    double error = 0.0;
+    int agree = 0, outputs = 0;
+
+    for (int r = 0; r < inputs->rows; r++) {
+        Vec input = {inputs->columns, inputs->data + (size_t)r * inputs->columns};
+        const Vec* f = model_infer(model, &fc, &input), *q = qmodel_infer(qmodel, &qc, &input);
+
+        for (int i = 0; i < f->size; i++) {
+            float e = fabsf(f->data[i] - q->data[i]);
+            if (e > accuracy.max_error) accuracy.max_error = e;
+            error += e;
+        }
+        agree += vector_argmax(f) == vector_argmax(q);
+        outputs += f->size;
+    }
+
+    accuracy.mean_error = (float)(error / outputs);
+    accuracy.agreement = (float)agree / (float)inputs->rows;
+
+    context_free(&fc);
+    context_free(&qc);
+    return accuracy;
+}
@@ -4,6 +4,8 @@
  * ******************************************/
 
 #include <nerv.h>
+#include "simd.h"
+#include "thread.h"
 #include <limits.h>
 #include <math.h>
 
@@ -17,11 +19,11 @@ static unsigned int rand_seeded(unsigned int num)
     return ((num * (num * num * 15731 + 789221) + 1376312589) & 0x7fffffff);
 }
 
-#define _randn() rand_seeded(pseudo_random_seed++)
+#define _randn() rand_seeded(__sync_fetch_and_add(&pseudo_random_seed, 1))
 
 unsigned int randn() 
 {
-    return rand_seeded(pseudo_random_seed++);
+    return _randn();
 }
 
 void rands(unsigned int seed) 
@@ -36,8 +38,8 @@ double rand_norm()
 
 double rand_gauss()
 {
-	static double U, V;
-	static int phase = 0;
+	static __thread double U, V;
+	static __thread int phase = 0;
 	double Z;
 
 	if (phase == 0) {
@@ -55,4 +57,122 @@ double rand_gauss()
 double rand_dist(double standard_deviation, double mean)
 {
     return rand_gauss() * standard_deviation + mean;
-}
\ No newline at end of file
+}
+
+/*------------------------------------------*/
+
+/*       COUNTER BASED PHILOX STREAMS       */
+
+/*------------------------------------------*/
+
+/* An Rng is a seed, a stream and a block counter. Block n of a stream is
+the Philox4x32-10 hash of (n, stream) under seed, four 32 bit values
+that depend on nothing else, so streams never share state and a bulk
+fill can hand any range of blocks to any thread and still write the
+same values for every thread count and instruction set. Single draws
+take the words of one block in order; a bulk fill starts at the next
+unused block and drops what is left of the current one. */
+
+#define RNG_CHUNK 256
+#define RNG_UNIT (1.0f / 16777216.0f)
+#define RNG_TWO_PI 6.28318530718f
+
+Rng rng_create(unsigned long long seed, unsigned long long stream)
+{
+    Rng rng;
+    rng.seed = seed;
+    rng.stream = stream;
+    rng.counter = 0;
+    rng.used = 4;
+    return rng;
+}
+
+unsigned int rng_next(Rng* rng)
+{
+    if (rng->used == 4) {
+        nerv_kernels.philox(rng->block, rng->seed, rng->stream, rng->counter++, 1);
+        rng->used = 0;
+    }
+    return rng->block[rng->used++];
+}
+
+float rng_uniform(Rng* rng)
+{
+    return (float)(rng_next(rng) >> 8) * RNG_UNIT;
+}
+
+static inline void rng_box_muller(float* dst, unsigned int a, unsigned int b, float mean, float standard_deviation)
+{
+    float r = standard_deviation * sqrtf(-2.0f * logf((float)((a >> 8) + 1) * RNG_UNIT));
+    float t = RNG_TWO_PI * (float)(b >> 8) * RNG_UNIT;
+    dst[0] = r * cosf(t) + mean;
+    dst[1] = r * sinf(t) + mean;
+}
+
+float rng_gauss(Rng* rng)
+{
+    float z[2];
+    unsigned int a = rng_next(rng);
+    rng_box_muller(z, a, rng_next(rng), 0.0f, 1.0f);
+    return z[0];
+}
+
+void rng_shuffle(Rng* rng, int* indices, int count)
+{
+    for (int i = count - 1; i > 0; i--) {
+        int j = (int)(((unsigned long long)rng_next(rng) * (unsigned long long)(i + 1)) >> 32), t = indices[i];
+        indices[i] = indices[j];
+        indices[j] = t;
+    }
+}
+
+typedef struct {
+    const Rng* rng;
+    float* dst;
+    int count, gauss;
+    float a, b;
+} RngFill;
+
+static void rng_fill_blocks(void* arg, int begin, int end)
+{
+    const RngFill* fill = (const RngFill*)arg;
+    unsigned int bits[RNG_CHUNK * 4];
+
+    for (int first = begin; first < end; first += RNG_CHUNK) {
+        int blocks = end - first < RNG_CHUNK ? end - first : RNG_CHUNK;
+        nerv_kernels.philox(bits, fill->rng->seed, fill->rng->stream, fill->rng->counter + (unsigned long long)first, blocks);
+
+        int offset = first * 4, n = fill->count - offset < blocks * 4 ? fill->count - offset : blocks * 4;
+        float* f = fill->dst + offset;
+        if (fill->gauss) {
+            float z[2];
+            for (int i = 0; i < n; i += 2) {
+                rng_box_muller(z, bits[i], bits[i + 1], fill->a, fill->b);
+                f[i] = z[0];
+                if (i + 1 < n) f[i + 1] = z[1];
+            }
+        } else for (int i = 0; i < n; i++) {
+            f[i] = (float)(bits[i] >> 8) * RNG_UNIT * fill->b + fill->a;
+        }
+    }
+}
+
+static void rng_fill(Rng* rng, RngFill* fill)
+{
+    int blocks = (fill->count + 3) / 4;
+    nerv_parallel(blocks, (size_t)fill->count * (fill->gauss ? 8 : 1), rng_fill_blocks, fill);
+    rng->counter += (unsigned long long)blocks;
+    rng->used = 4;
+}
+
+void rng_fill_uniform(Rng* rng, float* dst, int count, float min, float max)
+{
+    RngFill fill = {rng, dst, count, 0, min, max - min};
+    rng_fill(rng, &fill);
+}
+
+void rng_fill_gauss(Rng* rng, float* dst, int count, float mean, float standard_deviation)
+{
+    RngFill fill = {rng, dst, count, 1, mean, standard_deviation};
+    rng_fill(rng, &fill);
+}
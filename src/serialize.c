@@ -3,14 +3,221 @@
  *     serialize models - save and load
  * ******************************************/
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <nerv.h>
+#include "sparse.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
 
+/* Version 1 nerv files are laid out as:
+
+    header      NervHeader, 64 bytes
+    layers      layer_count NervLayer records
+    padding     zeros up to params_offset, a multiple of 64
+    params      params_size floats, model.params exactly as in memory
+
+Since the parameter section matches the arena layout of model_build and
+sits 64 byte aligned in the file, model_map can point a model straight
+at a private mapping of it. Fields are in the byte order of the writer
+and endian lets a reader of the other order reject the file. checksum
+is FNV-1a over the 32 bit words of the parameter section. The flags of
+a layer record hold its NERV_ACTIVATION kind, zero being sigmoid. */
+
+#define NERV_MAGIC "NERV"
+#define NERV_VERSION 1
+#define NERV_ENDIAN 0x01020304
+#define NERV_FILE_ALIGN 64
+#define NERV_MAX_LAYERS 65536
+#define NERV_PAD(n) (((n) + 15) & ~15)
+
+typedef struct {
+    char magic[4];
+    uint32_t version, endian, layer_count;
+    uint64_t params_offset, params_size, checksum;
+    uint8_t reserved[24];
+} NervHeader;
+
+typedef struct {
+    int32_t size, flags;
+} NervLayer;
+
+/* Files written before versioning start with the in-memory header of the
+original Model struct, a layer count followed by a pointer. */
+
+typedef struct {
+    int layer_count;
+    Layer* layers;
+} ModelHeader;
+
+/* Four interleaved FNV-1a lanes keep the multiplies independent. Sizes
+passed in are always whole padded tensors, multiples of 16 words. */
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+typedef struct {
+    uint64_t lane[4];
+} Checksum;
+
+static void checksum_init(Checksum* sum)
+{
+    for (int i = 0; i < 4; i++) {
+        sum->lane[i] = FNV_OFFSET + i;
+    }
+}
+
+static void checksum_update(Checksum* sum, const float* data, size_t size)
+{
+    uint64_t h0 = sum->lane[0], h1 = sum->lane[1], h2 = sum->lane[2], h3 = sum->lane[3];
+    for (const float* end = data + size; data != end; data += 4) {
+        uint32_t n[4];
+        memcpy(n, data, sizeof(n));
+        h0 = (h0 ^ n[0]) * FNV_PRIME;
+        h1 = (h1 ^ n[1]) * FNV_PRIME;
+        h2 = (h2 ^ n[2]) * FNV_PRIME;
+        h3 = (h3 ^ n[3]) * FNV_PRIME;
+    }
+    sum->lane[0] = h0, sum->lane[1] = h1, sum->lane[2] = h2, sum->lane[3] = h3;
+}
+
+static uint64_t checksum_final(const Checksum* sum)
+{
+    uint64_t hash = FNV_OFFSET;
+    for (int i = 0; i < 4; i++) {
+        hash = (hash ^ sum->lane[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+static uint64_t header_params_offset(uint32_t layer_count)
+{
+    uint64_t offset = sizeof(NervHeader) + sizeof(NervLayer) * layer_count;
+    return (offset + NERV_FILE_ALIGN - 1) & ~(uint64_t)(NERV_FILE_ALIGN - 1);
+}
+
+static int header_check(const NervHeader* header, const char* path)
+{
+    if (header->version != NERV_VERSION) {
+        printf("Unsupported nerv model file version %u in '%s'\n", header->version, path);
+        return 0;
+    }
+    
+    if (header->endian != NERV_ENDIAN) {
+        printf("Nerv model file '%s' was written with a different byte order\n", path);
+        return 0;
+    }
+
+    if (!header->layer_count || header->layer_count > NERV_MAX_LAYERS || 
+        header->params_offset != header_params_offset(header->layer_count)) {
+        printf("Corrupted nerv model file header in '%s'\n", path);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Layer sizes are checked before any arithmetic on them. Each term of
+the parameter count then fits in 64 bits, and the sum stops once it is
+past what a Model can index, so it cannot wrap. */
+
+static int header_layers(const NervHeader* header, const NervLayer* layers, int* layer_sizes, const char* path)
+{
+    for (uint32_t i = 0; i < header->layer_count; i++) {
+        layer_sizes[i] = layers[i].size;
+        if (layers[i].size < 1) {
+            printf("Nerv model file '%s' has an invalid size in layer %u\n", path, i);
+            return 0;
+        }
+        if (layers[i].flags < 0 || layers[i].flags >= NERV_ACTIVATIONS) {
+            printf("Nerv model file '%s' has an unknown activation in layer %u\n", path, i);
+            return 0;
+        }
+    }
+
+    uint64_t size = 0;
+    for (uint32_t i = 0; i < header->layer_count && size <= INT_MAX; i++) {
+        uint64_t next = i + 1 < header->layer_count ? (uint64_t)layers[i + 1].size : 0;
+        size += NERV_PAD(next * layers[i].size) + NERV_PAD((uint64_t)layers[i].size);
+    }
+
+    if (size > INT_MAX || size != header->params_size) {
+        printf("Nerv model file '%s' parameter section does not match its layers\n", path);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void model_layers_activation(const Model* model, const NervLayer* layers)
+{
+    for (int i = 0; i < model->layer_count; i++) {
+        model->layers[i].activation = layers[i].flags;
+    }
+}
+
+/* Legacy files carry no size or checksum, so the layer count is bounded
+like a versioned header and the file must hold every tensor it declares
+before anything is built from it. */
+
+static Model model_load_legacy(FILE* file, char* path)
+{
+    Model model = {0, NULL, {0, NULL}, NULL, NULL, 0};
+
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    rewind(file);
+
+    ModelHeader header;
+    if (file_size < 0 || fread(&header, sizeof(ModelHeader), 1, file) != 1 ||
+        header.layer_count < 1 || header.layer_count > NERV_MAX_LAYERS) {
+        printf("Could not read nerv model file '%s'\n", path);
+        return model;
+    }
+
+    int layer_sizes[header.layer_count];
+    uint64_t size = sizeof(ModelHeader) + sizeof(int) * (uint64_t)header.layer_count;
+    if (fread(layer_sizes, sizeof(int), header.layer_count, file) != (size_t)header.layer_count) {
+        printf("Could not read nerv model file '%s'\n", path);
+        return model;
+    }
+
+    for (int i = 0; i < header.layer_count; i++) {
+        int64_t next = i + 1 < header.layer_count ? layer_sizes[i + 1] : 0;
+        uint64_t floats = (uint64_t)layer_sizes[i] * (uint64_t)(1 + next);
+        if (layer_sizes[i] < 1 || next < 0 || floats > ((uint64_t)file_size - size) / sizeof(float)) {
+            printf("Nerv model file '%s' is truncated or corrupted\n", path);
+            return model;
+        }
+        size += sizeof(float) * floats;
+    }
+
+    model = model_build(header.layer_count, layer_sizes);
+    Layer* layer = model.layers;
+    for (int i = 0; i < model.layer_count; i++, layer++) {
+        size_t weights = i < model.layer_count - 1 ? (size_t)layer->w.rows * layer->w.columns : 0;
+        if (fread(layer->a.data, sizeof(float), layer->a.size, file) != (size_t)layer->a.size ||
+            fread(layer->w.data, sizeof(float), weights, file) != weights) {
+            printf("Nerv model file '%s' is truncated or corrupted\n", path);
+            model_free(&model);
+            Model empty = {0, NULL, {0, NULL}, NULL, NULL, 0};
+            return empty;
+        }
+    }
+
+    printf("Succesfully loaded legacy nerv model file '%s'\n", path);
+    return model;
+}
+
 Model model_load(char* path)
 {
-    Model model = {0, NULL};
+    Model model = {0, NULL, {0, NULL}, NULL, NULL, 0};
 
     FILE* file = fopen(path, "rb");
     if (!file) {
@@ -18,55 +225,183 @@ Model model_load(char* path)
         return model;
     }
 
-    fread(&model, sizeof(Model), 1, file);
-    model.layers = (Layer*)malloc(sizeof(Layer) * model.layer_count);
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    rewind(file);
 
-    int layer_sizes[model.layer_count + 1];
-    memset(&layer_sizes[0], 0, sizeof(int) * (model.layer_count + 1));
-    fread(&layer_sizes[0], sizeof(int), model.layer_count, file);
+    NervHeader header;
+    if (fread(&header, sizeof(NervHeader), 1, file) != 1 || memcmp(header.magic, NERV_MAGIC, 4)) {
+        model = model_load_legacy(file, path);
+        fclose(file);
+        if (model.layers) model_print_struct(&model);
+        return model;
+    }
 
-    Layer* layer = model.layers;
-    for (int i = 0; i < model.layer_count; i++) {
-        int size = layer_sizes[i], next = layer_sizes[i + 1];
-        *layer = layer_create(size, next);
-        
-        fread(layer->a.data, sizeof(float), layer->a.size, file);
-        
-        if (!next) break;
-        fread(layer->w.data, sizeof(float), layer->w.rows * layer->w.columns, file);
-        
-        layer++;
+    if (!header_check(&header, path)) {
+        fclose(file);
+        return model;
     }
-    
+
+    /* header_check bounds layer_count to 1..NERV_MAX_LAYERS. */
+    NervLayer layers[header.layer_count];
+    int layer_sizes[header.layer_count];
+    if (fread(layers, sizeof(NervLayer), header.layer_count, file) != header.layer_count ||
+        !header_layers(&header, layers, layer_sizes, path)) {
+        fclose(file);
+        return model;
+    }
+
+    if (file_size < 0 || header.params_offset > (uint64_t)file_size ||
+        header.params_size > ((uint64_t)file_size - header.params_offset) / sizeof(float)) {
+        printf("Nerv model file '%s' is truncated or corrupted\n", path);
+        fclose(file);
+        return model;
+    }
+
+    model = model_build(header.layer_count, layer_sizes);
+    model_layers_activation(&model, layers);
+    fseek(file, (long)header.params_offset, SEEK_SET);
+    size_t read = fread(model.params.data, sizeof(float), model.params.size, file);
     fclose(file);
+
+    Checksum sum;
+    checksum_init(&sum);
+    checksum_update(&sum, model.params.data, model.params.size);
+    
+    if (read != (size_t)model.params.size || checksum_final(&sum) != header.checksum) {
+        printf("Nerv model file '%s' is truncated or corrupted\n", path);
+        model_free(&model);
+        Model empty = {0, NULL, {0, NULL}, NULL, NULL, 0};
+        return empty;
+    }
+
     printf("Succesfully loaded nerv model file '%s'\n", path);
     model_print_struct(&model);
     return model;
 }
 
+Model model_map(char* path, int verify)
+{
+    Model model = {0, NULL, {0, NULL}, NULL, NULL, 0};
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) || (size_t)st.st_size < sizeof(NervHeader)) {
+        printf("Could not map nerv model file '%s'\n", path);
+        if (fd >= 0) close(fd);
+        return model;
+    }
+
+    size_t size = (size_t)st.st_size;
+    char* map = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf("Could not map nerv model file '%s'\n", path);
+        return model;
+    }
+
+    const NervHeader* header = (const NervHeader*)map;
+    if (memcmp(header->magic, NERV_MAGIC, 4)) {
+        printf("Nerv model file '%s' is not in a mappable format\n", path);
+        munmap(map, size);
+        return model;
+    }
+
+    if (!header_check(header, path) || header->params_offset > size ||
+        header->params_size > (size - header->params_offset) / sizeof(float)) {
+        printf("Could not map nerv model file '%s'\n", path);
+        munmap(map, size);
+        return model;
+    }
+
+    /* header_check bounds layer_count to 1..NERV_MAX_LAYERS. */
+    int layer_sizes[header->layer_count];
+    if (!header_layers(header, (const NervLayer*)(map + sizeof(NervHeader)), layer_sizes, path)) {
+        munmap(map, size);
+        return model;
+    }
+
+    float* params = (float*)(map + header->params_offset);
+    if (verify) {
+        Checksum sum;
+        checksum_init(&sum);
+        checksum_update(&sum, params, header->params_size);
+        if (checksum_final(&sum) != header->checksum) {
+            printf("Nerv model file '%s' is corrupted\n", path);
+            munmap(map, size);
+            return model;
+        }
+    }
+
+    model = model_build_params(header->layer_count, layer_sizes, params);
+    model_layers_activation(&model, (const NervLayer*)(map + sizeof(NervHeader)));
+    model.map = map;
+    model.map_size = size;
+    return model;
+}
+
 void model_save(char* path, const Model* restrict model)
 {
+    if (model_compacted(model)) {
+        printf("Could not save compact model to '%s', call model_densify first\n", path);
+        return;
+    }
+
     FILE* file = fopen(path, "wb");
     if (!file) {
         printf("Could not write nerv model file '%s'\n", path);
         return;
     }
 
-    fwrite(model, sizeof(Model), 1, file);
+    NervHeader header;
+    memset(&header, 0, sizeof(NervHeader));
+    memcpy(header.magic, NERV_MAGIC, 4);
+    header.version = NERV_VERSION;
+    header.endian = NERV_ENDIAN;
+    header.layer_count = model->layer_count;
+    header.params_offset = header_params_offset(header.layer_count);
+    header.params_size = model_param_size(model);
+
+    Checksum sum;
+    checksum_init(&sum);
+    fseek(file, (long)header.params_offset, SEEK_SET);
+
+    /* Tensors are written one by one with the padding of the arena layout
+    so models without an arena produce the same file. */
 
+    float zeros[16] = {0.0f};
     Layer* layer = model->layers;
     for (Layer* end = layer + model->layer_count; layer != end; layer++) {
-        fwrite(&layer->a.size, sizeof(int), 1, file);
+        const Vec tensors[2] = {
+            {layer->w.rows * layer->w.columns, layer->w.data},
+            {layer->b.size, layer->b.data}
+        };
+
+        for (int i = 0; i < 2; i++) {
+            int size = tensors[i].size, pad = NERV_PAD(size) - size;
+            if (!size) continue;
+            fwrite(tensors[i].data, sizeof(float), size, file);
+            fwrite(zeros, sizeof(float), pad, file);
+            
+            checksum_update(&sum, tensors[i].data, size & ~15);
+            if (size & 15) {
+                float tail[16] = {0.0f};
+                memcpy(tail, tensors[i].data + (size & ~15), sizeof(float) * (size & 15));
+                checksum_update(&sum, tail, 16);
+            }
+        }
     }
+    header.checksum = checksum_final(&sum);
 
+    rewind(file);
+    fwrite(&header, sizeof(NervHeader), 1, file);
+    
     layer = model->layers;
     for (Layer* end = layer + model->layer_count; layer != end; layer++) {
-        fwrite(layer->a.data, sizeof(float), layer->a.size, file);
-        
-        if (layer + 1 == end) break;
-        fwrite(layer->w.data, sizeof(float), layer->w.rows * layer->w.columns, file);
+        NervLayer record = {layer->a.size, layer->activation};
+        fwrite(&record, sizeof(NervLayer), 1, file);
     }
 
     fclose(file);
     printf("Succesfully saved nerv file '%s'\n", path);
-}
\ No newline at end of file
+}
@@ -0,0 +1,954 @@
+
+/*********************************************
+ *  vectorized kernels and runtime dispatch
+ * ******************************************/
+
+#include <nerv.h>
+#include "simd.h"
+#include <stdio.h>
+#include <math.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+    #define NERV_X86
+    #include <immintrin.h>
+#endif
+
+/* Scalar kernels are the portable fallback and the reference every
+vectorized implementation is checked against by nerv_simd_test. */
+
+static void scalar_add(float* restrict dst, const float* restrict src, int size)
+{
+    for (float* end = dst + size; dst != end; dst++, src++) {
+        *dst += *src;
+    }
+}
+
+static void scalar_sub(float* restrict dst, const float* restrict src, int size)
+{
+    for (float* end = dst + size; dst != end; dst++, src++) {
+        *dst -= *src;
+    }
+}
+
+static void scalar_hadamard(float* restrict dst, const float* restrict src, int size)
+{
+    for (float* end = dst + size; dst != end; dst++, src++) {
+        *dst *= *src;
+    }
+}
+
+static void scalar_scale(float* restrict dst, float n, int size)
+{
+    for (float* end = dst + size; dst != end; dst++) {
+        *dst *= n;
+    }
+}
+
+static void scalar_axpy(float* restrict dst, float n, const float* restrict src, int size)
+{
+    for (float* end = dst + size; dst != end; dst++, src++) {
+        *dst += n * (*src);
+    }
+}
+
+static float scalar_dot(const float* restrict a, const float* restrict b, int size)
+{
+    float sum = 0.0f;
+    for (const float* end = a + size; a != end; a++, b++) {
+        sum += (*a) * (*b);
+    }
+    return sum;
+}
+
+/* dst += mat^T * x over size columns of rows rows, ldm floats apart. Four
+rows are folded into each load and store of dst, which stays in cache
+while mat streams past once. */
+
+static void scalar_gemv_t(float* restrict dst, const float* restrict mat, int ldm, const float* restrict x, int rows, int size)
+{
+    int y = 0;
+    for (; y + 4 <= rows; y += 4, mat += 4 * (size_t)ldm) {
+        const float* m1 = mat + ldm, *m2 = m1 + ldm, *m3 = m2 + ldm;
+        for (int i = 0; i < size; i++) {
+            dst[i] += x[y] * mat[i] + x[y + 1] * m1[i] + x[y + 2] * m2[i] + x[y + 3] * m3[i];
+        }
+    }
+    for (; y < rows; y++, mat += ldm) {
+        scalar_axpy(dst, x[y], mat, size);
+    }
+}
+
+static void scalar_sigmoid(float* dst, const float* src, int size)
+{
+    for (float* end = dst + size; dst != end; dst++, src++) {
+        *dst = fast_sigmoid(*src);
+    }
+}
+
+static void precise_sigmoid(float* dst, const float* src, int size)
+{
+    for (float* end = dst + size; dst != end; dst++, src++) {
+        *dst = _sigmoid(*src);
+    }
+}
+
+/* Optimizer rules applied in a single pass over parameters p, their
+gradients g and the state m and v of the rule. */
+
+static void scalar_update(const Update* restrict u, float* restrict p, float* restrict m, float* restrict v, const float* restrict g, float scale, int size)
+{
+    float r = u->rate, mu = u->momentum, b1 = u->beta1, b2 = u->beta2;
+    for (int i = 0; i < size; i++) {
+        float x = scale * g[i] + u->l2 * p[i];
+        switch (u->kind) {
+            case NERV_OPTIMIZER_MOMENTUM:
+                m[i] = mu * m[i] + x;
+                p[i] = u->shrink * p[i] - r * m[i];
+                break;
+            case NERV_OPTIMIZER_NESTEROV:
+                m[i] = mu * m[i] + x;
+                p[i] = u->shrink * p[i] - r * (x + mu * m[i]);
+                break;
+            case NERV_OPTIMIZER_ADAM:
+            case NERV_OPTIMIZER_ADAMW:
+                m[i] = b1 * m[i] + (1.0f - b1) * x;
+                v[i] = b2 * v[i] + (1.0f - b2) * x * x;
+                p[i] = u->shrink * p[i] - r * m[i] / (sqrtf(u->correction * v[i]) + u->epsilon);
+                break;
+            case NERV_OPTIMIZER_RMSPROP:
+                v[i] = b2 * v[i] + (1.0f - b2) * x * x;
+                p[i] = u->shrink * p[i] - r * x / (sqrtf(v[i]) + u->epsilon);
+                break;
+            default:
+                p[i] = u->shrink * p[i] - r * x;
+        }
+    }
+}
+
+/* Dot products of a row of reduced precision weights with a float vector,
+converting every weight on load and accumulating in float. */
+
+static float scalar_dot_i8(const signed char* restrict w, const float* restrict x, int size)
+{
+    float sum = 0.0f;
+    for (int i = 0; i < size; i++) {
+        sum += (float)w[i] * x[i];
+    }
+    return sum;
+}
+
+static float scalar_dot_f16(const unsigned short* restrict w, const float* restrict x, int size)
+{
+    float sum = 0.0f;
+    for (int i = 0; i < size; i++) {
+        sum += half_to_float(w[i]) * x[i];
+    }
+    return sum;
+}
+
+static float scalar_dot_bf16(const unsigned short* restrict w, const float* restrict x, int size)
+{
+    float sum = 0.0f;
+    for (int i = 0; i < size; i++) {
+        sum += bf16_to_float(w[i]) * x[i];
+    }
+    return sum;
+}
+
+/* Transpose tiles write the T x T block of src at lds floats per row
+into dst as T columns, ldd floats per row. */
+
+#define SCALAR_TILE 4
+
+static void scalar_transpose(const float* restrict src, int lds, float* restrict dst, int ldd)
+{
+    for (int y = 0; y < SCALAR_TILE; y++) {
+        for (int x = 0; x < SCALAR_TILE; x++) {
+            dst[x * ldd + y] = src[y * lds + x];
+        }
+    }
+}
+
+/* Philox4x32-10: block b is ten rounds over the counter words
+(counter + b, stream) under key, so any block can be computed on its own
+and every table produces the same bits. */
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+static void scalar_philox(unsigned int* restrict dst, unsigned long long key, unsigned long long stream, unsigned long long counter, int blocks)
+{
+    for (int b = 0; b < blocks; b++, dst += 4) {
+        unsigned long long n = counter + (unsigned long long)b;
+        unsigned int c0 = (unsigned int)n, c1 = (unsigned int)(n >> 32);
+        unsigned int c2 = (unsigned int)stream, c3 = (unsigned int)(stream >> 32);
+        unsigned int k0 = (unsigned int)key, k1 = (unsigned int)(key >> 32);
+
+        for (int r = 0; r < PHILOX_ROUNDS; r++, k0 += PHILOX_W0, k1 += PHILOX_W1) {
+            unsigned long long p0 = (unsigned long long)PHILOX_M0 * c0;
+            unsigned long long p1 = (unsigned long long)PHILOX_M1 * c2;
+            c0 = (unsigned int)(p1 >> 32) ^ c1 ^ k0;
+            c2 = (unsigned int)(p0 >> 32) ^ c3 ^ k1;
+            c1 = (unsigned int)p1;
+            c3 = (unsigned int)p0;
+        }
+
+        dst[0] = c0;
+        dst[1] = c1;
+        dst[2] = c2;
+        dst[3] = c3;
+    }
+}
+
+/* GEMM micro-kernels multiply a packed mr x kc panel of A by a packed
+kc x nr panel of B, both zero padded to the full tile of the kernel, and
+add the valid mr x nr corner of the product into C. */
+
+#define SCALAR_MR 4
+#define SCALAR_NR 8
+
+static void gemm_tile_add(float* restrict c, int ldc, const float* restrict tile, int tn, int mr, int nr)
+{
+    for (int i = 0; i < mr; i++, c += ldc, tile += tn) {
+        for (int j = 0; j < nr; j++) {
+            c[j] += tile[j];
+        }
+    }
+}
+
+static void scalar_gemm(int kc, const float* restrict a, const float* restrict b, float* restrict c, int ldc, int mr, int nr)
+{
+    float acc[SCALAR_MR * SCALAR_NR] = {0.0f};
+    for (int k = 0; k < kc; k++, a += SCALAR_MR, b += SCALAR_NR) {
+        for (int i = 0; i < SCALAR_MR; i++) {
+            for (int j = 0; j < SCALAR_NR; j++) {
+                acc[i * SCALAR_NR + j] += a[i] * b[j];
+            }
+        }
+    }
+    gemm_tile_add(c, ldc, acc, SCALAR_NR, mr, nr);
+}
+
+#ifdef NERV_X86
+
+/* The three instruction sets share one template per kernel. Before each
+instantiation V_* names the register type and intrinsics of that set and
+W the number of floats per register; the remainder that does not fill a
+register goes through the scalar kernel. */
+
+#define SIMD_BINARY(prefix, name, OP, tail)                             \
+static void prefix##_##name(float* restrict dst, const float* restrict src, int size) \
+{                                                                       \
+    int i = 0;                                                          \
+    for (; i + W <= size; i += W) {                                     \
+        V_STORE(dst + i, OP(V_LOAD(dst + i), V_LOAD(src + i)));         \
+    }                                                                   \
+    tail(dst + i, src + i, size - i);                                   \
+}
+
+#define SIMD_KERNELS(prefix)                                            \
+SIMD_BINARY(prefix, add, V_ADD, scalar_add)                             \
+SIMD_BINARY(prefix, sub, V_SUB, scalar_sub)                             \
+SIMD_BINARY(prefix, hadamard, V_MUL, scalar_hadamard)                   \
+                                                                        \
+static void prefix##_scale(float* restrict dst, float n, int size)      \
+{                                                                       \
+    V s = V_SET1(n);                                                    \
+    int i = 0;                                                          \
+    for (; i + W <= size; i += W) {                                     \
+        V_STORE(dst + i, V_MUL(V_LOAD(dst + i), s));                    \
+    }                                                                   \
+    scalar_scale(dst + i, n, size - i);                                 \
+}                                                                       \
+                                                                        \
+static void prefix##_axpy(float* restrict dst, float n, const float* restrict src, int size) \
+{                                                                       \
+    V s = V_SET1(n);                                                    \
+    int i = 0;                                                          \
+    for (; i + W <= size; i += W) {                                     \
+        V_STORE(dst + i, V_FMA(s, V_LOAD(src + i), V_LOAD(dst + i)));   \
+    }                                                                   \
+    scalar_axpy(dst + i, n, src + i, size - i);                         \
+}                                                                       \
+                                                                        \
+static float prefix##_dot(const float* restrict a, const float* restrict b, int size) \
+{                                                                       \
+    V s0 = V_SET1(0.0f), s1 = V_SET1(0.0f);                             \
+    int i = 0;                                                          \
+    for (; i + 2 * W <= size; i += 2 * W) {                             \
+        s0 = V_FMA(V_LOAD(a + i), V_LOAD(b + i), s0);                   \
+        s1 = V_FMA(V_LOAD(a + i + W), V_LOAD(b + i + W), s1);           \
+    }                                                                   \
+    for (; i + W <= size; i += W) {                                     \
+        s0 = V_FMA(V_LOAD(a + i), V_LOAD(b + i), s0);                   \
+    }                                                                   \
+    return V_HSUM(V_ADD(s0, s1)) + scalar_dot(a + i, b + i, size - i);  \
+}                                                                       \
+                                                                        \
+static void prefix##_gemv_t(float* restrict dst, const float* restrict mat, int ldm, const float* restrict x, int rows, int size) \
+{                                                                       \
+    int y = 0;                                                          \
+    for (; y + 4 <= rows; y += 4, mat += 4 * (size_t)ldm) {             \
+        const float* m1 = mat + ldm, *m2 = m1 + ldm, *m3 = m2 + ldm;    \
+        V x0 = V_SET1(x[y]), x1 = V_SET1(x[y + 1]);                     \
+        V x2 = V_SET1(x[y + 2]), x3 = V_SET1(x[y + 3]);                 \
+        int i = 0;                                                      \
+        for (; i + W <= size; i += W) {                                 \
+            V acc = V_FMA(x0, V_LOAD(mat + i), V_LOAD(dst + i));        \
+            acc = V_FMA(x1, V_LOAD(m1 + i), acc);                       \
+            acc = V_FMA(x2, V_LOAD(m2 + i), acc);                       \
+            V_STORE(dst + i, V_FMA(x3, V_LOAD(m3 + i), acc));           \
+        }                                                               \
+        for (; i < size; i++) {                                         \
+            dst[i] += x[y] * mat[i] + x[y + 1] * m1[i] + x[y + 2] * m2[i] + x[y + 3] * m3[i]; \
+        }                                                               \
+    }                                                                   \
+    for (; y < rows; y++, mat += ldm) {                                 \
+        prefix##_axpy(dst, x[y], mat, size);                            \
+    }                                                                   \
+}                                                                       \
+                                                                        \
+static inline V prefix##_exp(V x)                                       \
+{                                                                       \
+    x = V_MIN(V_MAX(x, V_SET1(EXP_MIN)), V_SET1(EXP_MAX));              \
+    VI n = V_ROUND(V_MUL(x, V_SET1(EXP_LOG2E)));                        \
+    V fn = V_TOFLOAT(n);                                                \
+    x = V_SUB(x, V_MUL(fn, V_SET1(EXP_LN2_HI)));                        \
+    x = V_SUB(x, V_MUL(fn, V_SET1(EXP_LN2_LO)));                        \
+    V y = V_SET1(EXP_P0);                                               \
+    y = V_FMA(y, x, V_SET1(EXP_P1));                                    \
+    y = V_FMA(y, x, V_SET1(EXP_P2));                                    \
+    y = V_FMA(y, x, V_SET1(EXP_P3));                                    \
+    y = V_FMA(y, x, V_SET1(EXP_P4));                                    \
+    y = V_FMA(y, x, V_SET1(EXP_P5));                                    \
+    y = V_ADD(V_FMA(y, V_MUL(x, x), x), V_SET1(1.0f));                  \
+    return V_MUL(y, V_POW2(n));                                         \
+}                                                                       \
+                                                                        \
+static void prefix##_sigmoid(float* dst, const float* src, int size)    \
+{                                                                       \
+    V one = V_SET1(1.0f);                                               \
+    int i = 0;                                                          \
+    for (; i + W <= size; i += W) {                                     \
+        V e = prefix##_exp(V_SUB(V_SET1(0.0f), V_LOAD(src + i)));       \
+        V_STORE(dst + i, V_DIV(one, V_ADD(one, e)));                    \
+    }                                                                   \
+    scalar_sigmoid(dst + i, src + i, size - i);                         \
+}                                                                       \
+                                                                        \
+static void prefix##_update(const Update* restrict u, float* restrict p, float* restrict m, float* restrict v, const float* restrict g, float scale, int size) \
+{                                                                       \
+    V r = V_SET1(u->rate), mu = V_SET1(u->momentum), s = V_SET1(scale); \
+    V b1 = V_SET1(u->beta1), c1 = V_SET1(1.0f - u->beta1);              \
+    V b2 = V_SET1(u->beta2), c2 = V_SET1(1.0f - u->beta2);              \
+    V l2 = V_SET1(u->l2), shrink = V_SET1(u->shrink);                   \
+    V eps = V_SET1(u->epsilon), corr = V_SET1(u->correction);           \
+    int i = 0;                                                          \
+    for (; i + W <= size; i += W) {                                     \
+        V w = V_LOAD(p + i), x = V_FMA(s, V_LOAD(g + i), V_MUL(l2, w)), step; \
+        if (u->kind == NERV_OPTIMIZER_MOMENTUM || u->kind == NERV_OPTIMIZER_NESTEROV) { \
+            V n = V_FMA(mu, V_LOAD(m + i), x);                          \
+            V_STORE(m + i, n);                                          \
+            step = u->kind == NERV_OPTIMIZER_NESTEROV ? V_FMA(mu, n, x) : n; \
+        } else if (u->kind == NERV_OPTIMIZER_RMSPROP) {                 \
+            V q = V_FMA(b2, V_LOAD(v + i), V_MUL(c2, V_MUL(x, x)));     \
+            V_STORE(v + i, q);                                          \
+            step = V_DIV(x, V_ADD(V_SQRT(q), eps));                     \
+        } else if (u->kind == NERV_OPTIMIZER_ADAM || u->kind == NERV_OPTIMIZER_ADAMW) { \
+            V n = V_FMA(b1, V_LOAD(m + i), V_MUL(c1, x));               \
+            V q = V_FMA(b2, V_LOAD(v + i), V_MUL(c2, V_MUL(x, x)));     \
+            V_STORE(m + i, n);                                          \
+            V_STORE(v + i, q);                                          \
+            step = V_DIV(n, V_ADD(V_SQRT(V_MUL(corr, q)), eps));        \
+        } else {                                                        \
+            step = x;                                                   \
+        }                                                               \
+        V_STORE(p + i, V_SUB(V_MUL(shrink, w), V_MUL(r, step)));        \
+    }                                                                   \
+    scalar_update(u, p + i, m ? m + i : m, v ? v + i : v, g + i, scale, size - i); \
+}
+
+/* The reduced precision dot products load W weights at a time through
+V_LOAD_I8, V_LOAD_F16 and V_LOAD_BF16, which widen them to floats. SSE2
+has no cheap widening, so its table keeps the scalar versions. */
+
+#define SIMD_QDOT(prefix, name, type, LOAD)                             \
+static float prefix##_dot_##name(const type* restrict w, const float* restrict x, int size) \
+{                                                                       \
+    V s0 = V_SET1(0.0f), s1 = V_SET1(0.0f);                             \
+    int i = 0;                                                          \
+    for (; i + 2 * W <= size; i += 2 * W) {                             \
+        s0 = V_FMA(LOAD(w + i), V_LOAD(x + i), s0);                     \
+        s1 = V_FMA(LOAD(w + i + W), V_LOAD(x + i + W), s1);             \
+    }                                                                   \
+    for (; i + W <= size; i += W) {                                     \
+        s0 = V_FMA(LOAD(w + i), V_LOAD(x + i), s0);                     \
+    }                                                                   \
+    return V_HSUM(V_ADD(s0, s1)) + scalar_dot_##name(w + i, x + i, size - i); \
+}
+
+#define SIMD_QUANT_KERNELS(prefix)                                      \
+SIMD_QDOT(prefix, i8, signed char, V_LOAD_I8)                           \
+SIMD_QDOT(prefix, f16, unsigned short, V_LOAD_F16)                      \
+SIMD_QDOT(prefix, bf16, unsigned short, V_LOAD_BF16)
+
+#pragma GCC push_options
+#pragma GCC target("sse2")
+
+static inline float sse_hsum(__m128 v)
+{
+    __m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+#define W 4
+#define V __m128
+#define VI __m128i
+#define V_LOAD _mm_loadu_ps
+#define V_STORE _mm_storeu_ps
+#define V_SET1 _mm_set1_ps
+#define V_ADD _mm_add_ps
+#define V_SUB _mm_sub_ps
+#define V_MUL _mm_mul_ps
+#define V_DIV _mm_div_ps
+#define V_SQRT _mm_sqrt_ps
+#define V_MIN _mm_min_ps
+#define V_MAX _mm_max_ps
+#define V_FMA(a, b, c) _mm_add_ps(_mm_mul_ps(a, b), c)
+#define V_HSUM sse_hsum
+#define V_ROUND _mm_cvtps_epi32
+#define V_TOFLOAT _mm_cvtepi32_ps
+#define V_POW2(n) _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23))
+SIMD_KERNELS(sse)
+#include "simd_undef.h"
+
+#define SSE_TILE 4
+
+static void sse_transpose(const float* restrict src, int lds, float* restrict dst, int ldd)
+{
+    __m128 r0 = _mm_loadu_ps(src), r1 = _mm_loadu_ps(src + lds);
+    __m128 r2 = _mm_loadu_ps(src + 2 * lds), r3 = _mm_loadu_ps(src + 3 * lds);
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    _mm_storeu_ps(dst, r0);
+    _mm_storeu_ps(dst + ldd, r1);
+    _mm_storeu_ps(dst + 2 * ldd, r2);
+    _mm_storeu_ps(dst + 3 * ldd, r3);
+}
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma,f16c")
+
+static inline float avx2_hsum(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+#define W 8
+#define V __m256
+#define VI __m256i
+#define V_LOAD _mm256_loadu_ps
+#define V_STORE _mm256_storeu_ps
+#define V_SET1 _mm256_set1_ps
+#define V_ADD _mm256_add_ps
+#define V_SUB _mm256_sub_ps
+#define V_MUL _mm256_mul_ps
+#define V_DIV _mm256_div_ps
+#define V_SQRT _mm256_sqrt_ps
+#define V_MIN _mm256_min_ps
+#define V_MAX _mm256_max_ps
+#define V_FMA _mm256_fmadd_ps
+#define V_HSUM avx2_hsum
+#define V_ROUND _mm256_cvtps_epi32
+#define V_TOFLOAT _mm256_cvtepi32_ps
+#define V_POW2(n) _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(n, _mm256_set1_epi32(127)), 23))
+#define V_LOAD_I8(p) _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(p))))
+#define V_LOAD_F16(p) _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(p)))
+#define V_LOAD_BF16(p) _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(p))), 16))
+SIMD_KERNELS(avx2)
+SIMD_QUANT_KERNELS(avx2)
+#include "simd_undef.h"
+
+/* 6 x 16 tile: twelve accumulators, two loads of B and six broadcasts of
+A per step keep both FMA ports busy. */
+
+#define AVX2_MR 6
+#define AVX2_NR 16
+
+#define AVX2_ROW(i)                                                     \
+    a##i = _mm256_broadcast_ss(a + i);                                  \
+    c##i##0 = _mm256_fmadd_ps(a##i, b0, c##i##0);                       \
+    c##i##1 = _mm256_fmadd_ps(a##i, b1, c##i##1);
+
+#define AVX2_STORE(i)                                                   \
+    _mm256_storeu_ps(tile + i * AVX2_NR, c##i##0);                      \
+    _mm256_storeu_ps(tile + i * AVX2_NR + 8, c##i##1);
+
+static void avx2_gemm(int kc, const float* restrict a, const float* restrict b, float* restrict c, int ldc, int mr, int nr)
+{
+    __m256 c00 = _mm256_setzero_ps(), c01 = c00, c10 = c00, c11 = c00, c20 = c00, c21 = c00;
+    __m256 c30 = c00, c31 = c00, c40 = c00, c41 = c00, c50 = c00, c51 = c00;
+    __m256 a0, a1, a2, a3, a4, a5;
+    
+    for (int k = 0; k < kc; k++, a += AVX2_MR, b += AVX2_NR) {
+        __m256 b0 = _mm256_loadu_ps(b), b1 = _mm256_loadu_ps(b + 8);
+        AVX2_ROW(0) AVX2_ROW(1) AVX2_ROW(2) AVX2_ROW(3) AVX2_ROW(4) AVX2_ROW(5)
+    }
+
+    float tile[AVX2_MR * AVX2_NR];
+    AVX2_STORE(0) AVX2_STORE(1) AVX2_STORE(2) AVX2_STORE(3) AVX2_STORE(4) AVX2_STORE(5)
+    gemm_tile_add(c, ldc, tile, AVX2_NR, mr, nr);
+}
+
+/* 8 x 8 transpose in three shuffle stages: unpack interleaves pairs of
+rows, shuffle gathers groups of four and permute2f128 swaps the 128 bit
+halves across the two groups of four rows. */
+
+#define AVX2_TILE 8
+
+static void avx2_transpose(const float* restrict src, int lds, float* restrict dst, int ldd)
+{
+    __m256 r0 = _mm256_loadu_ps(src), r1 = _mm256_loadu_ps(src + lds);
+    __m256 r2 = _mm256_loadu_ps(src + 2 * lds), r3 = _mm256_loadu_ps(src + 3 * lds);
+    __m256 r4 = _mm256_loadu_ps(src + 4 * lds), r5 = _mm256_loadu_ps(src + 5 * lds);
+    __m256 r6 = _mm256_loadu_ps(src + 6 * lds), r7 = _mm256_loadu_ps(src + 7 * lds);
+
+    __m256 t0 = _mm256_unpacklo_ps(r0, r1), t1 = _mm256_unpackhi_ps(r0, r1);
+    __m256 t2 = _mm256_unpacklo_ps(r2, r3), t3 = _mm256_unpackhi_ps(r2, r3);
+    __m256 t4 = _mm256_unpacklo_ps(r4, r5), t5 = _mm256_unpackhi_ps(r4, r5);
+    __m256 t6 = _mm256_unpacklo_ps(r6, r7), t7 = _mm256_unpackhi_ps(r6, r7);
+
+    r0 = _mm256_shuffle_ps(t0, t2, 0x44);
+    r1 = _mm256_shuffle_ps(t0, t2, 0xEE);
+    r2 = _mm256_shuffle_ps(t1, t3, 0x44);
+    r3 = _mm256_shuffle_ps(t1, t3, 0xEE);
+    r4 = _mm256_shuffle_ps(t4, t6, 0x44);
+    r5 = _mm256_shuffle_ps(t4, t6, 0xEE);
+    r6 = _mm256_shuffle_ps(t5, t7, 0x44);
+    r7 = _mm256_shuffle_ps(t5, t7, 0xEE);
+
+    _mm256_storeu_ps(dst, _mm256_permute2f128_ps(r0, r4, 0x20));
+    _mm256_storeu_ps(dst + ldd, _mm256_permute2f128_ps(r1, r5, 0x20));
+    _mm256_storeu_ps(dst + 2 * ldd, _mm256_permute2f128_ps(r2, r6, 0x20));
+    _mm256_storeu_ps(dst + 3 * ldd, _mm256_permute2f128_ps(r3, r7, 0x20));
+    _mm256_storeu_ps(dst + 4 * ldd, _mm256_permute2f128_ps(r0, r4, 0x31));
+    _mm256_storeu_ps(dst + 5 * ldd, _mm256_permute2f128_ps(r1, r5, 0x31));
+    _mm256_storeu_ps(dst + 6 * ldd, _mm256_permute2f128_ps(r2, r6, 0x31));
+    _mm256_storeu_ps(dst + 7 * ldd, _mm256_permute2f128_ps(r3, r7, 0x31));
+}
+
+/* Eight Philox blocks per step, one per 32 bit lane. mul_epu32 only
+multiplies the even lanes, so the odd lanes are shifted down and
+multiplied apart, and the four words of the eight blocks are transposed
+back into block order on the way out. GCC leaves the upper halves dirty
+on the tail call into the scalar kernel, which slows every SSE libm
+call after it, so they are cleared by hand. */
+
+static inline void avx2_mulhilo(__m256i a, __m256i m, __m256i* hi, __m256i* lo)
+{
+    __m256i even = _mm256_mul_epu32(a, m), odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), m);
+    *lo = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+    *hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+}
+
+static void avx2_philox(unsigned int* restrict dst, unsigned long long key, unsigned long long stream, unsigned long long counter, int blocks)
+{
+    const __m256i m0 = _mm256_set1_epi32((int)PHILOX_M0), m1 = _mm256_set1_epi32((int)PHILOX_M1);
+    int b = 0;
+
+    for (; b + 8 <= blocks; b += 8, dst += 32) {
+        unsigned int lo[8], hi[8];
+        for (int i = 0; i < 8; i++) {
+            unsigned long long n = counter + (unsigned long long)(b + i);
+            lo[i] = (unsigned int)n;
+            hi[i] = (unsigned int)(n >> 32);
+        }
+
+        __m256i c0 = _mm256_loadu_si256((const __m256i*)lo), c1 = _mm256_loadu_si256((const __m256i*)hi);
+        __m256i c2 = _mm256_set1_epi32((int)(unsigned int)stream), c3 = _mm256_set1_epi32((int)(unsigned int)(stream >> 32));
+        unsigned int k0 = (unsigned int)key, k1 = (unsigned int)(key >> 32);
+
+        for (int r = 0; r < PHILOX_ROUNDS; r++, k0 += PHILOX_W0, k1 += PHILOX_W1) {
+            __m256i h0, l0, h1, l1;
+            avx2_mulhilo(c0, m0, &h0, &l0);
+            avx2_mulhilo(c2, m1, &h1, &l1);
+            c0 = _mm256_xor_si256(_mm256_xor_si256(h1, c1), _mm256_set1_epi32((int)k0));
+            c2 = _mm256_xor_si256(_mm256_xor_si256(h0, c3), _mm256_set1_epi32((int)k1));
+            c1 = l1;
+            c3 = l0;
+        }
+
+        __m256i t0 = _mm256_unpacklo_epi32(c0, c1), t1 = _mm256_unpackhi_epi32(c0, c1);
+        __m256i t2 = _mm256_unpacklo_epi32(c2, c3), t3 = _mm256_unpackhi_epi32(c2, c3);
+        __m256i u0 = _mm256_unpacklo_epi64(t0, t2), u1 = _mm256_unpackhi_epi64(t0, t2);
+        __m256i u2 = _mm256_unpacklo_epi64(t1, t3), u3 = _mm256_unpackhi_epi64(t1, t3);
+        _mm256_storeu_si256((__m256i*)dst, _mm256_permute2x128_si256(u0, u1, 0x20));
+        _mm256_storeu_si256((__m256i*)(dst + 8), _mm256_permute2x128_si256(u2, u3, 0x20));
+        _mm256_storeu_si256((__m256i*)(dst + 16), _mm256_permute2x128_si256(u0, u1, 0x31));
+        _mm256_storeu_si256((__m256i*)(dst + 24), _mm256_permute2x128_si256(u2, u3, 0x31));
+    }
+
+    _mm256_zeroupper();
+    scalar_philox(dst, key, stream, counter + (unsigned long long)b, blocks - b);
+}
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+
+#define W 16
+#define V __m512
+#define VI __m512i
+#define V_LOAD _mm512_loadu_ps
+#define V_STORE _mm512_storeu_ps
+#define V_SET1 _mm512_set1_ps
+#define V_ADD _mm512_add_ps
+#define V_SUB _mm512_sub_ps
+#define V_MUL _mm512_mul_ps
+#define V_DIV _mm512_div_ps
+#define V_SQRT _mm512_sqrt_ps
+#define V_MIN _mm512_min_ps
+#define V_MAX _mm512_max_ps
+#define V_FMA _mm512_fmadd_ps
+#define V_HSUM _mm512_reduce_add_ps
+#define V_ROUND _mm512_cvtps_epi32
+#define V_TOFLOAT _mm512_cvtepi32_ps
+#define V_POW2(n) _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_add_epi32(n, _mm512_set1_epi32(127)), 23))
+#define V_LOAD_I8(p) _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)(p))))
+#define V_LOAD_F16(p) _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(p)))
+#define V_LOAD_BF16(p) _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(p))), 16))
+SIMD_KERNELS(avx512)
+SIMD_QUANT_KERNELS(avx512)
+#include "simd_undef.h"
+
+/* 6 x 32 tile, the AVX2 layout on registers twice as wide. */
+
+#define AVX512_MR 6
+#define AVX512_NR 32
+
+#define AVX512_ROW(i)                                                   \
+    a##i = _mm512_set1_ps(a[i]);                                        \
+    c##i##0 = _mm512_fmadd_ps(a##i, b0, c##i##0);                       \
+    c##i##1 = _mm512_fmadd_ps(a##i, b1, c##i##1);
+
+#define AVX512_STORE(i)                                                 \
+    _mm512_storeu_ps(tile + i * AVX512_NR, c##i##0);                    \
+    _mm512_storeu_ps(tile + i * AVX512_NR + 16, c##i##1);
+
+static void avx512_gemm(int kc, const float* restrict a, const float* restrict b, float* restrict c, int ldc, int mr, int nr)
+{
+    __m512 c00 = _mm512_setzero_ps(), c01 = c00, c10 = c00, c11 = c00, c20 = c00, c21 = c00;
+    __m512 c30 = c00, c31 = c00, c40 = c00, c41 = c00, c50 = c00, c51 = c00;
+    __m512 a0, a1, a2, a3, a4, a5;
+    
+    for (int k = 0; k < kc; k++, a += AVX512_MR, b += AVX512_NR) {
+        __m512 b0 = _mm512_loadu_ps(b), b1 = _mm512_loadu_ps(b + 16);
+        AVX512_ROW(0) AVX512_ROW(1) AVX512_ROW(2) AVX512_ROW(3) AVX512_ROW(4) AVX512_ROW(5)
+    }
+
+    float tile[AVX512_MR * AVX512_NR];
+    AVX512_STORE(0) AVX512_STORE(1) AVX512_STORE(2) AVX512_STORE(3) AVX512_STORE(4) AVX512_STORE(5)
+    gemm_tile_add(c, ldc, tile, AVX512_NR, mr, nr);
+}
+
+#pragma GCC pop_options
+
+#endif /* NERV_X86 */
+
+/*------------------------------------------*/
+
+/*      KERNEL TABLES AND CPU DISPATCH      */
+
+/*------------------------------------------*/
+
+#define KERNEL_TABLE(lvl, prefix, gemm_prefix, mr, nr, q, rng, tr, tile) { \
+    lvl, prefix##_add, prefix##_sub, prefix##_hadamard,                 \
+    prefix##_scale, prefix##_axpy, prefix##_dot, prefix##_gemv_t,      \
+    prefix##_sigmoid,                                                   \
+    mr, nr, gemm_prefix##_gemm, prefix##_update,                        \
+    q##_dot_i8, q##_dot_f16, q##_dot_bf16, rng##_philox,                \
+    tile, tr##_transpose                                                \
+}
+
+static const Kernels kernel_tables[] = {
+    KERNEL_TABLE(NERV_SIMD_SCALAR, scalar, scalar, SCALAR_MR, SCALAR_NR, scalar, scalar, scalar, SCALAR_TILE),
+#ifdef NERV_X86
+    KERNEL_TABLE(NERV_SIMD_SSE, sse, scalar, SCALAR_MR, SCALAR_NR, scalar, scalar, sse, SSE_TILE),
+    KERNEL_TABLE(NERV_SIMD_AVX2, avx2, avx2, AVX2_MR, AVX2_NR, avx2, avx2, avx2, AVX2_TILE),
+    KERNEL_TABLE(NERV_SIMD_AVX512, avx512, avx512, AVX512_MR, AVX512_NR, avx512, avx2, avx2, AVX2_TILE),
+#endif
+};
+
+static const char* kernel_names[] = {"scalar", "sse", "avx2", "avx512"};
+
+Kernels nerv_kernels = {
+    NERV_SIMD_SCALAR, scalar_add, scalar_sub, scalar_hadamard,
+    scalar_scale, scalar_axpy, scalar_dot, scalar_gemv_t, precise_sigmoid,
+    SCALAR_MR, SCALAR_NR, scalar_gemm, scalar_update,
+    scalar_dot_i8, scalar_dot_f16, scalar_dot_bf16, scalar_philox,
+    SCALAR_TILE, scalar_transpose
+};
+
+/* The AVX-512 table borrows the AVX2 philox, transpose and half precision
+kernels, so it also needs every feature the AVX2 table does. */
+
+static int simd_supported()
+{
+#ifdef NERV_X86
+    __builtin_cpu_init();
+    int avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+    if (avx2 && __builtin_cpu_supports("avx512f")) return NERV_SIMD_AVX512;
+    if (avx2) return NERV_SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2")) return NERV_SIMD_SSE;
+#endif
+    return NERV_SIMD_SCALAR;
+}
+
+static int sigmoid_mode = NERV_SIGMOID_PRECISE;
+
+static void simd_resolve(int level)
+{
+    nerv_kernels = kernel_tables[level];
+    if (sigmoid_mode == NERV_SIGMOID_PRECISE) {
+        nerv_kernels.sigmoid = precise_sigmoid;
+    }
+}
+
+#ifdef __GNUC__
+__attribute__((constructor))
+#endif
+static void simd_load()
+{
+    simd_resolve(simd_supported());
+}
+
+int nerv_simd_set(int level)
+{
+    int supported = simd_supported();
+    if (level < NERV_SIMD_SCALAR) level = NERV_SIMD_SCALAR;
+    if (level > supported) level = supported;
+    simd_resolve(level);
+    return level;
+}
+
+void nerv_sigmoid_mode(int mode)
+{
+    sigmoid_mode = mode;
+    simd_resolve(nerv_kernels.level);
+}
+
+int nerv_simd_level()
+{
+    return nerv_kernels.level;
+}
+
+const char* nerv_simd_name()
+{
+    return kernel_names[nerv_kernels.level];
+}
+
+/*------------------------------------------*/
+
+/*       SELF TEST AGAINST SCALAR KERNELS   */
+
+/*------------------------------------------*/
+
+#define SIMD_TEST_SIZE 67
+#define SIMD_TEST_ROWS 7
+
+static int simd_compare(const char* op, int level, int size, const float* a, const float* b, int n)
+{
+    for (int i = 0; i < n; i++) {
+        float tolerance = 1e-5f * (1.0f + fabsf(b[i]) + (float)size);
+        if (fabsf(a[i] - b[i]) > tolerance) {
+            printf("SIMD Test: %s %s failed at size %d (%f != %f)\n", kernel_names[level], op, size, a[i], b[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Checks the micro-kernel of a table on packed panels against a plain
+triple loop, for every partial tile and a depth past one register. */
+
+#define SIMD_TEST_DEPTH 19
+#define SIMD_TEST_TILE (8 * 32)
+
+static int simd_test_gemm(const Kernels* k, int level)
+{
+    float a[SIMD_TEST_DEPTH * 8], b[SIMD_TEST_DEPTH * 32];
+    float c[SIMD_TEST_TILE], ref[SIMD_TEST_TILE];
+    int tm = k->gemm_mr, tn = k->gemm_nr;
+
+    for (int i = 0; i < SIMD_TEST_DEPTH * tm; i++) a[i] = (float)(i % 11) * 0.25f - 1.0f;
+    for (int i = 0; i < SIMD_TEST_DEPTH * tn; i++) b[i] = (float)(i % 5) * -0.5f + 0.75f;
+
+    for (int mr = 1; mr <= tm; mr++) {
+        for (int nr = 1; nr <= tn; nr++) {
+            for (int i = 0; i < tm * tn; i++) c[i] = ref[i] = 1.0f;
+            
+            k->gemm(SIMD_TEST_DEPTH, a, b, c, tn, mr, nr);
+            for (int i = 0; i < mr; i++) {
+                for (int j = 0; j < nr; j++) {
+                    for (int z = 0; z < SIMD_TEST_DEPTH; z++) {
+                        ref[i * tn + j] += a[z * tm + i] * b[z * tn + j];
+                    }
+                }
+            }
+            
+            if (simd_compare("gemm", level, SIMD_TEST_DEPTH, c, ref, tm * tn)) return 1;
+        }
+    }
+    
+    return 0;
+}
+
+/* Runs every optimizer rule twice from the same state on both tables and
+compares parameters and state. */
+
+static int simd_test_update(const Kernels* k, const Kernels* ref, int level, const float* x, const float* y, int n)
+{
+    float p[2][SIMD_TEST_SIZE], m[2][SIMD_TEST_SIZE], v[2][SIMD_TEST_SIZE];
+    Update u = {0, 0.05f, 0.9f, 0.9f, 0.99f, 1e-3f, 0.01f, 0.999f, 1.5f};
+    
+    for (u.kind = 0; u.kind < NERV_OPTIMIZERS; u.kind++) {
+        for (int i = 0; i < n; i++) {
+            p[0][i] = p[1][i] = x[i];
+            m[0][i] = m[1][i] = y[i] * 0.1f;
+            v[0][i] = v[1][i] = fabsf(y[i]);
+        }
+
+        for (int t = 0; t < 2; t++) {
+            k->update(&u, p[0], m[0], v[0], y, 0.5f, n);
+            ref->update(&u, p[1], m[1], v[1], y, 0.5f, n);
+        }
+        
+        if (simd_compare("update", level, n, p[0], p[1], n) || simd_compare("update", level, n, m[0], m[1], n) ||
+            simd_compare("update", level, n, v[0], v[1], n)) return 1;
+    }
+
+    return 0;
+}
+
+/* Transposes one tile out of a wider source into a wider destination
+and checks every element, including that nothing outside the tile is
+written. */
+
+static int simd_test_transpose(const Kernels* k, int level, const float* src)
+{
+    float dst[SIMD_TEST_TILE];
+    int t = k->transpose_tile, lds = t + 3, ldd = t + 5;
+
+    for (int i = 0; i < t * ldd; i++) dst[i] = -1.0f;
+    k->transpose(src, lds, dst, ldd);
+    for (int y = 0; y < t; y++) {
+        for (int x = 0; x < ldd; x++) {
+            float expected = x < t ? src[x * lds + y] : -1.0f;
+            if (dst[y * ldd + x] != expected) {
+                printf("SIMD Test: %s transpose failed at (%d, %d)\n", kernel_names[level], y, x);
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Blocks of every table must match the scalar bits exactly, including
+counters that carry into their high word. */
+
+#define SIMD_TEST_BLOCKS 21
+
+static int simd_test_philox(const Kernels* k, const Kernels* ref, int level)
+{
+    unsigned int a[SIMD_TEST_BLOCKS * 4], b[SIMD_TEST_BLOCKS * 4];
+    unsigned long long counter = 0xFFFFFFF9ull;
+
+    for (int n = 0; n <= SIMD_TEST_BLOCKS; n++) {
+        k->philox(a, 0x0123456789ABCDEFull, 7, counter, n);
+        ref->philox(b, 0x0123456789ABCDEFull, 7, counter, n);
+        for (int i = 0; i < n * 4; i++) {
+            if (a[i] != b[i]) {
+                printf("SIMD Test: %s philox failed at %d blocks (%u != %u)\n", kernel_names[level], n, a[i], b[i]);
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int nerv_simd_test()
+{
+    float x[SIMD_TEST_SIZE], y[SIMD_TEST_SIZE], z[SIMD_TEST_SIZE];
+    float r[SIMD_TEST_SIZE], s[SIMD_TEST_SIZE], w[SIMD_TEST_SIZE * SIMD_TEST_ROWS];
+    signed char q8[SIMD_TEST_SIZE];
+    unsigned short q16[SIMD_TEST_SIZE];
+    for (int i = 0; i < SIMD_TEST_SIZE; i++) {
+        q8[i] = (signed char)(i * 37 % 255 - 127);
+        x[i] = (float)(i % 13) * 0.37f - 2.0f;
+        y[i] = (float)(i % 7) * -0.61f + 1.5f;
+        z[i] = (float)(i - SIMD_TEST_SIZE / 2) * 3.1f;
+        q16[i] = float_to_half(x[i]);
+    }
+    for (int i = 0; i < SIMD_TEST_SIZE * SIMD_TEST_ROWS; i++) {
+        w[i] = (float)(i % 17) * 0.23f - 1.9f;
+    }
+
+    const Kernels* ref = kernel_tables;
+    int failures = 0, supported = simd_supported();
+    
+    failures += simd_test_gemm(ref, NERV_SIMD_SCALAR);
+    failures += simd_test_transpose(ref, NERV_SIMD_SCALAR, w);
+    for (int level = NERV_SIMD_SCALAR + 1; level <= supported; level++) {
+        const Kernels* k = kernel_tables + level;
+        for (int n = 0; n <= SIMD_TEST_SIZE; n++) {
+            
+#define SIMD_TEST_OP(op, call_k, call_ref)                              \
+            for (int i = 0; i < n; i++) r[i] = s[i] = x[i];              \
+            call_k; call_ref;                                           \
+            failures += simd_compare(op, level, n, r, s, n);
+
+            SIMD_TEST_OP("add", k->add(r, y, n), ref->add(s, y, n))
+            SIMD_TEST_OP("sub", k->sub(r, y, n), ref->sub(s, y, n))
+            SIMD_TEST_OP("hadamard", k->hadamard(r, y, n), ref->hadamard(s, y, n))
+            SIMD_TEST_OP("scale", k->scale(r, 1.7f, n), ref->scale(s, 1.7f, n))
+            SIMD_TEST_OP("axpy", k->axpy(r, -0.3f, y, n), ref->axpy(s, -0.3f, y, n))
+            SIMD_TEST_OP("sigmoid", k->sigmoid(r, z, n), ref->sigmoid(s, z, n))
+#undef SIMD_TEST_OP
+
+            for (int i = 0; i < n; i++) r[i] = s[i] = x[i];
+            k->gemv_t(r, w, n, y, SIMD_TEST_ROWS, n);
+            ref->gemv_t(s, w, n, y, SIMD_TEST_ROWS, n);
+            failures += simd_compare("gemv_t", level, n, r, s, n);
+
+            r[0] = k->dot(x, y, n);
+            s[0] = ref->dot(x, y, n);
+            failures += simd_compare("dot", level, n, r, s, 1);
+            failures += simd_test_update(k, ref, level, x, y, n);
+
+            r[0] = k->dot_i8(q8, y, n);
+            s[0] = ref->dot_i8(q8, y, n);
+            r[1] = k->dot_f16(q16, y, n);
+            s[1] = ref->dot_f16(q16, y, n);
+            r[2] = k->dot_bf16(q16, y, n);
+            s[2] = ref->dot_bf16(q16, y, n);
+            failures += simd_compare("quantized dot", level, n, r, s, 3);
+        }
+        
+        failures += simd_test_philox(k, ref, level);
+        failures += simd_test_transpose(k, level, w);        
+        failures += simd_test_gemm(k, level);
+    }
+
+    return failures;
+}
@@ -0,0 +1,66 @@
+#ifndef NERV_SIMD_H
+#define NERV_SIMD_H
+
+/*********************************************
+ *  internal table of vectorized float kernels
+ * ******************************************/
+
+/* Coefficients of one optimizer step, folded by optimizer.c so the update
+kernel only multiplies and adds. x = scale * g + l2 * p is the gradient
+seen by the rule, shrink = 1 - rate * decay applies AdamW decay, and
+Adam divides by sqrt(correction * v) + epsilon with rate already holding
+the bias correction of m. */
+
+typedef struct {
+    int kind;
+    float rate, momentum, beta1, beta2, epsilon;
+    float l2, shrink, correction;
+} Update;
+
+/* sigmoid reads each element before writing it, so dst may equal src;
+nerv_activate relies on that to activate in place. */
+
+typedef struct {
+    int level;
+    void (*add)(float* dst, const float* src, int size);
+    void (*sub)(float* dst, const float* src, int size);
+    void (*hadamard)(float* dst, const float* src, int size);
+    void (*scale)(float* dst, float n, int size);
+    void (*axpy)(float* dst, float n, const float* src, int size);
+    float (*dot)(const float* a, const float* b, int size);
+    void (*gemv_t)(float* dst, const float* mat, int ldm, const float* x, int rows, int size);
+    void (*sigmoid)(float* dst, const float* src, int size);
+    int gemm_mr, gemm_nr;
+    void (*gemm)(int kc, const float* a, const float* b, float* c, int ldc, int mr, int nr);
+    void (*update)(const Update* u, float* p, float* m, float* v, const float* g, float scale, int size);
+    float (*dot_i8)(const signed char* w, const float* x, int size);
+    float (*dot_f16)(const unsigned short* w, const float* x, int size);
+    float (*dot_bf16)(const unsigned short* w, const float* x, int size);
+    void (*philox)(unsigned int* dst, unsigned long long key, unsigned long long stream, unsigned long long counter, int blocks);
+    int transpose_tile;
+    void (*transpose)(const float* src, int lds, float* dst, int ldd);
+} Kernels;
+
+extern Kernels nerv_kernels;
+
+/* Cephes style expf: exp(x) = 2^n * p(r) with n = round(x / ln2) and
+r = x - n * ln2 split in two constants for extra precision. Inputs are
+clamped to [EXP_MIN, EXP_MAX] so 2^n stays a normal float, as n = -127
+would build an exponent field of zero and flush the result to 0. Over
+that range the relative error of fast_exp stays under 8e-8 and
+fast_sigmoid is within 9e-8 absolute; below it fast_exp saturates at the
+smallest normal float. */
+
+#define EXP_MIN -87.33f
+#define EXP_MAX 88.0f
+#define EXP_LOG2E 1.44269504088896341f
+#define EXP_LN2_HI 0.693359375f
+#define EXP_LN2_LO -2.12194440e-4f
+#define EXP_P0 1.9875691500e-4f
+#define EXP_P1 1.3981999507e-3f
+#define EXP_P2 8.3334519073e-3f
+#define EXP_P3 4.1665795894e-2f
+#define EXP_P4 1.6666665459e-1f
+#define EXP_P5 5.0000001201e-1f
+
+#endif
@@ -0,0 +1,24 @@
+/* Clears the per instruction set names used by the kernel templates of
+simd.c so the next instruction set can define its own. */
+
+#undef W
+#undef V
+#undef VI
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ADD
+#undef V_SUB
+#undef V_MUL
+#undef V_DIV
+#undef V_SQRT
+#undef V_MIN
+#undef V_MAX
+#undef V_FMA
+#undef V_HSUM
+#undef V_ROUND
+#undef V_TOFLOAT
+#undef V_POW2
+#undef V_LOAD_I8
+#undef V_LOAD_F16
+#undef V_LOAD_BF16
@@ -0,0 +1,369 @@
+/*********************************************
+ *  compressed sparse rows and weight pruning
+ * ******************************************/
+
+#include <nerv.h>
+#include "sparse.h"
+#include "thread.h"
+#include "activation.h"
+#include "alloc.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+/* An SMat stores the nonzero entries of a matrix row by row: row y owns
+values and column indices in [offsets[y], offsets[y + 1]), columns in
+increasing order. offsets, indices and values share one allocation.
+
+A pruned Layer keeps its dense w, holding zeros outside the pattern, so
+parameters, batches, optimizers and files keep working unchanged, and
+carries the SMat s that the single sample forward and backward passes
+and model_update run on. Updates of the dense parameters are copied
+back into s by model_sparse_sync, which also clears any weight outside
+the pattern so pruned weights stay at zero.
+
+Until then a pruned layer costs its dense weights plus 8 bytes for each
+nonzero. model_compact releases the dense weights once training through
+model.params is done, leaving w with its shape and no data, so a layer
+pruned to sparsity p keeps 8 (1 - p) of the 4 bytes per weight it had.
+Compact models run model_forward, model_backwards, model_update,
+model_infer and model_prune on s alone; batches, optimizers, files and
+quantization need the dense weights and refuse them until model_densify
+rebuilds w. */
+
+static SMat smatrix_alloc(int rows, int columns, int nnz)
+{
+    SMat s;
+    s.rows = rows;
+    s.columns = columns;
+    s.nnz = nnz;
+    s.offsets = (int*)nerv_malloc(sizeof(int) * (rows + 1 + nnz) + sizeof(float) * nnz);
+    s.indices = s.offsets + rows + 1;
+    s.values = (float*)(s.indices + nnz);
+    return s;
+}
+
+SMat smatrix(const Mat* restrict mat, float threshold)
+{
+    int nnz = 0;
+    for (int i = 0; i < mat->rows * mat->columns; i++) {
+        nnz += fabsf(mat->data[i]) > threshold;
+    }
+
+    SMat s = smatrix_alloc(mat->rows, mat->columns, nnz);
+    int k = 0;
+    for (int y = 0; y < mat->rows; y++) {
+        const float* f = mat->data + (size_t)y * mat->columns;
+        s.offsets[y] = k;
+        for (int x = 0; x < mat->columns; x++) {
+            if (fabsf(f[x]) <= threshold) continue;
+            s.indices[k] = x;
+            s.values[k++] = f[x];
+        }
+    }
+    s.offsets[mat->rows] = k;
+    return s;
+}
+
+SMat smatrix_copy(const SMat* restrict mat)
+{
+    SMat s = smatrix_alloc(mat->rows, mat->columns, mat->nnz);
+    memcpy(s.offsets, mat->offsets, sizeof(int) * (mat->rows + 1 + mat->nnz) + sizeof(float) * mat->nnz);
+    return s;
+}
+
+Mat smatrix_dense(const SMat* restrict mat)
+{
+    Mat m = matrix(mat->rows, mat->columns);
+    for (int y = 0; y < mat->rows; y++) {
+        float* f = m.data + (size_t)y * mat->columns;
+        for (int k = mat->offsets[y]; k < mat->offsets[y + 1]; k++) {
+            f[mat->indices[k]] = mat->values[k];
+        }
+    }
+    return m;
+}
+
+void smatrix_free(SMat* mat)
+{
+    nerv_free(mat->offsets);
+    memset(mat, 0, sizeof(SMat));
+}
+
+/*------------------------------------------*/
+
+/*       SPARSE MATRIX VECTOR PRODUCTS      */
+
+/*------------------------------------------*/
+
+typedef struct {
+    const Vec* z, *a;
+    const SMat* mat;
+    const Vec* vec, *bias;
+    int activation;
+} Sparse;
+
+static void vector_sparse_rows(void* arg, int begin, int end)
+{
+    const Sparse* op = (const Sparse*)arg;
+    const SMat* s = op->mat;
+    float* z = op->z->data, *x = op->vec->data;
+
+    for (int y = begin; y < end; y++) {
+        float sum = op->bias ? op->bias->data[y] : 0.0f;
+        for (int k = s->offsets[y]; k < s->offsets[y + 1]; k++) {
+            sum += s->values[k] * x[s->indices[k]];
+        }
+        z[y] = sum;
+    }
+
+    if (op->bias && op->activation != NERV_ACTIVATION_SOFTMAX) {
+        nerv_activate(op->activation, op->a->data + begin, z + begin, 1, end - begin);
+    }
+}
+
+/* The transposed product scatters every row into d. Each task owns a
+range of columns and finds where it starts in every row by binary
+search, so tasks never write the same element. */
+
+static int smatrix_row_find(const SMat* s, int y, int column)
+{
+    int lo = s->offsets[y], hi = s->offsets[y + 1];
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (s->indices[mid] < column) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static void vector_sparse_columns(void* arg, int begin, int end)
+{
+    const Sparse* op = (const Sparse*)arg;
+    const SMat* s = op->mat;
+    float* d = op->z->data, *x = op->vec->data;
+
+    memset(d + begin, 0, (end - begin) * sizeof(float));
+    for (int y = 0; y < s->rows; y++) {
+        int k = begin ? smatrix_row_find(s, y, begin) : s->offsets[y];
+        for (int last = s->offsets[y + 1]; k < last && s->indices[k] < end; k++) {
+            d[s->indices[k]] += s->values[k] * x[y];
+        }
+    }
+
+    if (op->a && op->activation != NERV_ACTIVATION_SOFTMAX) {
+        nerv_activate_deriv(op->activation, d + begin, op->a->data + begin, 1, end - begin);
+    }
+}
+
+void vector_by_smatrix_into(const Vec* restrict dst, const SMat* restrict mat, const Vec* restrict vec)
+{
+    if (vec->size != mat->columns || dst->size != mat->rows) {
+        printf("Vector By Sparse Matrix: Vector size must be equal to matrix columns\n");
+        return;
+    }
+
+    Sparse op = {dst, dst, mat, vec, NULL, 0};
+    nerv_parallel(mat->rows, (size_t)mat->nnz, vector_sparse_rows, &op);
+}
+
+void vector_by_smatrix_transposed_into(const Vec* restrict dst, const SMat* restrict mat, const Vec* restrict vec)
+{
+    if (vec->size != mat->rows || dst->size != mat->columns) {
+        printf("Vector By Sparse Matrix Transposed: Vector size must be equal to matrix rows\n");
+        return;
+    }
+
+    Sparse op = {dst, NULL, mat, vec, NULL, 0};
+    nerv_parallel(mat->columns, (size_t)mat->nnz, vector_sparse_columns, &op);
+}
+
+void vector_sparse_into(const Vec* z, const Vec* a, const SMat* restrict mat, const Vec* restrict vec, const Vec* restrict bias, int activation)
+{
+    if (vec->size != mat->columns || z->size != mat->rows || a->size != mat->rows || bias->size != mat->rows) {
+        printf("Sparse: Vector size must be equal to matrix columns and outputs to matrix rows\n");
+        return;
+    }
+
+    Sparse op = {z, a, mat, vec, bias, activation};
+    nerv_parallel(mat->rows, (size_t)mat->nnz, vector_sparse_rows, &op);
+    if (activation == NERV_ACTIVATION_SOFTMAX) {
+        nerv_activate(activation, a->data, z->data, 1, z->size);
+    }
+}
+
+void vector_sparse_deriv_into(const Vec* restrict d, const SMat* restrict mat, const Vec* restrict vec, const Vec* restrict a, int activation)
+{
+    if (vec->size != mat->rows || d->size != mat->columns || a->size != mat->columns) {
+        printf("Sparse Backwards: Vector size must be equal to matrix rows and outputs to matrix columns\n");
+        return;
+    }
+
+    Sparse op = {d, a, mat, vec, NULL, activation};
+    nerv_parallel(mat->columns, (size_t)mat->nnz, vector_sparse_columns, &op);
+    if (activation == NERV_ACTIVATION_SOFTMAX) {
+        nerv_activate_deriv(activation, d->data, a->data, 1, d->size);
+    }
+}
+
+/*------------------------------------------*/
+
+/*           MAGNITUDE PRUNING              */
+
+/*------------------------------------------*/
+
+/* Quickselect of the k-th smallest value, reordering f. */
+
+static float select_kth(float* f, int n, int k)
+{
+    int lo = 0, hi = n - 1;
+    while (lo < hi) {
+        float pivot = f[(lo + hi) / 2];
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (f[i] < pivot) i++;
+            while (f[j] > pivot) j--;
+            if (i <= j) {
+                float t = f[i];
+                f[i++] = f[j];
+                f[j--] = t;
+            }
+        }
+        if (k <= j) hi = j;
+        else if (k >= i) lo = i;
+        else break;
+    }
+    return f[k];
+}
+
+/* A compact layer is pruned again from its SMat: the dense weights are
+rebuilt for the selection and released once the new pattern is taken. */
+
+float layer_prune(Layer* layer, float sparsity)
+{
+    int n = layer->w.rows * layer->w.columns;
+    if (!n) return 0.0f;
+
+    int compact = !layer->w.data;
+    if (compact) {
+        int arena = nerv_arena_suspend();
+        layer->w = smatrix_dense(&layer->s);
+        nerv_arena_resume(arena);
+    }
+    if (layer->s.offsets) smatrix_free(&layer->s);
+
+    int k = (int)(sparsity * (float)n);
+    float threshold = -1.0f;
+    if (k > 0) {
+        float* f = (float*)nerv_malloc(sizeof(float) * n);
+        for (int i = 0; i < n; i++) {
+            f[i] = fabsf(layer->w.data[i]);
+        }
+        threshold = select_kth(f, n, (k < n ? k : n) - 1);
+        nerv_free(f);
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (fabsf(layer->w.data[i]) <= threshold) layer->w.data[i] = 0.0f;
+    }
+
+    layer->s = smatrix(&layer->w, 0.0f);
+    if (compact) {
+        matrix_free(&layer->w);
+        layer->w.data = NULL;
+    }
+    return threshold;
+}
+
+float model_prune(const Model* restrict model, float sparsity)
+{
+    int nnz = 0, total = 0;
+    for (int i = 0; i < model->layer_count - 1; i++) {
+        Layer* layer = model->layers + i;
+        layer_prune(layer, sparsity);
+        nnz += layer->s.nnz;
+        total += layer->w.rows * layer->w.columns;
+    }
+    return total ? 1.0f - (float)nnz / (float)total : 0.0f;
+}
+
+void model_densify(const Model* restrict model)
+{
+    for (int i = 0; i < model->layer_count; i++) {
+        Layer* layer = model->layers + i;
+        if (!layer->s.offsets) continue;
+        if (!layer->w.data) {
+            int arena = nerv_arena_suspend();
+            layer->w = smatrix_dense(&layer->s);
+            nerv_arena_resume(arena);
+        }
+        smatrix_free(&layer->s);
+    }
+}
+
+/* The dense weights of an arena model cannot be released one by one, so
+the model is moved to per layer ownership first, which also drops a
+mapped file. */
+
+void model_compact(Model* model)
+{
+    if (model->arena) {
+        Model ret = model_new(model->layer_count);
+        int arena = nerv_arena_suspend();
+        for (int i = 0; i < model->layer_count; i++) {
+            Layer* layer = ret.layers + i, *l = model->layers + i;
+            layer->activation = l->activation;
+            layer->a = vector_copy(&l->a);
+            layer->b = vector_copy(&l->b);
+            layer->z = vector_copy(&l->z);
+            layer->d = vector_copy(&l->d);
+            layer->s = l->s;
+            layer->w = l->w;
+            layer->w.data = NULL;
+            if (l->w.data && !l->s.offsets) layer->w = matrix_copy(&l->w);
+            memset(&l->s, 0, sizeof(SMat));
+        }
+        nerv_arena_resume(arena);
+
+        model_free(model);
+        *model = ret;
+        return;
+    }
+
+    for (int i = 0; i < model->layer_count; i++) {
+        Layer* layer = model->layers + i;
+        if (!layer->s.offsets || !layer->w.data) continue;
+        matrix_free(&layer->w);
+        layer->w.data = NULL;
+    }
+}
+
+int model_compacted(const Model* restrict model)
+{
+    for (int i = 0; i < model->layer_count; i++) {
+        const Layer* layer = model->layers + i;
+        if (layer->w.rows && !layer->w.data) return 1;
+    }
+    return 0;
+}
+
+void model_sparse_sync(const Model* restrict model)
+{
+    for (int i = 0; i < model->layer_count; i++) {
+        Layer* layer = model->layers + i;
+        SMat* s = &layer->s;
+        if (!s->offsets || !layer->w.data) continue;
+
+        for (int y = 0; y < s->rows; y++) {
+            float* f = layer->w.data + (size_t)y * s->columns;
+            int x = 0;
+            for (int k = s->offsets[y]; k < s->offsets[y + 1]; k++) {
+                int column = s->indices[k];
+                if (column > x) memset(f + x, 0, (column - x) * sizeof(float));
+                s->values[k] = f[column];
+                x = column + 1;
+            }
+            if (s->columns > x) memset(f + x, 0, (s->columns - x) * sizeof(float));
+        }
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef NERV_SPARSE_H
+#define NERV_SPARSE_H
+
+/*********************************************
+ *  internal upkeep of pruned layer patterns
+ * ******************************************/
+
+/* Copies the dense weights of every pruned layer into its sparse values
+and zeroes the weights outside its pattern. Called after any update that
+goes through the dense parameters. */
+
+void model_sparse_sync(const Model* model);
+
+/* Whether model_compact released the dense weights of any layer. */
+
+int model_compacted(const Model* model);
+
+#endif
@@ -0,0 +1,178 @@
+
+/*********************************************
+ *    persistent thread pool for kernels
+ * ******************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <nerv.h>
+#include "thread.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#define NERV_MAX_THREADS 256
+#define NERV_PARALLEL_THRESHOLD (1 << 16)
+
+typedef struct {
+    void (*task)(void*, int, int);
+    void* arg;
+    int count, chunks;
+} Job;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static pthread_t pool_workers[NERV_MAX_THREADS];
+
+static int pool_threads = 1, pool_quit = 0, pool_pending = 0, pool_busy = 0;
+static unsigned int pool_generation = 0;
+static size_t pool_threshold = NERV_PARALLEL_THRESHOLD;
+static Job pool_job;
+
+static void job_run(const Job* job, int chunk)
+{
+    int begin = (int)((long)job->count * chunk / job->chunks);
+    int end = (int)((long)job->count * (chunk + 1) / job->chunks);
+    if (begin < end) job->task(job->arg, begin, end);
+}
+
+static void* pool_worker(void* arg)
+{
+    int chunk = (int)(intptr_t)arg;
+    unsigned int seen = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    while (1) {
+        while (seen == pool_generation && !pool_quit) {
+            pthread_cond_wait(&pool_wake, &pool_lock);
+        }
+        
+        if (pool_quit) break;
+        seen = pool_generation;
+        Job job = pool_job;
+        pthread_mutex_unlock(&pool_lock);
+
+        job_run(&job, chunk);
+        
+        pthread_mutex_lock(&pool_lock);
+        if (!--pool_pending) pthread_cond_signal(&pool_done);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+}
+
+static void pool_stop()
+{
+    pthread_mutex_lock(&pool_lock);
+    pool_quit = 1;
+    pthread_cond_broadcast(&pool_wake);
+    pthread_mutex_unlock(&pool_lock);
+
+    for (int i = 1; i < pool_threads; i++) {
+        pthread_join(pool_workers[i], NULL);
+    }
+
+    pool_quit = 0;
+    pool_threads = 1;
+}
+
+void nerv_set_threads(int count)
+{
+    if (count <= 0) count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (count <= 0) count = 1;
+    if (count > NERV_MAX_THREADS) count = NERV_MAX_THREADS;
+
+    pool_stop();
+    pool_generation = 0;
+
+    for (int i = 1; i < count; i++) {
+        if (pthread_create(pool_workers + i, NULL, pool_worker, (void*)(intptr_t)i)) break;
+        pool_threads++;
+    }
+}
+
+int nerv_get_threads()
+{
+    return pool_threads;
+}
+
+void nerv_set_parallel_threshold(size_t work)
+{
+    pool_threshold = work;
+}
+
+void nerv_parallel(int count, size_t work, void (*task)(void*, int, int), void* arg)
+{
+    if (pool_threads < 2 || count < 2 || work < pool_threshold || 
+        __sync_lock_test_and_set(&pool_busy, 1)) {
+        task(arg, 0, count);
+        return;
+    }
+
+    Job job = {task, arg, count, pool_threads};
+    
+    pthread_mutex_lock(&pool_lock);
+    pool_job = job;
+    pool_pending = pool_threads - 1;
+    pool_generation++;
+    pthread_cond_broadcast(&pool_wake);
+    pthread_mutex_unlock(&pool_lock);
+
+    job_run(&job, 0);
+
+    pthread_mutex_lock(&pool_lock);
+    while (pool_pending) {
+        pthread_cond_wait(&pool_done, &pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    
+    __sync_lock_release(&pool_busy);
+}
+
+/*------------------------------------------*/
+
+/*          PER THREAD SCRATCH MEMORY       */
+
+/*------------------------------------------*/
+
+typedef struct {
+    float* data[NERV_SCRATCH_SLOTS];
+    size_t size[NERV_SCRATCH_SLOTS];
+} Scratch;
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void scratch_release(void* ptr)
+{
+    Scratch* scratch = (Scratch*)ptr;
+    for (int i = 0; i < NERV_SCRATCH_SLOTS; i++) {
+        nerv_free(scratch->data[i]);
+    }
+    nerv_free(scratch);
+}
+
+static void scratch_init()
+{
+    pthread_key_create(&scratch_key, scratch_release);
+}
+
+float* nerv_scratch(int slot, size_t size)
+{
+    pthread_once(&scratch_once, scratch_init);
+    
+    Scratch* scratch = (Scratch*)pthread_getspecific(scratch_key);
+    if (!scratch) {
+        scratch = (Scratch*)nerv_calloc(1, sizeof(Scratch));
+        pthread_setspecific(scratch_key, scratch);
+    }
+
+    if (scratch->size[slot] < size) {
+        nerv_free(scratch->data[slot]);
+        scratch->data[slot] = (float*)nerv_malloc(size * sizeof(float));
+        scratch->size[slot] = size;
+    }
+
+    return scratch->data[slot];
+}
@@ -0,0 +1,26 @@
+#ifndef NERV_THREAD_H
+#define NERV_THREAD_H
+
+/*********************************************
+ *  internal parallel loop over the thread pool
+ * ******************************************/
+
+#include <stddef.h>
+
+/* Splits [0, count) into one contiguous range per pool thread and calls
+task(arg, begin, end) on each, the calling thread taking the first one.
+When work (multiply-adds or elements touched) is under the parallel
+threshold, the pool has a single thread or is already running a loop,
+the whole range runs serially on the caller. */
+
+void nerv_parallel(int count, size_t work, void (*task)(void*, int, int), void* arg);
+
+/* Per thread scratch buffer of at least size floats, grown on demand and
+released when the thread exits. slot selects one of NERV_SCRATCH_SLOTS
+independent buffers. */
+
+#define NERV_SCRATCH_SLOTS 2
+
+float* nerv_scratch(int slot, size_t size);
+
+#endif
@@ -0,0 +1,183 @@
+
+/*********************************************
+ *   data-parallel multithreaded SGD trainer
+ * ******************************************/
+
+#include <nerv.h>
+#include "thread.h"
+#include <stdio.h>
+#include <stdint.h>
+
+/* Every worker owns a Batch, so activations, deltas and gradients are
+private while the weights of the Model are shared. Workers run on the
+kernel thread pool, whose own loops fall back to serial inside them.
+
+NERV_TRAIN_SYNC splits each mini-batch across the workers, sums their
+gradients into the first worker in parallel over the flat gradient
+buffer and applies one averaged step.
+NERV_TRAIN_HOGWILD gives each worker a contiguous share of the epoch
+and lets it update the shared weights after every mini-batch of its
+own without any locking.
+
+With an Optimizer attached every step goes through it instead of plain
+SGD with alpha; hogwild workers then share its state as freely as they
+share the weights. */
+
+typedef struct {
+    Trainer* trainer;
+    const Model* model;
+    const Mat* inputs, *targets;
+    int begin, end;
+    float alpha;
+} TrainStep;
+
+static Mat matrix_rows(const Mat* m, int begin, int end)
+{
+    Mat ret = {end - begin, m->columns, m->data + begin * m->columns};
+    return ret;
+}
+
+static void trainer_update(Trainer* trainer, const Model* model, Batch* batch, float alpha)
+{
+    if (trainer->optimizer) model_optimize_batch(model, batch, trainer->optimizer);
+    else model_update_batch(model, batch, alpha);
+}
+
+static void trainer_sync_task(void* arg, int begin, int end)
+{
+    const TrainStep* step = (const TrainStep*)arg;
+    Trainer* trainer = step->trainer;
+    int rows = step->end - step->begin;
+    
+    for (int w = begin; w < end; w++) {
+        int r0 = step->begin + (int)((long)rows * w / trainer->threads);
+        int r1 = step->begin + (int)((long)rows * (w + 1) / trainer->threads);
+        if (r0 == r1) continue;
+
+        Batch* batch = trainer->workers + w;
+        Mat x = matrix_rows(step->inputs, r0, r1), y = matrix_rows(step->targets, r0, r1);
+        model_forward_batch(step->model, batch, &x);
+        model_backwards_batch(step->model, batch, &y);
+        trainer->costs[w] += model_cost_batch(step->model, batch, &y);
+    }
+}
+
+static void trainer_hogwild_task(void* arg, int begin, int end)
+{
+    const TrainStep* step = (const TrainStep*)arg;
+    Trainer* trainer = step->trainer;
+    int rows = step->end - step->begin;
+
+    for (int w = begin; w < end; w++) {
+        int r0 = step->begin + (int)((long)rows * w / trainer->threads);
+        int r1 = step->begin + (int)((long)rows * (w + 1) / trainer->threads);
+        Batch* batch = trainer->workers + w;
+
+        for (int r = r0; r < r1; r += batch->size) {
+            int n = r1 - r < batch->size ? r1 - r : batch->size;
+            Mat x = matrix_rows(step->inputs, r, r + n), y = matrix_rows(step->targets, r, r + n);
+            model_forward_batch(step->model, batch, &x);
+            model_backwards_batch(step->model, batch, &y);
+            trainer->costs[w] += model_cost_batch(step->model, batch, &y);
+            trainer_update(trainer, step->model, batch, step->alpha);
+        }
+    }
+}
+
+static void trainer_reduce_task(void* arg, int begin, int end)
+{
+    Trainer* trainer = (Trainer*)arg;
+    Vec sum = {end - begin, trainer->workers->grads.data + begin};
+
+    for (int w = 1; w < trainer->threads; w++) {
+        Vec grads = {sum.size, trainer->workers[w].grads.data + begin};
+        vector_add(&sum, &grads);
+        vector_scale(&grads, 0.0f);
+    }
+}
+
+Trainer trainer_create(const Model* restrict model, int threads, int batch_size, int mode)
+{
+    Trainer trainer;
+    if (threads <= 0) threads = nerv_get_threads();
+    
+    trainer.mode = mode;
+    trainer.threads = threads;
+    trainer.batch_size = batch_size;
+    trainer.workers = (Batch*)nerv_malloc(sizeof(Batch) * threads);
+    trainer.costs = (float*)nerv_calloc(threads, sizeof(float));
+    trainer.optimizer = NULL;
+
+    int size = batch_size;
+    if (mode == NERV_TRAIN_SYNC) size = (batch_size + threads - 1) / threads;
+    
+    for (int i = 0; i < threads; i++) {
+        trainer.workers[i] = batch_create(model, size);
+        if (trainer.workers[i].layer_count) continue;
+
+        printf("Trainer: Could not create the batch of worker %d\n", i);
+        trainer.threads = i;
+        trainer_free(&trainer);
+        Trainer empty = {mode, 0, batch_size, NULL, NULL, NULL};
+        return empty;
+    }
+
+    return trainer;
+}
+
+void trainer_free(Trainer* trainer)
+{
+    for (int i = 0; i < trainer->threads; i++) {
+        batch_free(trainer->workers + i);
+    }
+    nerv_free(trainer->workers);
+    nerv_free(trainer->costs);
+}
+
+void trainer_optimizer(Trainer* trainer, Optimizer* optimizer)
+{
+    trainer->optimizer = optimizer;
+}
+
+float trainer_epoch(Trainer* restrict trainer, const Model* restrict model, const Mat* restrict inputs, const Mat* restrict targets, float alpha)
+{
+    if (!trainer->workers) {
+        printf("Trainer: Trainer has no workers, trainer_create failed\n");
+        return 0.0f;
+    }
+
+    if (inputs->rows != targets->rows) {
+        printf("Trainer: Input (%d) and target (%d) sample counts are not equal\n", inputs->rows, targets->rows);
+        return 0.0f;
+    }
+
+    for (int i = 0; i < trainer->threads; i++) {
+        trainer->costs[i] = 0.0f;
+    }
+
+    TrainStep step = {trainer, model, inputs, targets, 0, inputs->rows, alpha};
+    
+    if (trainer->mode == NERV_TRAIN_HOGWILD) {
+        nerv_parallel(trainer->threads, SIZE_MAX, trainer_hogwild_task, &step);
+    } else for (int r = 0; r < inputs->rows; r += trainer->batch_size) {
+        step.begin = r;
+        step.end = r + trainer->batch_size < inputs->rows ? r + trainer->batch_size : inputs->rows;
+        nerv_parallel(trainer->threads, SIZE_MAX, trainer_sync_task, &step);
+
+        Batch* sum = trainer->workers;
+        for (int w = 1; w < trainer->threads; w++) {
+            sum->count += trainer->workers[w].count;
+            trainer->workers[w].count = 0;
+        }
+
+        Vec* grads = &sum->grads;
+        nerv_parallel(grads->size, (size_t)grads->size * trainer->threads, trainer_reduce_task, trainer);
+        trainer_update(trainer, model, sum, alpha);
+    }
+
+    float cost = 0.0f;
+    for (int i = 0; i < trainer->threads; i++) {
+        cost += trainer->costs[i];
+    }
+    return cost;
+}
@@ -4,21 +4,32 @@
  * ******************************************/
 
 #include <nerv.h>
+#include "alloc.h"
 #include <stdarg.h>
-#include <stdlib.h>
 #include <string.h>
 
 Vec vector(int size)
 {
     Vec v = {
         v.size = size,
-        v.data = (float*)calloc(size, sizeof(float))
+        v.data = (float*)nerv_tensor_calloc(size, sizeof(float))
+    };  return v;
+}
+
+/* vector_empty leaves the data uninitialized for buffers that are
+written in full before they are read. */
+
+Vec vector_empty(int size)
+{
+    Vec v = {
+        v.size = size,
+        v.data = (float*)nerv_tensor_malloc(size * sizeof(float))
     };  return v;
 }
 
 Vec vector_create(int size, ...)
 {
-    Vec v = vector(size);
+    Vec v = vector_empty(size);
     float *f = v.data;
     
     va_list args;
@@ -34,7 +45,7 @@ Vec vector_create(int size, ...)
 
 Vec vector_uniform(int size, float val)
 {
-    Vec v = vector(size);
+    Vec v = vector_empty(size);
     float* f = v.data;
     
     for (float* end = f + v.size; f != end; f++) {
@@ -46,12 +57,12 @@ Vec vector_uniform(int size, float val)
 
 Vec vector_copy(const Vec* restrict src)
 {
-    Vec v = vector(src->size);
+    Vec v = vector_empty(src->size);
     memcpy(v.data, src->data, v.size * sizeof(float));
     return v;
 }
 
 void vector_free(Vec* vec)
 {
-    free(vec->data);
+    nerv_free(vec->data);
 }
\ No newline at end of file
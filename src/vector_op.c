@@ -4,6 +4,9 @@
  * ******************************************/
 
 #include <nerv.h>
+#include "simd.h"
+#include "thread.h"
+#include "activation.h"
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
@@ -15,10 +18,7 @@ void vector_add(const Vec* restrict dst, const Vec* restrict src)
         return;
     }
 
-    float* f = dst->data, *n = src->data;
-    for (float* end = f + dst->size; f != end; f++, n++) {
-        *f += *n;
-    }
+    nerv_kernels.add(dst->data, src->data, dst->size);
 }
 
 void vector_sub(const Vec* restrict dst, const Vec* restrict src)
@@ -28,10 +28,7 @@ void vector_sub(const Vec* restrict dst, const Vec* restrict src)
         return;
     }
     
-    float* f = dst->data, *n = src->data;
-    for (float* end = f + dst->size; f != end; f++, n++) {
-        *f -= *n;
-    }
+    nerv_kernels.sub(dst->data, src->data, dst->size);
 }
 
 void vector_hadamard(const Vec* restrict dst, const Vec* restrict src)
@@ -41,133 +38,334 @@ void vector_hadamard(const Vec* restrict dst, const Vec* restrict src)
         return;
     }
 
-    float* f = dst->data, *n = src->data;
-    for (float* end = f + dst->size; f != end; f++, n++) {
-        *f *= *n;
-    }
+    nerv_kernels.hadamard(dst->data, src->data, dst->size);
 }
 
 void vector_scale(const Vec* restrict v, float n)
 {
-    float *f = v->data;
-    for (float* end = f + v->size; f != end; f++) {
-        *f *= n;
+    nerv_kernels.scale(v->data, n, v->size);
+}
+
+typedef struct {
+    const Vec* dst;
+    const Mat* mat;
+    const Vec* vec;
+} VecByMat;
+
+static void vector_by_matrix_rows(void* arg, int begin, int end)
+{
+    const VecByMat* op = (const VecByMat*)arg;
+    int columns = op->mat->columns;
+    
+    float* f = op->dst->data + begin, *m = op->mat->data + begin * columns;
+    for (int y = begin; y < end; y++, f++, m += columns) {
+        *f = nerv_kernels.dot(m, op->vec->data, columns);
     }
 }
 
-Vec vector_by_matrix(const Mat* restrict mat, const Vec* restrict vec)
+void vector_by_matrix_into(const Vec* restrict dst, const Mat* restrict mat, const Vec* restrict vec)
 {
-    Vec ret = vector(mat->rows);
-    if (vec->size != mat->columns) {
+    if (vec->size != mat->columns || dst->size != mat->rows) {
         printf("Vector By Matrix: Vector size must be equal to matrix columns\n");
-        return ret;
+        return;
     }
 
-    float* f = ret.data, *m = mat->data;
-    for (int y = 0; y < mat->rows; y++, f++) {
-        float* n = vec->data;
-        for (int x = 0; x < mat->columns; x++, m++, n++) {
-            *f += (*m) * (*n);
-        }
+    VecByMat op = {dst, mat, vec};
+    nerv_parallel(mat->rows, (size_t)mat->rows * mat->columns, vector_by_matrix_rows, &op);
+}
+
+/* Transposed products d = mat^T * vec never transpose mat: each task owns
+a range of columns of d and accumulates vec[y] times row y of mat into
+it, four rows per pass of the gemv_t kernel. Columns go in blocks of
+GEMV_T_BLOCK so the block of d stays in L1 while every row of mat
+streams past once, the same traffic as the forward product. */
+
+#define GEMV_T_BLOCK 2048
+
+static void gemv_t_columns(float* restrict d, const Mat* restrict mat, const float* restrict vec, int begin, int end)
+{
+    memset(d + begin, 0, (end - begin) * sizeof(float));
+    for (int x = begin; x < end; x += GEMV_T_BLOCK) {
+        int n = end - x < GEMV_T_BLOCK ? end - x : GEMV_T_BLOCK;
+        nerv_kernels.gemv_t(d + x, mat->data + x, mat->columns, vec, mat->rows, n);
     }
+}
 
-    return ret;
+static void vector_by_matrix_transposed_columns(void* arg, int begin, int end)
+{
+    const VecByMat* op = (const VecByMat*)arg;
+    gemv_t_columns(op->dst->data, op->mat, op->vec->data, begin, end);
 }
 
-Vec vector_by_matrix_transposed(const Mat* restrict mat, const Vec* restrict vec)
+void vector_by_matrix_transposed_into(const Vec* restrict dst, const Mat* restrict mat, const Vec* restrict vec)
 {
-    Mat m;
-    memcpy(&m, mat, sizeof(Mat));
+    if (vec->size != mat->rows || dst->size != mat->columns) {
+        printf("Vector By Matrix Transposed: Vector size must be equal to matrix rows\n");
+        return;
+    }
 
-    m.columns = m.rows;
-    m.rows = mat->columns;
-    
-    return vector_by_matrix(&m, vec);
+    VecByMat op = {dst, mat, vec};
+    nerv_parallel(mat->columns, (size_t)mat->rows * mat->columns, vector_by_matrix_transposed_columns, &op);
 }
 
-Vec vector_relu(const Vec* restrict v)
+/* Fused dense layer kernels. The forward one writes z = mat * vec + bias
+and a = f(z) for a chunk of rows while the chunk is still in cache.
+The backward one computes d = mat^T * vec over a chunk of columns as
+above, then scales it by f'(a) in place, so no intermediate vector is
+allocated. Softmax needs the whole row, so it runs once after the
+parallel loop. */
+
+typedef struct {
+    const Vec* z, *a;
+    const Mat* mat;
+    const Vec* vec, *bias;
+    int activation;
+} Dense;
+
+static void vector_dense_rows(void* arg, int begin, int end)
 {
-    Vec ret = vector(v->size);
+    const Dense* op = (const Dense*)arg;
+    int columns = op->mat->columns;
     
-    float* r = ret.data, *n = v->data;
-    for (float* end = r + ret.size; r != end; r++, n++) {
-        *r = _relu(*n);
+    float* z = op->z->data, *b = op->bias->data, *m = op->mat->data + begin * columns;
+    for (int y = begin; y < end; y++, m += columns) {
+        z[y] = nerv_kernels.dot(m, op->vec->data, columns) + b[y];
+    }
+    
+    if (op->activation != NERV_ACTIVATION_SOFTMAX) {
+        nerv_activate(op->activation, op->a->data + begin, z + begin, 1, end - begin);
+    }
+}
+
+void vector_dense_into(const Vec* z, const Vec* a, const Mat* restrict mat, const Vec* restrict vec, const Vec* restrict bias, int activation)
+{
+    if (vec->size != mat->columns || z->size != mat->rows || a->size != mat->rows || bias->size != mat->rows) {
+        printf("Dense: Vector size must be equal to matrix columns and outputs to matrix rows\n");
+        return;
+    }
+
+    Dense op = {z, a, mat, vec, bias, activation};
+    nerv_parallel(mat->rows, (size_t)mat->rows * mat->columns, vector_dense_rows, &op);
+    if (activation == NERV_ACTIVATION_SOFTMAX) {
+        nerv_activate(activation, a->data, z->data, 1, z->size);
     }
+}
 
+static void vector_dense_deriv_columns(void* arg, int begin, int end)
+{
+    const Dense* op = (const Dense*)arg;
+    gemv_t_columns(op->z->data, op->mat, op->vec->data, begin, end);
+
+    if (op->activation != NERV_ACTIVATION_SOFTMAX) {
+        nerv_activate_deriv(op->activation, op->z->data + begin, op->a->data + begin, 1, end - begin);
+    }
+}
+
+void vector_dense_deriv_into(const Vec* restrict d, const Mat* restrict mat, const Vec* restrict vec, const Vec* restrict a, int activation)
+{
+    if (vec->size != mat->rows || d->size != mat->columns || a->size != mat->columns) {
+        printf("Dense Backwards: Vector size must be equal to matrix rows and outputs to matrix columns\n");
+        return;
+    }
+
+    Dense op = {d, a, mat, vec, NULL, activation};
+    nerv_parallel(mat->columns, (size_t)mat->rows * mat->columns, vector_dense_deriv_columns, &op);
+    if (activation == NERV_ACTIVATION_SOFTMAX) {
+        nerv_activate_deriv(activation, d->data, a->data, 1, d->size);
+    }
+}
+
+/* The allocating functions below are the _into ones over a fresh
+vector_empty, since every element is written, zeroed first when the
+shapes do not match and the _into leaves it untouched. The element-wise
+activations below read each element before writing the same one, so
+they may take the source itself as dst to work in place; the matrix
+products above may not. */
+
+Vec vector_by_matrix(const Mat* restrict mat, const Vec* restrict vec)
+{
+    Vec ret = vector_empty(mat->rows);
+    if (vec->size != mat->columns) memset(ret.data, 0, sizeof(float) * mat->rows);
+    vector_by_matrix_into(&ret, mat, vec);
     return ret;
 }
 
-Vec vector_drelu(const Vec* restrict v)
+Vec vector_by_matrix_transposed(const Mat* restrict mat, const Vec* restrict vec)
+{
+    Vec ret = vector_empty(mat->columns);
+    if (vec->size != mat->rows) memset(ret.data, 0, sizeof(float) * mat->columns);
+    vector_by_matrix_transposed_into(&ret, mat, vec);
+    return ret;
+}
+
+void vector_relu_into(const Vec* dst, const Vec* v)
+{
+    if (dst->size != v->size) {
+        printf("ReLU: Vector A (%d) and B (%d) are not the same size\n", dst->size, v->size);
+        return;
+    }
+
+    nerv_activate(NERV_ACTIVATION_RELU, dst->data, v->data, 1, dst->size);
+}
+
+Vec vector_relu(const Vec* restrict v)
 {
-    Vec ret = vector(v->size);
-    float* r = ret.data, *n = v->data;
-    for (float* end = r + ret.size; r != end; r++, n++) {
+    Vec ret = vector_empty(v->size);
+    vector_relu_into(&ret, v);
+    return ret;
+}
+
+void vector_drelu_into(const Vec* dst, const Vec* v)
+{
+    if (dst->size != v->size) {
+        printf("ReLU Derivative: Vector A (%d) and B (%d) are not the same size\n", dst->size, v->size);
+        return;
+    }
+
+    float* r = dst->data, *n = v->data;
+    for (float* end = r + dst->size; r != end; r++, n++) {
         *r = _drelu(*n);
     }
+}
+
+Vec vector_drelu(const Vec* restrict v)
+{
+    Vec ret = vector_empty(v->size);
+    vector_drelu_into(&ret, v);
     return ret;
 }
 
-Vec vector_sigmoid(const Vec* restrict v)
+void vector_sigmoid_into(const Vec* dst, const Vec* v)
 {
-    Vec ret = vector(v->size);
-    float* r = ret.data, *n = v->data;
-    for (float* end = r + ret.size; r != end; r++, n++) {
-        *r = _sigmoid(*n);
+    if (dst->size != v->size) {
+        printf("Sigmoid: Vector A (%d) and B (%d) are not the same size\n", dst->size, v->size);
+        return;
     }
+
+    nerv_kernels.sigmoid(dst->data, v->data, dst->size);
+}
+
+Vec vector_sigmoid(const Vec* restrict v)
+{
+    Vec ret = vector_empty(v->size);
+    vector_sigmoid_into(&ret, v);
     return ret;
 }
 
-Vec vector_dsigmoid(const Vec* restrict v)
+void vector_dsigmoid_into(const Vec* dst, const Vec* v)
 {
-    Vec ret = vector(v->size);
-    float* r = ret.data, *n = v->data;
-    for (float* end = r + ret.size; r != end; r++, n++) {
-        *r = _dsigmoid(*n);
+    if (dst->size != v->size) {
+        printf("Sigmoid Derivative: Vector A (%d) and B (%d) are not the same size\n", dst->size, v->size);
+        return;
     }
+
+    nerv_kernels.sigmoid(dst->data, v->data, dst->size);
+    float* r = dst->data;
+    for (float* end = r + dst->size; r != end; r++) {
+        *r = _sigderiv(*r);
+    }
+}
+
+Vec vector_dsigmoid(const Vec* restrict v)
+{
+    Vec ret = vector_empty(v->size);
+    vector_dsigmoid_into(&ret, v);
     return ret;
 }
 
-Vec vector_sigderiv(const Vec* restrict v)
+void vector_sigderiv_into(const Vec* dst, const Vec* v)
 {
-    Vec ret = vector(v->size);
-    float* r = ret.data, *n = v->data;
-    for (float* end = r + ret.size; r != end; r++, n++) {
+    if (dst->size != v->size) {
+        printf("Sigmoid Derivative: Vector A (%d) and B (%d) are not the same size\n", dst->size, v->size);
+        return;
+    }
+
+    float* r = dst->data, *n = v->data;
+    for (float* end = r + dst->size; r != end; r++, n++) {
         *r = _sigderiv(*n);
     }
+}
+
+Vec vector_sigderiv(const Vec* restrict v)
+{
+    Vec ret = vector_empty(v->size);
+    vector_sigderiv_into(&ret, v);
     return ret;
 }
 
-Vec vector_leaky_relu(const Vec* restrict v, float leak)
+void vector_leaky_relu_into(const Vec* dst, const Vec* v, float leak)
 {
-    Vec ret = vector(v->size);
-    float* r = ret.data, *n = v->data;
-    for (float* end = r + ret.size; r != end; r++) {
-        *r = leaky_relu(*(n++), leak);
+    if (dst->size != v->size) {
+        printf("Leaky ReLU: Vector A (%d) and B (%d) are not the same size\n", dst->size, v->size);
+        return;
     }
+
+    float* r = dst->data, *n = v->data;
+    for (float* end = r + dst->size; r != end; r++, n++) {
+        *r = _leaky_relu(*n, leak);
+    }
+}
+
+Vec vector_leaky_relu(const Vec* restrict v, float leak)
+{
+    Vec ret = vector_empty(v->size);
+    vector_leaky_relu_into(&ret, v, leak);
     return ret;
 }
 
-Vec vector_dleaky_relu(const Vec* restrict v, float leak)
+void vector_dleaky_relu_into(const Vec* dst, const Vec* v, float leak)
 {
-    Vec ret = vector(v->size);
-    float* r = ret.data, *n = v->data;
-    for (float* end = r + ret.size; r != end; r++) {
-        *r = dleaky_relu(*(n++), leak);
+    if (dst->size != v->size) {
+        printf("Leaky ReLU Derivative: Vector A (%d) and B (%d) are not the same size\n", dst->size, v->size);
+        return;
     }
+
+    float* r = dst->data, *n = v->data;
+    for (float* end = r + dst->size; r != end; r++, n++) {
+        *r = _dleaky_relu(*n, leak);
+    }
+}
+
+Vec vector_dleaky_relu(const Vec* restrict v, float leak)
+{
+    Vec ret = vector_empty(v->size);
+    vector_dleaky_relu_into(&ret, v, leak);
     return ret;
 }
 
+void vector_softmax_into(const Vec* dst, const Vec* v)
+{
+    if (dst->size != v->size) {
+        printf("Softmax: Vector A (%d) and B (%d) are not the same size\n", dst->size, v->size);
+        return;
+    }
+
+    nerv_activate(NERV_ACTIVATION_SOFTMAX, dst->data, v->data, 1, dst->size);
+}
+
 Vec vector_softmax(const Vec* restrict v)
 {
-    float* n = v->data, total = 0.0f, *f;
-    for (float* end = n + v->size; n != end; n++) {
-        total += *n;
+    Vec ret = vector_empty(v->size);
+    vector_softmax_into(&ret, v);
+    return ret;
+}
+
+void vector_activate_into(const Vec* dst, const Vec* z, int activation)
+{
+    if (dst->size != z->size) {
+        printf("Activate: Vector A (%d) and B (%d) are not the same size\n", dst->size, z->size);
+        return;
     }
 
-    Vec ret = vector(v->size);
-    n = ret.data, f = v->data;
-    for (float* end = n + ret.size; n != end; n++) {
-        *n = *(f++) / total;
+    nerv_activate(activation, dst->data, z->data, 1, dst->size);
+}
+
+void vector_deriv_hadamard(const Vec* restrict d, const Vec* restrict a, int activation)
+{
+    if (d->size != a->size) {
+        printf("Derivative: Vector A (%d) and B (%d) are not the same size\n", d->size, a->size);
+        return;
     }
-    return ret;
-}
\ No newline at end of file
+
+    nerv_activate_deriv(activation, d->data, a->data, 1, d->size);
+}
@@ -0,0 +1,1122 @@
+
+/*********************************************
+ *       nerv behaviour and regression tests
+ * ******************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <nerv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* Usage: nerv_test
+
+Every check compares the library against a naive reference, a known
+answer or an invariant and reports failures on stderr, and the run fails
+if any check does, so make test stops on it. Kernels are checked at
+every SIMD level the machine supports and with one and several pool
+threads. Messages the library prints for the corrupt inputs it is fed on
+purpose are discarded. */
+
+#define TEST_FILE "nerv_test.model"
+#define TEST_DATA "nerv_test.ndat"
+
+static int checks = 0, failures = 0;
+
+#define CHECK(cond, ...) do {                                           \
+    checks++;                                                           \
+    if (!(cond)) {                                                      \
+        failures++;                                                     \
+        fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);            \
+        fprintf(stderr, __VA_ARGS__);                                   \
+        fprintf(stderr, "\n");                                          \
+    }                                                                   \
+} while (0)
+
+static int quiet(int fd)
+{
+    fflush(stdout);
+    if (fd >= 0) {
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+        return -1;
+    }
+
+    int saved = dup(STDOUT_FILENO), null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+    return saved;
+}
+
+static void fill(float* f, int size)
+{
+    for (int i = 0; i < size; i++) {
+        f[i] = (float)rand_norm() - 0.5f;
+    }
+}
+
+static float max_diff(const float* a, const float* b, int size)
+{
+    float e = 0.0f;
+    for (int i = 0; i < size; i++) {
+        e = fmaxf(e, fabsf(a[i] - b[i]));
+    }
+    return e;
+}
+
+/*------------------------------------------*/
+
+/*      ALLOCATION FREE SINGLE SAMPLES      */
+
+/*------------------------------------------*/
+
+static void test_alloc()
+{
+    static const int sizes[] = {12, 33, 17, 5};
+    Model model = model_build(4, sizes);
+    model_init(&model);
+    Context context = context_create(&model);
+    Vec input = vector(12), target = vector(5);
+    fill(input.data, 12);
+    fill(target.data, 5);
+    memcpy(model.layers->a.data, input.data, sizeof(float) * 12);
+
+    model_forward(&model);
+    model_backwards(&model, &target);
+    model_update(&model, 0.1f);
+    model_infer(&model, &context, &input);
+
+    size_t count = nerv_alloc_count();
+    for (int i = 0; i < 8; i++) {
+        model_forward(&model);
+        model_backwards(&model, &target);
+        model_update(&model, 0.1f);
+        model_infer(&model, &context, &input);
+    }
+    CHECK(nerv_alloc_count() == count, "single sample passes allocated %zu times", nerv_alloc_count() - count);
+
+    context_free(&context);
+    vector_free(&input);
+    vector_free(&target);
+    model_free(&model);
+}
+
+/*------------------------------------------*/
+
+/*              MATRIX KERNELS              */
+
+/*------------------------------------------*/
+
+static void naive_multiply(float* c, const float* a, const float* b, int m, int n, int k)
+{
+    for (int y = 0; y < m; y++) {
+        for (int x = 0; x < n; x++) {
+            double sum = 0.0;
+            for (int i = 0; i < k; i++) {
+                sum += (double)a[y * k + i] * b[i * n + x];
+            }
+            c[y * n + x] = (float)sum;
+        }
+    }
+}
+
+static void naive_transpose(float* dst, const float* src, int rows, int columns)
+{
+    for (int y = 0; y < rows; y++) {
+        for (int x = 0; x < columns; x++) {
+            dst[x * rows + y] = src[y * columns + x];
+        }
+    }
+}
+
+static void test_gemm(int m, int n, int k)
+{
+    Mat a = matrix(m, k), b = matrix(k, n), at = matrix(k, m), bt = matrix(n, k);
+    Mat c = matrix(m, n), ref = matrix(m, n);
+    fill(a.data, m * k);
+    fill(b.data, k * n);
+    naive_transpose(at.data, a.data, m, k);
+    naive_transpose(bt.data, b.data, k, n);
+    naive_multiply(ref.data, a.data, b.data, m, n, k);
+
+    float tolerance = 1e-5f * (float)k;
+    const char* name = nerv_simd_name();
+
+    for (int i = 0; i < m * n; i++) c.data[i] = 1e3f;
+    matrix_multiply_into(&c, &a, &b);
+    CHECK(max_diff(c.data, ref.data, m * n) < tolerance, "%s multiply_into %dx%dx%d", name, m, n, k);
+
+    for (int i = 0; i < m * n; i++) c.data[i] = -1e3f;
+    matrix_multiply_transposed_into(&c, &a, &bt);
+    CHECK(max_diff(c.data, ref.data, m * n) < tolerance, "%s multiply_transposed_into %dx%dx%d", name, m, n, k);
+
+    for (int i = 0; i < m * n; i++) c.data[i] = 7.0f;
+    matrix_transposed_multiply_into(&c, &at, &b);
+    CHECK(max_diff(c.data, ref.data, m * n) < tolerance, "%s transposed_multiply_into %dx%dx%d", name, m, n, k);
+
+    matrix_multiply_acc(&c, &a, &b);
+    for (int i = 0; i < m * n; i++) c.data[i] *= 0.5f;
+    CHECK(max_diff(c.data, ref.data, m * n) < tolerance, "%s multiply_acc %dx%dx%d", name, m, n, k);
+
+    matrix_free(&a);
+    matrix_free(&b);
+    matrix_free(&at);
+    matrix_free(&bt);
+    matrix_free(&c);
+    matrix_free(&ref);
+}
+
+static void test_transpose(int rows, int columns)
+{
+    Mat src = matrix(rows, columns), dst = matrix(columns, rows), ref = matrix(columns, rows);
+    fill(src.data, rows * columns);
+    naive_transpose(ref.data, src.data, rows, columns);
+
+    matrix_transpose_into(&dst, &src);
+    CHECK(!memcmp(dst.data, ref.data, sizeof(float) * rows * columns), "%s transpose_into %dx%d", nerv_simd_name(), rows, columns);
+
+    if (rows == columns) {
+        matrix_transpose_inplace(&src);
+        CHECK(!memcmp(src.data, ref.data, sizeof(float) * rows * columns), "%s transpose_inplace %dx%d", nerv_simd_name(), rows, columns);
+    }
+
+    matrix_free(&src);
+    matrix_free(&dst);
+    matrix_free(&ref);
+}
+
+/* Both GEMVs against the naive product: rows of mat times vec, and vec
+times mat for the transposed one, which runs in column blocks of 2048 and
+four rows per pass. */
+
+static void test_gemv(int rows, int columns)
+{
+    Mat mat = matrix(rows, columns);
+    Vec x = vector(columns), v = vector(rows), y = vector(rows), d = vector(columns);
+    Vec ry = vector(rows), rd = vector(columns);
+    fill(mat.data, rows * columns);
+    fill(x.data, columns);
+    fill(v.data, rows);
+    naive_multiply(ry.data, mat.data, x.data, rows, 1, columns);
+    naive_multiply(rd.data, v.data, mat.data, 1, columns, rows);
+
+    const char* name = nerv_simd_name();
+    vector_by_matrix_into(&y, &mat, &x);
+    CHECK(max_diff(y.data, ry.data, rows) < 1e-5f * (float)columns, "%s vector_by_matrix %dx%d", name, rows, columns);
+    for (int i = 0; i < columns; i++) d.data[i] = 1e3f;
+    vector_by_matrix_transposed_into(&d, &mat, &v);
+    CHECK(max_diff(d.data, rd.data, columns) < 1e-5f * (float)rows, "%s vector_by_matrix_transposed %dx%d", name, rows, columns);
+
+    matrix_free(&mat);
+    vector_free(&x);
+    vector_free(&v);
+    vector_free(&y);
+    vector_free(&d);
+    vector_free(&ry);
+    vector_free(&rd);
+}
+
+/* Allocating products of mismatched shapes print an error and must
+return zeros rather than whatever the fresh buffer held. */
+
+static void test_mismatch()
+{
+    Mat a = matrix(3, 4), b = matrix(5, 2);
+    Vec v = vector(7);
+    fill(a.data, 12);
+    fill(b.data, 10);
+    fill(v.data, 7);
+
+    int out = quiet(-1);
+    Mat c = matrix_multiply(&a, &b);
+    Vec x = vector_by_matrix(&a, &v), y = vector_by_matrix_transposed(&a, &v);
+    quiet(out);
+
+    int nonzero = 0;
+    for (int i = 0; i < 6; i++) nonzero += c.data[i] != 0.0f;
+    for (int i = 0; i < 3; i++) nonzero += x.data[i] != 0.0f;
+    for (int i = 0; i < 4; i++) nonzero += y.data[i] != 0.0f;
+    CHECK(!nonzero, "mismatched products returned %d nonzero elements", nonzero);
+
+    matrix_free(&a);
+    matrix_free(&b);
+    matrix_free(&c);
+    vector_free(&v);
+    vector_free(&x);
+    vector_free(&y);
+}
+
+static void test_kernels()
+{
+    static const int shapes[][3] = {{1, 1, 1}, {7, 13, 5}, {6, 16, 256}, {97, 130, 300}, {200, 33, 517}};
+    static const int gemvs[][2] = {{1, 1}, {5, 3}, {7, 2053}, {130, 300}, {33, 4100}};
+    static const int transposes[][2] = {{1, 1}, {3, 70}, {63, 63}, {64, 64}, {130, 130}, {129, 257}};
+    static const int threads[] = {1, 4};
+
+    int supported = nerv_simd_set(NERV_SIMD_AVX512);
+    CHECK(!nerv_simd_test(), "nerv_simd_test reports a kernel mismatch");
+
+    for (size_t t = 0; t < sizeof(threads) / sizeof(int); t++) {
+        nerv_set_threads(threads[t]);
+        for (int level = NERV_SIMD_SCALAR; level <= supported; level++) {
+            nerv_simd_set(level);
+            for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+                test_gemm(shapes[i][0], shapes[i][1], shapes[i][2]);
+            }
+            for (size_t i = 0; i < sizeof(gemvs) / sizeof(gemvs[0]); i++) {
+                test_gemv(gemvs[i][0], gemvs[i][1]);
+            }
+            for (size_t i = 0; i < sizeof(transposes) / sizeof(transposes[0]); i++) {
+                test_transpose(transposes[i][0], transposes[i][1]);
+            }
+        }
+    }
+
+    nerv_set_threads(1);
+    nerv_simd_set(supported);
+}
+
+/*------------------------------------------*/
+
+/*          PHILOX RANDOM STREAMS           */
+
+/*------------------------------------------*/
+
+/* Known answers of Philox4x32-10 from the Random123 distribution, with
+the counter as (counter, stream) and the key as the seed. */
+
+static void test_philox()
+{
+    static const struct {
+        unsigned long long seed, stream, counter;
+        unsigned int out[4];
+    } kat[] = {
+        {0ull, 0ull, 0ull, {0x6627e8d5u, 0xe169c58du, 0xbc57ac4cu, 0x9b00dbd8u}},
+        {~0ull, ~0ull, ~0ull, {0x408f276du, 0x41c83b0eu, 0xa20bc7c6u, 0x6d5451fdu}},
+        {0x299f31d0a4093822ull, 0x0370734413198a2eull, 0x85a308d3243f6a88ull,
+            {0xd16cfe09u, 0x94fdccebu, 0x5001e420u, 0x24126ea1u}}
+    };
+
+    int supported = nerv_simd_set(NERV_SIMD_AVX512);
+    for (int level = NERV_SIMD_SCALAR; level <= supported; level++) {
+        nerv_simd_set(level);
+        for (size_t i = 0; i < sizeof(kat) / sizeof(kat[0]); i++) {
+            Rng rng = rng_create(kat[i].seed, kat[i].stream);
+            rng.counter = kat[i].counter;
+            for (int j = 0; j < 4; j++) {
+                unsigned int n = rng_next(&rng);
+                CHECK(n == kat[i].out[j], "%s philox answer %zu word %d: %08x != %08x", nerv_simd_name(), i, j, n, kat[i].out[j]);
+            }
+        }
+    }
+    nerv_simd_set(supported);
+
+    /* A bulk fill must not depend on how the pool splits it. */
+
+    int count = 100003;
+    float* a = (float*)malloc(sizeof(float) * count), *b = (float*)malloc(sizeof(float) * count);
+    Rng rng = rng_create(42, 3);
+    rng_fill_gauss(&rng, a, count, 0.0f, 1.0f);
+    nerv_set_threads(4);
+    rng = rng_create(42, 3);
+    rng_fill_gauss(&rng, b, count, 0.0f, 1.0f);
+    nerv_set_threads(1);
+    CHECK(!memcmp(a, b, sizeof(float) * count), "rng_fill_gauss differs between 1 and 4 threads");
+
+    free(a);
+    free(b);
+}
+
+/*------------------------------------------*/
+
+/*          MODEL FILES AND LOADERS         */
+
+/*------------------------------------------*/
+
+static void write_file(const char* path, const void* data, size_t size)
+{
+    FILE* file = fopen(path, "wb");
+    fwrite(data, 1, size, file);
+    fclose(file);
+}
+
+static char* read_file(const char* path, size_t* size)
+{
+    FILE* file = fopen(path, "rb");
+    fseek(file, 0, SEEK_END);
+    *size = (size_t)ftell(file);
+    rewind(file);
+    char* data = (char*)malloc(*size);
+    *size = fread(data, 1, *size, file);
+    fclose(file);
+    return data;
+}
+
+static int same_model(const Model* a, const Model* b)
+{
+    if (!a->layers || !b->layers || a->layer_count != b->layer_count) return 0;
+    for (int i = 0; i < a->layer_count; i++) {
+        const Layer* x = a->layers + i, *y = b->layers + i;
+        if (x->a.size != y->a.size || x->activation != y->activation) return 0;
+        if (x->w.rows * x->w.columns != y->w.rows * y->w.columns) return 0;
+        if (memcmp(x->b.data, y->b.data, sizeof(float) * x->b.size)) return 0;
+        if (x->w.data && memcmp(x->w.data, y->w.data, sizeof(float) * x->w.rows * x->w.columns)) return 0;
+    }
+    return 1;
+}
+
+static void test_model_files()
+{
+    static const int sizes[] = {9, 31, 4};
+    Model model = model_build(3, sizes);
+    model_init(&model);
+    model_set_activation(&model, 2, NERV_ACTIVATION_SOFTMAX);
+
+    int out = quiet(-1);
+    model_save(TEST_FILE, &model);
+    Model loaded = model_load(TEST_FILE), mapped = model_map(TEST_FILE, 1);
+    quiet(out);
+    CHECK(same_model(&model, &loaded), "model_load does not round trip model_save");
+    CHECK(same_model(&model, &mapped), "model_map does not round trip model_save");
+    model_free(&loaded);
+    model_free(&mapped);
+
+    size_t size;
+    char* data = read_file(TEST_FILE, &size);
+    struct {
+        const char* name;
+        size_t size, offset;
+        char flip;
+    } corrupt[] = {
+        {"empty", 0, 0, 0},
+        {"truncated header", 20, 0, 0},
+        {"truncated params", size - 8, 0, 0},
+        {"bad magic", size, 0, 0x20},
+        {"flipped parameter", size, size - 4, 0x01}
+    };
+
+    out = quiet(-1);
+    for (size_t i = 0; i < sizeof(corrupt) / sizeof(corrupt[0]); i++) {
+        char saved = data[corrupt[i].offset];
+        data[corrupt[i].offset] ^= corrupt[i].flip;
+        write_file(TEST_FILE, data, corrupt[i].size);
+        data[corrupt[i].offset] = saved;
+
+        Model m = model_load(TEST_FILE), n = model_map(TEST_FILE, 1);
+        CHECK(!m.layers, "model_load accepted a file with a %s", corrupt[i].name);
+        CHECK(!n.layers, "model_map accepted a file with a %s", corrupt[i].name);
+        model_free(&m);
+        model_free(&n);
+    }
+
+    /* Negative layer sizes whose padded products wrap to the declared
+    parameter count, written over the saved header: layer_count at byte
+    12, params_offset at 16, params_size at 24 and the layers at 64. */
+
+    char forged[128 + 224 * sizeof(float)] = {0};
+    uint32_t count = 2;
+    uint64_t offset = 128, params = 224;
+    int32_t layers[] = {-16, 0, -16, 0};
+    memcpy(forged, data, 64);
+    memcpy(forged + 12, &count, sizeof(count));
+    memcpy(forged + 16, &offset, sizeof(offset));
+    memcpy(forged + 24, &params, sizeof(params));
+    memcpy(forged + 64, layers, sizeof(layers));
+    write_file(TEST_FILE, forged, sizeof(forged));
+
+    Model m = model_load(TEST_FILE), n = model_map(TEST_FILE, 0);
+    CHECK(!m.layers, "model_load accepted a file with negative layer sizes");
+    CHECK(!n.layers, "model_map accepted a file with negative layer sizes");
+    model_free(&m);
+    model_free(&n);
+
+    /* Legacy files are a layer count, the layer sizes and raw floats. */
+
+    int legacy[] = {3, 9, 31, 4};
+    write_file(TEST_FILE, legacy, sizeof(legacy));
+    m = model_load(TEST_FILE);
+    CHECK(!m.layers, "model_load accepted a legacy file without weights");
+    model_free(&m);
+
+    legacy[2] = -31;
+    write_file(TEST_FILE, legacy, sizeof(legacy));
+    m = model_load(TEST_FILE);
+    CHECK(!m.layers, "model_load accepted a legacy file with a negative layer size");
+    model_free(&m);
+
+    legacy[0] = 1 << 30;
+    write_file(TEST_FILE, legacy, sizeof(legacy));
+    m = model_load(TEST_FILE);
+    CHECK(!m.layers, "model_load accepted a legacy file with a huge layer count");
+    model_free(&m);
+    quiet(out);
+
+    remove(TEST_FILE);
+    free(data);
+    model_free(&model);
+}
+
+/*------------------------------------------*/
+
+/*            PROFILING COUNTERS            */
+
+/*------------------------------------------*/
+
+/* Only checked when the library is built with make PROFILE=1. */
+
+static void test_profile()
+{
+    if (!nerv_profile_enabled()) return;
+
+    enum { LAYERS = NERV_PROFILE_LAYERS + 44 };
+    int sizes[LAYERS];
+    for (int i = 0; i < LAYERS; i++) sizes[i] = 2;
+    Model model = model_build(LAYERS, sizes);
+    model_init(&model);
+
+    nerv_profile_reset();
+    model_forward(&model);
+    Profile first = nerv_profile_get(NERV_PROFILE_FORWARD, 0);
+    Profile last = nerv_profile_get(NERV_PROFILE_FORWARD, NERV_PROFILE_LAYERS - 1);
+    Profile overflow = nerv_profile_get(NERV_PROFILE_FORWARD, NERV_PROFILE_LAYERS);
+    Profile total = nerv_profile_get(NERV_PROFILE_FORWARD, -1);
+    CHECK(first.calls == 1 && last.calls == 1, "profiled layers were not counted once");
+    CHECK(overflow.calls == LAYERS - 1 - NERV_PROFILE_LAYERS, "overflow row counted %llu of %d layers",
+        overflow.calls, LAYERS - 1 - NERV_PROFILE_LAYERS);
+    CHECK(total.calls == LAYERS - 1, "phase total counted %llu of %d layers", total.calls, LAYERS - 1);
+
+    nerv_profile_reset();
+    model_free(&model);
+}
+
+/*------------------------------------------*/
+
+/*               MINI-BATCHES               */
+
+/*------------------------------------------*/
+
+/* A batch of 13 in room for 16 must give every sample the output of its
+own forward pass and sum the per-sample gradients of model_backwards. */
+
+static void test_batch()
+{
+    static const int sizes[] = {6, 11, 9, 4};
+    enum { SAMPLES = 13 };
+    Model model = model_build(4, sizes);
+    model_set_activation(&model, 2, NERV_ACTIVATION_RELU);
+    model_set_activation(&model, 3, NERV_ACTIVATION_SOFTMAX);
+    model_init(&model);
+
+    Mat inputs = matrix(SAMPLES, 6), targets = matrix(SAMPLES, 4);
+    fill(inputs.data, SAMPLES * 6);
+    fill(targets.data, SAMPLES * 4);
+
+    int count = model.layer_count, size = model_param_size(&model);
+    Vec grads = vector(size), outputs = vector(SAMPLES * 4);
+    Mat gw[count];
+    Vec gb[count];
+    model_bind_params(&model, grads.data, gw, gb);
+    for (int n = 0; n < SAMPLES; n++) {
+        Vec target = {4, targets.data + n * 4};
+        memcpy(model.layers->a.data, inputs.data + n * 6, sizeof(float) * 6);
+        model_forward(&model);
+        model_backwards(&model, &target);
+        memcpy(outputs.data + n * 4, model.layers[count - 1].a.data, sizeof(float) * 4);
+
+        for (int i = 0; i < count - 1; i++) {
+            const Layer* layer = model.layers + i, *next = layer + 1;
+            for (int y = 0; y < layer->w.rows; y++) {
+                gb[i + 1].data[y] += next->d.data[y];
+                for (int x = 0; x < layer->w.columns; x++) {
+                    gw[i].data[y * layer->w.columns + x] += next->d.data[y] * layer->a.data[x];
+                }
+            }
+        }
+    }
+
+    Batch batch = batch_create(&model, 16);
+    model_forward_batch(&model, &batch, &inputs);
+    model_backwards_batch(&model, &batch, &targets);
+    CHECK(batch.count == SAMPLES, "batch counted %d of %d samples", batch.count, SAMPLES);
+    CHECK(max_diff(batch.a[count - 1].data, outputs.data, SAMPLES * 4) < 1e-5f,
+        "batch outputs differ from single samples by %g", max_diff(batch.a[count - 1].data, outputs.data, SAMPLES * 4));
+    CHECK(max_diff(batch.grads.data, grads.data, size) < 1e-4f,
+        "batch gradients differ from the summed single samples by %g", max_diff(batch.grads.data, grads.data, size));
+
+    batch_free(&batch);
+    vector_free(&grads);
+    vector_free(&outputs);
+    matrix_free(&inputs);
+    matrix_free(&targets);
+    model_free(&model);
+}
+
+/*------------------------------------------*/
+
+/*          CONCURRENT INFERENCE            */
+
+/*------------------------------------------*/
+
+#define TEST_INFER_THREADS 4
+#define TEST_INFER_INPUTS 32
+
+typedef struct {
+    const Model* model;
+    const Mat* inputs, *outputs;
+    float error;
+} InferJob;
+
+static void* infer_thread(void* arg)
+{
+    InferJob* job = (InferJob*)arg;
+    Context context = context_create(job->model);
+    int columns = job->outputs->columns;
+    for (int repeat = 0; repeat < 20; repeat++) {
+        for (int n = 0; n < job->inputs->rows; n++) {
+            Vec input = {job->inputs->columns, job->inputs->data + n * job->inputs->columns};
+            const Vec* output = model_infer(job->model, &context, &input);
+            job->error = fmaxf(job->error, max_diff(output->data, job->outputs->data + n * columns, columns));
+        }
+    }
+    context_free(&context);
+    return NULL;
+}
+
+/* model_infer on contexts of their own, from several threads at once,
+must give what model_forward gives and leave the model untouched. */
+
+static void test_context()
+{
+    static const int sizes[] = {9, 20, 5};
+    Model model = model_build(3, sizes);
+    model_set_activation(&model, 1, NERV_ACTIVATION_LEAKY_RELU);
+    model_set_activation(&model, 2, NERV_ACTIVATION_SOFTMAX);
+    model_init(&model);
+
+    Mat inputs = matrix(TEST_INFER_INPUTS, 9), outputs = matrix(TEST_INFER_INPUTS, 5);
+    fill(inputs.data, TEST_INFER_INPUTS * 9);
+    for (int n = 0; n < TEST_INFER_INPUTS; n++) {
+        memcpy(model.layers->a.data, inputs.data + n * 9, sizeof(float) * 9);
+        model_forward(&model);
+        memcpy(outputs.data + n * 5, model.layers[2].a.data, sizeof(float) * 5);
+    }
+
+    float last[5];
+    memcpy(last, model.layers[2].a.data, sizeof(last));
+
+    pthread_t threads[TEST_INFER_THREADS];
+    InferJob jobs[TEST_INFER_THREADS];
+    nerv_set_threads(4);
+    for (int i = 0; i < TEST_INFER_THREADS; i++) {
+        InferJob job = {&model, &inputs, &outputs, 0.0f};
+        jobs[i] = job;
+        pthread_create(threads + i, NULL, infer_thread, jobs + i);
+    }
+    for (int i = 0; i < TEST_INFER_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        CHECK(jobs[i].error < 1e-6f, "model_infer on thread %d differs from model_forward by %g", i, jobs[i].error);
+    }
+    nerv_set_threads(1);
+
+    CHECK(!memcmp(last, model.layers[2].a.data, sizeof(last)), "model_infer wrote the activations of the model");
+
+    matrix_free(&inputs);
+    matrix_free(&outputs);
+    model_free(&model);
+}
+
+/*------------------------------------------*/
+
+/*            NUMERICAL GRADIENTS           */
+
+/*------------------------------------------*/
+
+#define GRADIENT_STEP 1e-3f
+
+static float cost_at(const Model* model, const Vec* input, const Vec* target)
+{
+    memcpy(model->layers->a.data, input->data, sizeof(float) * input->size);
+    model_forward(model);
+    return model_cost(model, target);
+}
+
+/* Largest gap between the gradient model_backwards leaves, d of layer
+i + 1 for its biases and d times a of layer i for the weights into it,
+and central differences of model_cost over every parameter, relative to
+the largest gradient. */
+
+static float gradient_error(const Model* model, const Vec* input, const Vec* target)
+{
+    int count = model->layer_count, size = model_param_size(model);
+    Vec grads = vector(size);
+    Mat gw[count];
+    Vec gb[count];
+    model_bind_params(model, grads.data, gw, gb);
+
+    cost_at(model, input, target);
+    model_backwards(model, target);
+    for (int i = 0; i < count - 1; i++) {
+        const Layer* layer = model->layers + i, *next = layer + 1;
+        memcpy(gb[i + 1].data, next->d.data, sizeof(float) * next->d.size);
+        for (int y = 0; y < layer->w.rows; y++) {
+            for (int x = 0; x < layer->w.columns; x++) {
+                gw[i].data[y * layer->w.columns + x] = next->d.data[y] * layer->a.data[x];
+            }
+        }
+    }
+
+    float error = 0.0f, scale = 0.0f;
+    for (int i = 0; i < size; i++) {
+        float* p = model->params.data + i, saved = *p;
+        *p = saved + GRADIENT_STEP;
+        float up = cost_at(model, input, target);
+        *p = saved - GRADIENT_STEP;
+        float down = cost_at(model, input, target);
+        *p = saved;
+
+        error = fmaxf(error, fabsf((up - down) / (2.0f * GRADIENT_STEP) - grads.data[i]));
+        scale = fmaxf(scale, fabsf(grads.data[i]));
+    }
+
+    vector_free(&grads);
+    return scale > 0.0f ? error / scale : error;
+}
+
+/* Draws an input that keeps every z at least 0.05 from the kink of the
+rectifiers at zero, so no difference step crosses it. */
+
+static void fill_smooth(const Model* model, const Vec* input, const Vec* target)
+{
+    for (int tries = 0; tries < 100; tries++) {
+        fill(input->data, input->size);
+        cost_at(model, input, target);
+
+        int smooth = 1;
+        for (int i = 1; i < model->layer_count; i++) {
+            const Vec* z = &model->layers[i].z;
+            for (int j = 0; j < z->size; j++) smooth &= fabsf(z->data[j]) >= 0.05f;
+        }
+        if (smooth) return;
+    }
+}
+
+/* The fused backward pass at every SIMD level, then every activation in
+the hidden layers against every one in the output layer. */
+
+static void test_gradients()
+{
+    static const int sizes[] = {5, 7, 6, 3};
+    Model model = model_build(4, sizes);
+    model_init(&model);
+    Vec input = vector(5), target = vector(3);
+    fill(input.data, 5);
+    fill(target.data, 3);
+
+    int supported = nerv_simd_set(NERV_SIMD_AVX512);
+    for (int level = NERV_SIMD_SCALAR; level <= supported; level++) {
+        nerv_simd_set(level);
+        float error = gradient_error(&model, &input, &target);
+        CHECK(error < 1e-2f, "%s backward pass is off the numerical gradient by %g", nerv_simd_name(), error);
+    }
+    nerv_simd_set(supported);
+
+    for (int hidden = 0; hidden < NERV_ACTIVATIONS; hidden++) {
+        for (int output = 0; output < NERV_ACTIVATIONS; output++) {
+            model_set_activation(&model, 1, hidden);
+            model_set_activation(&model, 2, hidden);
+            model_set_activation(&model, 3, output);
+            model_init(&model);
+            fill_smooth(&model, &input, &target);
+            float error = gradient_error(&model, &input, &target);
+            CHECK(error < 1e-2f, "activations %d and %d are off the numerical gradient by %g", hidden, output, error);
+        }
+    }
+
+    vector_free(&input);
+    vector_free(&target);
+    model_free(&model);
+}
+
+/*------------------------------------------*/
+
+/*          QUANTIZED INFERENCE             */
+
+/*------------------------------------------*/
+
+/* Every weight format at every SIMD level against the float model, with
+room for the rounding of each format on outputs of a softmax. */
+
+static void test_quant()
+{
+    static const int sizes[] = {32, 64, 10};
+    static const float tolerances[] = {1e-2f, 2e-4f, 3e-3f};
+    static const char* names[] = {"int8", "fp16", "bf16"};
+    enum { INPUTS = 64 };
+
+    Model model = model_build(3, sizes);
+    model_set_activation(&model, 2, NERV_ACTIVATION_SOFTMAX);
+    model_init(&model);
+    Mat inputs = matrix(INPUTS, 32);
+    fill(inputs.data, INPUTS * 32);
+    Context fc = context_create(&model);
+
+    size_t bytes[3];
+    int supported = nerv_simd_set(NERV_SIMD_AVX512);
+    for (int format = NERV_QUANT_INT8; format <= NERV_QUANT_BF16; format++) {
+        QModel qmodel = qmodel_create(&model, format);
+        Context qc = qmodel_context(&qmodel);
+        bytes[format] = qmodel_size(&qmodel);
+
+        for (int level = NERV_SIMD_SCALAR; level <= supported; level++) {
+            nerv_simd_set(level);
+            float error = 0.0f;
+            for (int n = 0; n < INPUTS; n++) {
+                Vec input = {32, inputs.data + n * 32};
+                const Vec* f = model_infer(&model, &fc, &input), *q = qmodel_infer(&qmodel, &qc, &input);
+                error = fmaxf(error, max_diff(f->data, q->data, 10));
+            }
+            CHECK(error < tolerances[format], "%s %s inference is off the float model by %g",
+                nerv_simd_name(), names[format], error);
+        }
+
+        context_free(&qc);
+        qmodel_free(&qmodel);
+    }
+    nerv_simd_set(supported);
+
+    size_t dense = sizeof(float) * (size_t)model_param_size(&model);
+    CHECK(bytes[NERV_QUANT_INT8] < bytes[NERV_QUANT_FP16] && bytes[NERV_QUANT_FP16] < dense,
+        "int8 and fp16 models take %zu and %zu bytes against %zu for the floats", bytes[NERV_QUANT_INT8], bytes[NERV_QUANT_FP16], dense);
+    CHECK(bytes[NERV_QUANT_BF16] == bytes[NERV_QUANT_FP16], "bf16 and fp16 models differ in size");
+
+    context_free(&fc);
+    matrix_free(&inputs);
+    model_free(&model);
+}
+
+/*------------------------------------------*/
+
+/*                OPTIMIZERS                */
+
+/*------------------------------------------*/
+
+#define TEST_SAMPLES 64
+
+static void test_optimizers()
+{
+    static const int sizes[] = {4, 16, 2};
+    static const float rates[NERV_OPTIMIZERS] = {2.0f, 0.5f, 0.5f, 0.05f, 0.05f, 0.02f};
+
+    Mat inputs = matrix(TEST_SAMPLES, 4), targets = matrix(TEST_SAMPLES, 2);
+    fill(inputs.data, TEST_SAMPLES * 4);
+    for (int i = 0; i < TEST_SAMPLES; i++) {
+        const float* x = inputs.data + i * 4;
+        targets.data[i * 2] = x[0] + x[1] > 0.0f ? 0.9f : 0.1f;
+        targets.data[i * 2 + 1] = x[2] * x[3] > 0.0f ? 0.9f : 0.1f;
+    }
+
+    for (int kind = 0; kind < NERV_OPTIMIZERS; kind++) {
+        rands(7);
+        Model model = model_build(3, sizes);
+        model_init(&model);
+        Batch batch = batch_create(&model, TEST_SAMPLES);
+        Optimizer optimizer = optimizer_create(&model, kind, rates[kind]);
+
+        model_forward_batch(&model, &batch, &inputs);
+        float before = model_cost_batch(&model, &batch, &targets);
+        for (int step = 0; step < 400; step++) {
+            model_forward_batch(&model, &batch, &inputs);
+            model_backwards_batch(&model, &batch, &targets);
+            model_optimize_batch(&model, &batch, &optimizer);
+        }
+        model_forward_batch(&model, &batch, &inputs);
+        float after = model_cost_batch(&model, &batch, &targets);
+        CHECK(after < 0.5f * before, "optimizer %d only lowered the cost from %g to %g", kind, before, after);
+
+        optimizer_free(&optimizer);
+        batch_free(&batch);
+        model_free(&model);
+    }
+
+    matrix_free(&inputs);
+    matrix_free(&targets);
+}
+
+/*------------------------------------------*/
+
+/*          DATA-PARALLEL TRAINER           */
+
+/*------------------------------------------*/
+
+static void test_trainer()
+{
+    static const int sizes[] = {4, 16, 2};
+    static const int modes[] = {NERV_TRAIN_SYNC, NERV_TRAIN_HOGWILD};
+
+    Mat inputs = matrix(TEST_SAMPLES, 4), targets = matrix(TEST_SAMPLES, 2);
+    fill(inputs.data, TEST_SAMPLES * 4);
+    for (int i = 0; i < TEST_SAMPLES; i++) {
+        const float* x = inputs.data + i * 4;
+        targets.data[i * 2] = x[0] + x[1] > 0.0f ? 0.9f : 0.1f;
+        targets.data[i * 2 + 1] = x[2] * x[3] > 0.0f ? 0.9f : 0.1f;
+    }
+
+    nerv_set_threads(4);
+    for (size_t i = 0; i < sizeof(modes) / sizeof(int); i++) {
+        rands(7);
+        Model model = model_build(3, sizes);
+        model_init(&model);
+        Trainer trainer = trainer_create(&model, 4, 16, modes[i]);
+
+        float before = trainer_epoch(&trainer, &model, &inputs, &targets, 1.0f), after = before;
+        for (int epoch = 0; epoch < 800; epoch++) {
+            after = trainer_epoch(&trainer, &model, &inputs, &targets, 1.0f);
+        }
+        CHECK(after < 0.5f * before, "trainer mode %d only lowered the cost from %g to %g", modes[i], before, after);
+
+        trainer_free(&trainer);
+        model_prune(&model, 0.5f);
+        model_compact(&model);
+
+        int out = quiet(-1);
+        trainer = trainer_create(&model, 4, 16, modes[i]);
+        float cost = trainer_epoch(&trainer, &model, &inputs, &targets, 1.0f);
+        quiet(out);
+        CHECK(!trainer.workers && cost == 0.0f, "trainer of a compact model ran an epoch");
+
+        trainer_free(&trainer);
+        model_free(&model);
+    }
+    nerv_set_threads(1);
+
+    matrix_free(&inputs);
+    matrix_free(&targets);
+}
+
+/*------------------------------------------*/
+
+/*              SPARSE WEIGHTS              */
+
+/*------------------------------------------*/
+
+static void forward(const Model* model, const float* input, float* output)
+{
+    const Layer* last = model->layers + model->layer_count - 1;
+    memcpy(model->layers->a.data, input, sizeof(float) * model->layers->a.size);
+    model_forward(model);
+    memcpy(output, last->a.data, sizeof(float) * last->a.size);
+}
+
+static void test_sparse()
+{
+    static const int sizes[] = {12, 40, 6};
+    float input[12], dense[6], sparse[6], kept[6];
+    fill(input, 12);
+
+    size_t live = nerv_alloc_stats().live_bytes;
+    Model model = model_build(3, sizes);
+    model_init(&model);
+    model_prune(&model, 0.5f);
+    model_free(&model);
+    CHECK(nerv_alloc_stats().live_bytes == live, "model_free of a pruned arena model leaked %zu bytes",
+        nerv_alloc_stats().live_bytes - live);
+
+    model = model_build(3, sizes);
+    model_init(&model);
+    Optimizer optimizer = optimizer_create(&model, NERV_OPTIMIZER_SGD, 0.1f);
+
+    float sparsity = model_prune(&model, 0.5f);
+    CHECK(fabsf(sparsity - 0.5f) < 0.01f, "model_prune reached sparsity %g instead of 0.5", sparsity);
+    forward(&model, input, sparse);
+    model_densify(&model);
+    CHECK(!model.layers->s.offsets, "model_densify kept the sparse weights");
+    forward(&model, input, dense);
+    CHECK(max_diff(sparse, dense, 6) < 1e-5f, "sparse forward differs from the dense one by %g", max_diff(sparse, dense, 6));
+
+    model_prune(&model, 0.5f);
+    model_compact(&model);
+    CHECK(!model.layers->w.data && !model.layers[1].w.data, "model_compact kept the dense weights");
+    forward(&model, input, sparse);
+    CHECK(max_diff(sparse, dense, 6) < 1e-5f, "compact forward differs from the dense one by %g", max_diff(sparse, dense, 6));
+
+    sparsity = model_prune(&model, 0.8f);
+    CHECK(fabsf(sparsity - 0.8f) < 0.01f, "model_prune of a compact model reached sparsity %g instead of 0.8", sparsity);
+    CHECK(!model.layers->w.data, "model_prune rebuilt the dense weights of a compact model");
+    forward(&model, input, kept);
+
+    int out = quiet(-1);
+    model_optimize(&model, &optimizer);
+    quiet(out);
+    forward(&model, input, sparse);
+    CHECK(!memcmp(sparse, kept, sizeof(kept)), "model_optimize changed a compact model");
+
+    model_densify(&model);
+    CHECK(model.layers->w.data && !model.layers->s.offsets, "model_densify did not rebuild the dense weights");
+    forward(&model, input, dense);
+    CHECK(max_diff(kept, dense, 6) < 1e-5f, "densified forward differs from the compact one by %g", max_diff(kept, dense, 6));
+
+    optimizer_free(&optimizer);
+    model_free(&model);
+}
+
+/*------------------------------------------*/
+
+/*            STREAMED DATASETS             */
+
+/*------------------------------------------*/
+
+static void test_dataset()
+{
+    Mat inputs = matrix(100, 3), targets = matrix(100, 2);
+    for (int i = 0; i < 100; i++) {
+        inputs.data[i * 3] = (float)i;
+        targets.data[i * 2] = (float)-i;
+    }
+    dataset_save(TEST_DATA, &inputs, &targets);
+
+    Dataset dataset = dataset_open(TEST_DATA, 8, 24, 1);
+    Mat x, y;
+    int seen[100] = {0}, rows = 0, n, paired = 1;
+    for (int epoch = 0; epoch < 2; epoch++) {
+        while ((n = dataset_next(&dataset, &x, &y)) > 0) {
+            for (int r = 0; r < n; r++) {
+                int i = (int)x.data[r * 3];
+                paired &= i >= 0 && i < 100 && y.data[r * 2] == (float)-i;
+                if (paired) seen[i]++;
+            }
+            rows += n;
+        }
+    }
+    CHECK(n == 0 && rows == 200 && paired, "dataset epochs returned %d rows ending with %d", rows, n);
+    for (int i = 0; i < 100; i++) {
+        CHECK(seen[i] == 2, "sample %d was returned %d times in two epochs", i, seen[i]);
+        if (seen[i] != 2) break;
+    }
+    dataset_close(&dataset);
+
+    int out = quiet(-1);
+    truncate(TEST_DATA, 64 + 50 * 20);
+    dataset = dataset_open(TEST_DATA, 8, 24, 0);
+    quiet(out);
+    CHECK(!dataset.stream, "dataset_open accepted a truncated file");
+
+    remove(TEST_DATA);
+    matrix_free(&inputs);
+    matrix_free(&targets);
+}
+
+/*------------------------------------------*/
+
+/*        LAZY EXPRESSION GRAPHS            */
+
+/*------------------------------------------*/
+
+/* Naive rows of x times the transpose of w, the product graph_by_matrix
+records. */
+
+static void naive_by_matrix(float* dst, const Mat* w, const Mat* x)
+{
+    for (int y = 0; y < x->rows; y++) {
+        for (int i = 0; i < w->rows; i++) {
+            double sum = 0.0;
+            for (int k = 0; k < w->columns; k++) {
+                sum += (double)x->data[y * x->columns + k] * w->data[i * w->columns + k];
+            }
+            dst[y * w->rows + i] = (float)sum;
+        }
+    }
+}
+
+static void test_graph()
+{
+    Mat x = matrix(5, 7), w = matrix(3, 7), b = matrix(5, 3), c = matrix(5, 3);
+    Mat dst = matrix(5, 3), ref = matrix(5, 3), layer = matrix(5, 3);
+    fill(x.data, 35);
+    fill(w.data, 21);
+    fill(b.data, 15);
+    fill(c.data, 15);
+    naive_by_matrix(ref.data, &w, &x);
+    for (int i = 0; i < 15; i++) {
+        layer.data[i] = sigmoid(sigmoid(ref.data[i] + b.data[i]) + c.data[i]);
+    }
+
+    Graph graph = graph_create();
+    int gx = graph_matrix(&graph, &x), gw = graph_matrix(&graph, &w);
+    int gb = graph_matrix(&graph, &b), gc = graph_matrix(&graph, &c);
+    int product = graph_by_matrix(&graph, gw, gx);
+    int inner = graph_activate(&graph, graph_add(&graph, product, gb), NERV_ACTIVATION_SIGMOID);
+    int root = graph_activate(&graph, graph_add(&graph, inner, gc), NERV_ACTIVATION_SIGMOID);
+
+    /* Products write their destination rather than add to it, so every
+    evaluation into a dirty destination gives the same result. */
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < 15; i++) dst.data[i] = 1e3f;
+        graph_eval_matrix(&graph, product, &dst);
+        CHECK(max_diff(dst.data, ref.data, 15) < 1e-5f, "graph batched product pass %d", pass);
+
+        for (int i = 0; i < 15; i++) dst.data[i] = -1e3f;
+        graph_eval_matrix(&graph, root, &dst);
+        CHECK(max_diff(dst.data, layer.data, 15) < 1e-5f, "graph fused layer pass %d", pass);
+    }
+
+    /* A destination that is also an input of the product. */
+
+    Mat square = matrix(7, 7), rows = matrix(5, 7), out = matrix(5, 7);
+    fill(square.data, 49);
+    fill(rows.data, 35);
+    naive_by_matrix(out.data, &square, &rows);
+    graph_clear(&graph);
+    graph_eval_matrix(&graph, graph_by_matrix(&graph, graph_matrix(&graph, &square), graph_matrix(&graph, &rows)), &rows);
+    CHECK(max_diff(rows.data, out.data, 35) < 1e-5f, "graph product into its own input");
+
+    Vec v = {7, x.data}, y = vector(3);
+    graph_clear(&graph);
+    for (int i = 0; i < 3; i++) y.data[i] = 1e3f;
+    graph_eval_vector(&graph, graph_by_matrix(&graph, graph_matrix(&graph, &w), graph_vector(&graph, &v)), &y);
+    CHECK(max_diff(y.data, ref.data, 3) < 1e-5f, "graph vector product");
+
+    graph_free(&graph);
+    vector_free(&y);
+    matrix_free(&square);
+    matrix_free(&rows);
+    matrix_free(&out);
+    matrix_free(&x);
+    matrix_free(&w);
+    matrix_free(&b);
+    matrix_free(&c);
+    matrix_free(&dst);
+    matrix_free(&ref);
+    matrix_free(&layer);
+}
+
+int main()
+{
+    rands(1);
+    nerv_set_threads(1);
+
+    test_alloc();
+    test_kernels();
+    test_mismatch();
+    test_philox();
+    test_model_files();
+    test_profile();
+    test_batch();
+    test_context();
+    test_gradients();
+    test_quant();
+    test_optimizers();
+    test_trainer();
+    test_sparse();
+    test_dataset();
+    test_graph();
+
+    fprintf(stderr, "nerv_test: %d of %d checks passed\n", checks - failures, checks);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}